@@ -1,10 +1,15 @@
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 
 #include "pine.h"
 #include "data.h"
 #include "hiredis/hiredis.h"
 #include "htmlgen.h"
+#include "astcodec.h"
+#include "outbuf.h"
+#include "lru.h"
+#include "threadpool.h"
 
 #define mysql_fatal(mysql) do {\
     uwsgi_log("(MYSQL)%s at [%s:%d]\n", mysql_error(mysql), __FILE__, __LINE__); \
@@ -41,20 +46,18 @@ static bool prefix(char* s, char* pattern, char** p_out) {
     }
 }
 
-static bool say_no() {
-    return false;
-}
-
 typedef struct {
     struct namugen_doc_itfc vtbl;
     ConnCtx *conn;
     char* docname_prefix;
-} NormalNamugenDocumentInterface;
+    Document *cur_doc; // borrowed. The document being rendered, so that it's not fetched twice
 
-struct namugen_hook_itfc todo_hook = {
-    .hook_fn_link = say_no,
-    .hook_fn_call = say_no
-};
+    // links of cur_doc and whether they exist, recorded for the render cache
+    int link_count;
+    sds *links;
+    bool *link_exists;
+    bool cacheable; // turns false once another document is involved by inclusion
+} NormalNamugenDocumentInterface;
 
 
 #include "escaper.inc"
@@ -73,41 +76,248 @@ static int ok_put_plain(PineRequest *req, sds html) {
     return PINE_OK;
 }
 
-static int ok_put_html(PineRequest *req, sds html) {
+static int start_html_response(PineRequest *req) {
     GUARD(pr_prepare(req, 200, NULL));
     GUARD(pr_add_content_type(req, "text/html; charset=utf-8"));
-    GUARD(pr_write(req, html, sdslen(html)));
     return PINE_OK;
 }
 
-static void nmdi_docs_exist(struct namugen_doc_itfc* x, int argc, char** docnames, bool* results) {
+static void nmdi_docs_exist(struct namugen_doc_itfc* x, const char *linking_doc_name, int argc, char** docnames, bool* results) {
     NormalNamugenDocumentInterface *nmdi = (NormalNamugenDocumentInterface *)x;
     documents_exist(nmdi->conn, argc, docnames, results);
+
+    // only the links of cur_doc itself, not of the documents it includes
+    if (!nmdi->links && nmdi->cur_doc && !strcmp(linking_doc_name, nmdi->cur_doc->name)) {
+        int idx;
+        nmdi->link_count = argc;
+        nmdi->links = calloc(argc, sizeof(sds));
+        nmdi->link_exists = calloc(argc, sizeof(bool));
+        for (idx = 0; idx < argc; idx++) {
+            nmdi->links[idx] = sdsnew(docnames[idx]);
+            nmdi->link_exists[idx] = results[idx];
+        }
+    }
+}
+
+// 0 or unset keeps parsing and rendering on the worker thread alone
+#define RENDER_THREADS_ENV "PINE_RENDER_THREADS"
+// NULL unless RENDER_THREADS_ENV is set
+static struct threadpool *render_pool = NULL;
+
+static struct namuast_container* load_ast(ConnCtx *ctx, Document *doc) {
+    struct namuast_container *ast;
+    RAII_SDS sds blob = find_document_ast_blob(ctx, doc);
+    if (blob && (ast = namuast_deserialize(doc->name, blob, sdslen(blob)))) {
+        return ast;
+    }
+
+    namugen_ctx namugen;
+    namugen_init_with_arena(&namugen, doc->name);
+    namugen_scan_parallel(&namugen, doc->source, sdslen(doc->source), render_pool);
+    ast = namugen_obtain_ast(&namugen);
+    namugen_remove(&namugen);
+
+    RAII_SDS sds serialized = namuast_serialize(ast, doc->name, sdsempty());
+    cache_document_ast_blob(ctx, doc, serialized, sdslen(serialized));
+    return ast;
+}
+
+/*
+ * Transclusion cache
+ * ASTs of included documents are kept in the worker by name, along with their revision,
+ * so that a template included many times on a page or across requests is not deserialized or parsed again.
+ * An entry of an older revision is a miss and gets replaced, which is how an edit invalidates it.
+ * The cache holds one reference of each AST, and renders take their own while using one.
+ */
+#define INCLUDED_AST_LRU_BUDGET (32 * 1024 * 1024)
+
+struct included_ast {
+    sds rev;
+    struct namuast_container *ast;
+};
+
+static void included_ast_free(void *value) {
+    struct included_ast *included = value;
+    sdsfree(included->rev);
+    RELEASE_NAMUAST(included->ast);
+    free(included);
+}
+
+static struct lru* get_included_ast_lru() {
+    static struct lru included_ast_lru;
+    static bool initialized = false;
+    if (!initialized) {
+        lru_init(&included_ast_lru, INCLUDED_AST_LRU_BUDGET, included_ast_free);
+        initialized = true;
+    }
+    return &included_ast_lru;
+}
+
+static struct namuast_container* load_included_ast(ConnCtx *ctx, Document *doc) {
+    struct lru *lru = get_included_ast_lru();
+    struct included_ast *included = lru_get(lru, doc->name);
+    if (included && !strcmp(included->rev, doc->rev)) {
+        OBTAIN_NAMUAST(included->ast);
+        return included->ast;
+    }
+
+    struct namuast_container *ast = load_ast(ctx, doc);
+    included = malloc(sizeof(struct included_ast));
+    included->rev = sdsdup(doc->rev);
+    included->ast = ast;
+    OBTAIN_NAMUAST(ast);
+    // sds strings of the nodes are not in the arena, and are taken to be about as long as the source
+    size_t size = sizeof(struct included_ast) + sdslen(doc->source);
+    if (NAMUAST_ARENA(ast))
+        size += NAMUAST_ARENA(ast)->total_size;
+    lru_put(lru, doc->name, included, size);
+    return ast;
+}
+
+static struct namuast_container* nmdi_get_ast(struct namugen_doc_itfc* x, const char *doc_name) {
+    NormalNamugenDocumentInterface *nmdi = (NormalNamugenDocumentInterface *)x;
+    if (nmdi->cur_doc && !strcmp(nmdi->cur_doc->name, doc_name)) {
+        return load_ast(nmdi->conn, nmdi->cur_doc);
+    }
+    nmdi->cacheable = false;
+
+    RAII_SDS sds docname = sdsnew(doc_name);
+    RAII_Document Document doc;
+    Document_init(&doc);
+    if (!find_document(nmdi->conn, docname, &doc)) {
+        return NULL;
+    }
+    return load_included_ast(nmdi->conn, &doc);
 }
 
 struct namugen_doc_itfc nmdi_vtbl = {
+    .get_ast = nmdi_get_ast,
     .documents_exist = nmdi_docs_exist,
     .doc_href = nmdi_doc_href
 };
 
-static sds render_page(ConnCtx *ctx, Document *doc, char *docname_prefix) {
+// Generated pages go out in chunks of this size while they are being rendered
+#define PAGE_FLUSH_THRESHOLD (64 * 1024)
+
+typedef struct {
+    htmlgen_sink base;
+    PineRequest *req;
+    bool headers_sent;
+    const bool *cacheable;
+    struct outbuf flushed; // kept for the rendered cache, as long as the page is cacheable
+} ResponseSink;
+
+static bool response_sink_flush(htmlgen_sink *base, struct outbuf *chunks) {
+    ResponseSink *sink = (ResponseSink *)base;
+    bool success = true;
+    if (!sink->headers_sent) {
+        if (start_html_response(sink->req))
+            success = false;
+        else
+            sink->headers_sent = true;
+    }
+    size_t idx;
+    for (idx = 0; success && idx < chunks->count; idx += IOV_MAX) {
+        size_t count = chunks->count - idx < IOV_MAX? chunks->count - idx : IOV_MAX;
+        success = !pr_writev(sink->req, chunks->iov + idx, count);
+    }
+
+    if (success && *sink->cacheable) {
+        outbuf_move(&sink->flushed, chunks);
+    } else {
+        // what has been kept is of no use once another document is involved or the page is cut short
+        outbuf_remove(&sink->flushed);
+        outbuf_remove(chunks);
+    }
+    return success;
+}
+
+static int render_page(PineRequest *req, ConnCtx *ctx, Document *doc, char *docname_prefix) {
     if (!docname_prefix)
         docname_prefix = "/wiki/page/";
     NormalNamugenDocumentInterface my_itfc = {
        .vtbl = nmdi_vtbl,
        .conn = ctx,
-       .docname_prefix = docname_prefix
+       .docname_prefix = docname_prefix,
+       .cur_doc = doc,
+       .link_count = 0,
+       .links = NULL,
+       .link_exists = NULL,
+       .cacheable = true
     };
+    ResponseSink sink = {
+        .base = {
+            .flush = response_sink_flush,
+            .threshold = PAGE_FLUSH_THRESHOLD,
+            .broken = false
+        },
+        .req = req,
+        .headers_sent = false,
+        .cacheable = &my_itfc.cacheable
+    };
+    outbuf_init(&sink.flushed);
+    RAII_RenderedDocument RenderedDocument rendered;
+    RenderedDocument_init(&rendered);
 
-    sds result = sdsnewlen(NULL, sdslen(doc->source) * 2);
-
+    RAII_SDS sds result;
+    bool from_cache;
+    struct htmlgen_link_counter link_counter_st = htmlgen_link_counter;
     clock_t clock_st = clock();
-    result = htmlgen_generate_directly(doc->name, doc->source, sdslen(doc->source), &todo_hook, &my_itfc.vtbl, result);
+    if ((from_cache = find_rendered_document(ctx, doc, HTMLGEN_RENDERER_VERSION, &rendered))) {
+        result = rendered.html;
+        rendered.html = NULL;
+    } else {
+        bool success;
+        result = htmlgen_generate_to_sink(doc->name, &my_itfc.vtbl, &sink.base, sdsempty(), &success);
+
+        if (success && my_itfc.cacheable && !sink.base.broken) {
+            rendered.name = sdsdup(doc->name);
+            rendered.rev = sdsdup(doc->rev);
+            rendered.renderer_version = HTMLGEN_RENDERER_VERSION;
+            // handed over to rendered
+            rendered.link_count = my_itfc.link_count;
+            rendered.links = my_itfc.links;
+            rendered.link_exists = my_itfc.link_exists;
+            my_itfc.links = NULL;
+            my_itfc.link_exists = NULL;
+            // compressed from the chunks as they are
+            outbuf_push_ref(&sink.flushed, result, sdslen(result));
+            cache_rendered_document(ctx, &rendered, sink.flushed.iov, (int)sink.flushed.count);
+        }
+    }
     clock_t clock_ed = clock();
     double ms = (((double) (clock_ed - clock_st)) / CLOCKS_PER_SEC) * 1000.;
 
-    result = sdscatprintf(result, "<p class='gen-ms'>generated in %.2lfms</p>", ms);
-    return result;
+    outbuf_remove(&sink.flushed);
+    if (my_itfc.links) {
+        int idx;
+        for (idx = 0; idx < my_itfc.link_count; idx++) {
+            sdsfree(my_itfc.links[idx]);
+        }
+        free(my_itfc.links);
+        free(my_itfc.link_exists);
+    }
+    if (sink.base.broken)
+        return PINE_OK;
+
+    RAII_SDS sds footer;
+    if (from_cache)
+        footer = sdscatprintf(sdsempty(), "<p class='gen-ms'>served from cache in %.2lfms</p>", ms);
+    else {
+        footer = sdscatprintf(sdsempty(), "<p class='gen-ms'>generated in %.2lfms</p>", ms);
+        uwsgi_log("Rendered %s in %.2lfms, %llu links to %llu documents\n", doc->name, ms,
+                  htmlgen_link_counter.links - link_counter_st.links,
+                  htmlgen_link_counter.unique_links - link_counter_st.unique_links);
+    }
+    // not appended to result, which may be a whole cached page
+    struct iovec tail[2] = {
+        {.iov_base = result, .iov_len = sdslen(result)},
+        {.iov_base = footer, .iov_len = sdslen(footer)}
+    };
+    if (!sink.headers_sent)
+        GUARD(start_html_response(req));
+    GUARD(pr_writev(req, tail, 2));
+    return PINE_OK;
 }
 
 #define RAW_PAGE_PREFIX "/wiki/raw/"
@@ -140,8 +350,7 @@ int pine_main(PineRequest *req) {
         if (!find_document(conn, docname, &doc)) {
             goto not_found;
         }
-        RAII_SDS sds page = render_page(conn, &doc, RENDERED_PAGE_PREFIX);
-        return ok_put_html(req, page);
+        return render_page(req, conn, &doc, RENDERED_PAGE_PREFIX);
     } else {
         goto not_found;
     }
@@ -163,10 +372,20 @@ static void uwsgi_coroutine_write_hook(redisContext *c) {
     uwsgi.wait_write_hook(c->fd, 0);
 }
 
+
 void pine_init(int async) {
     initmod_htmlgen();
     initmod_namugen();
 
+    char *render_threads = getenv(RENDER_THREADS_ENV);
+    if (render_threads && atoi(render_threads) > 0) {
+        render_pool = threadpool_new(atoi(render_threads));
+        if (render_pool) {
+            htmlgen_use_thread_pool(render_pool);
+            uwsgi_log("Parsing and rendering big documents on %d thread(s)\n", render_pool->thread_count);
+        }
+    }
+
     redisCoroutineReadHook = uwsgi_coroutine_read_hook;
     redisCoroutineWriteHook = uwsgi_coroutine_write_hook;
     uwsgi_log("**Starting Pine using %d async worker(s)**\n", async);
@@ -182,6 +401,7 @@ void* pine_init_data_per_core(int core_id) {
 
     conn->wait_read_hook = uwsgi.wait_read_hook;
     conn->wait_write_hook = uwsgi.wait_read_hook;
+    conn->lock_across_workers = true;
 
     conn->mysql = mysql_init(NULL);
     mysql_options(conn->mysql, MYSQL_OPT_NONBLOCK, 0);
@@ -203,5 +423,9 @@ void* pine_init_data_per_core(int core_id) {
         abort();
     }
     uwsgi_log("Connected to Redis!\n");
+    if (load_compression_dict(conn))
+        uwsgi_log("Loaded LZ4 dictionary for cached documents\n");
+    uwsgi_log("Building the name index...\n");
+    init_name_index(conn);
     return core_data;
 }
@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size; // usable bytes after the header
+    size_t used;
+};
+
+struct arena_release {
+    void (*release)(void *);
+    void *ptr;
+};
+
+#define CHUNK_HEADER_SIZE ALIGN_UP(sizeof(struct arena_chunk))
+#define CHUNK_DATA(chunk) ((char *)(chunk) + CHUNK_HEADER_SIZE)
+
+static struct arena_chunk* new_chunk(struct arena *arena, size_t size) {
+    struct arena_chunk *chunk = malloc(CHUNK_HEADER_SIZE + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->total_size += CHUNK_HEADER_SIZE + size;
+    return chunk;
+}
+
+struct arena* arena_new(size_t chunk_size) {
+    struct arena *arena = malloc(sizeof(struct arena));
+    arena->chunk_size = chunk_size > 0? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+    arena->total_size = 0;
+    arena->head = new_chunk(arena, arena->chunk_size);
+    arena->last_alloc = NULL;
+    arena->last_size = 0;
+    arena->releases = NULL;
+    arena->release_count = 0;
+    arena->release_capacity = 0;
+    arena->adopted = NULL;
+    arena->next_adopted = NULL;
+    return arena;
+}
+
+void* arena_alloc(struct arena *arena, size_t size) {
+    struct arena_chunk *head = arena->head;
+    size = ALIGN_UP(size > 0? size : 1);
+
+    if (head->used + size <= head->size) {
+        char *ptr = CHUNK_DATA(head) + head->used;
+        head->used += size;
+        arena->last_alloc = ptr;
+        arena->last_size = size;
+        return ptr;
+    }
+
+    if (size > arena->chunk_size / 4) {
+        // big ones get their own chunk behind the head, so the head keeps being carved
+        struct arena_chunk *big = new_chunk(arena, size);
+        big->used = size;
+        big->next = head->next;
+        head->next = big;
+        return CHUNK_DATA(big);
+    }
+
+    struct arena_chunk *chunk = new_chunk(arena, arena->chunk_size);
+    chunk->next = head;
+    arena->head = chunk;
+    chunk->used = size;
+    arena->last_alloc = CHUNK_DATA(chunk);
+    arena->last_size = size;
+    return CHUNK_DATA(chunk);
+}
+
+void* arena_calloc(struct arena *arena, size_t nmemb, size_t size) {
+    void *ptr = arena_alloc(arena, nmemb * size);
+    memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+void* arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr)
+        return arena_alloc(arena, new_size);
+    if (new_size <= old_size)
+        return ptr;
+
+    if (ptr == arena->last_alloc) {
+        // grow the most recent allocation in place if the head has room
+        struct arena_chunk *head = arena->head;
+        size_t grown = ALIGN_UP(new_size);
+        size_t offset = arena->last_alloc - CHUNK_DATA(head);
+        if (offset + grown <= head->size) {
+            head->used = offset + grown;
+            arena->last_size = grown;
+            return ptr;
+        }
+    }
+    void *new_ptr = arena_alloc(arena, new_size);
+    memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
+
+void arena_on_release(struct arena *arena, void (*release)(void *), void *ptr) {
+    if (arena->release_count == arena->release_capacity) {
+        arena->release_capacity = arena->release_capacity > 0? arena->release_capacity * 2 : 64;
+        arena->releases = realloc(arena->releases, sizeof(struct arena_release) * arena->release_capacity);
+    }
+    arena->releases[arena->release_count].release = release;
+    arena->releases[arena->release_count].ptr = ptr;
+    arena->release_count++;
+}
+
+static void run_releases(struct arena *arena) {
+    while (arena->release_count > 0) {
+        struct arena_release *r = &arena->releases[--arena->release_count];
+        r->release(r->ptr);
+    }
+}
+
+static void free_adopted(struct arena *arena) {
+    while (arena->adopted) {
+        struct arena *adopted = arena->adopted;
+        arena->adopted = adopted->next_adopted;
+        arena->total_size -= adopted->total_size;
+        arena_free(adopted);
+    }
+}
+
+void arena_reset(struct arena *arena) {
+    run_releases(arena);
+    free_adopted(arena);
+    struct arena_chunk *chunk = arena->head;
+    struct arena_chunk *first = NULL;
+    while (chunk) {
+        struct arena_chunk *next = chunk->next;
+        if (!first && chunk->size == arena->chunk_size) {
+            first = chunk;
+        } else {
+            arena->total_size -= CHUNK_HEADER_SIZE + chunk->size;
+            free(chunk);
+        }
+        chunk = next;
+    }
+    if (!first)
+        first = new_chunk(arena, arena->chunk_size);
+    first->next = NULL;
+    first->used = 0;
+    arena->head = first;
+    arena->last_alloc = NULL;
+    arena->last_size = 0;
+}
+
+void arena_free(struct arena *arena) {
+    run_releases(arena);
+    free(arena->releases);
+    free_adopted(arena);
+    struct arena_chunk *chunk = arena->head;
+    while (chunk) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+void arena_adopt(struct arena *dst, struct arena *src) {
+    src->next_adopted = dst->adopted;
+    dst->adopted = src;
+    dst->total_size += src->total_size;
+}
@@ -0,0 +1,52 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator
+ * ===
+ * Memory is carved from a list of chunks and never given back one by one.
+ * Everything allocated from an arena dies at once in arena_reset() or arena_free().
+ * What lives outside of it, e.g. heap strings of objects in it, is given back by releases registered on the arena.
+ */
+
+#define ARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk;
+struct arena_release;
+
+struct arena {
+    struct arena_chunk *head; // the chunk being carved
+    size_t chunk_size;
+    size_t total_size; // bytes held by all chunks
+
+    // the most recent allocation in head. It can grow in place
+    char *last_alloc;
+    size_t last_size;
+
+    // run in reverse order on reset or free, before any chunk goes
+    struct arena_release *releases;
+    size_t release_count;
+    size_t release_capacity;
+
+    // arenas taken over by this one, chained through next_adopted
+    struct arena *adopted;
+    struct arena *next_adopted;
+};
+
+struct arena* arena_new(size_t chunk_size);
+void* arena_alloc(struct arena *arena, size_t size);
+void* arena_calloc(struct arena *arena, size_t nmemb, size_t size);
+void* arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+// release(ptr) is called when the arena is reset or freed. ptr may be in the arena
+void arena_on_release(struct arena *arena, void (*release)(void *), void *ptr);
+
+// drop every allocation but keep the first chunk for reuse
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+// src lives on until dst is reset or freed. Nothing is allocated from it anymore
+void arena_adopt(struct arena *dst, struct arena *src);
+
+#endif // !_ARENA_H
@@ -0,0 +1,687 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "astcodec.h"
+
+#define ASTCODEC_MAGIC "NMAST"
+#define ASTCODEC_MAGIC_LEN 5
+// nesting deeper than this is taken as a broken buffer rather than risking the stack
+#define ASTCODEC_MAX_DEPTH 1024
+
+/*
+ * Writer
+ */
+
+static sds put_uint(sds buf, uint64_t v) {
+    unsigned char tmp[10];
+    int n = 0;
+    do {
+        unsigned char b = v & 0x7F;
+        v >>= 7;
+        if (v)
+            b |= 0x80;
+        tmp[n++] = b;
+    } while (v);
+    return sdscatlen(buf, tmp, n);
+}
+
+static sds put_int(sds buf, int64_t v) {
+    return put_uint(buf, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static sds put_str(sds buf, const char *s, size_t len) {
+    if (!s)
+        return put_uint(buf, 0);
+    buf = put_uint(buf, (uint64_t)len + 1);
+    return sdscatlen(buf, s, len);
+}
+
+#define PUT_SDS(buf, s) put_str((buf), (s), (s)? sdslen(s) : 0)
+
+static sds put_inline(sds buf, namuast_inline *inl);
+static sds put_inl_container(sds buf, namuast_inl_container *container) {
+    size_t idx;
+    buf = put_uint(buf, container->len);
+    for (idx = 0; idx < container->len; idx++) {
+        buf = put_inline(buf, container->children[idx]);
+    }
+    return buf;
+}
+
+static sds put_opt_inl_container(sds buf, namuast_inl_container *container) {
+    if (!container)
+        return put_uint(buf, 0);
+    buf = put_uint(buf, 1);
+    return put_inl_container(buf, container);
+}
+
+static sds put_inline(sds buf, namuast_inline *inl) {
+    size_t idx;
+    buf = put_uint(buf, inl->inl_type);
+    switch (inl->inl_type) {
+    case namuast_inltype_str:
+        buf = PUT_SDS(buf, ((struct namuast_inl_str *)inl)->str);
+        break;
+    case namuast_inltype_link:
+        {
+            struct namuast_inl_link *link = (struct namuast_inl_link *)inl;
+            buf = PUT_SDS(buf, link->name);
+            buf = PUT_SDS(buf, link->section);
+            buf = put_opt_inl_container(buf, link->alias);
+        }
+        break;
+    case namuast_inltype_extlink:
+        {
+            struct namuast_inl_extlink *extlink = (struct namuast_inl_extlink *)inl;
+            buf = PUT_SDS(buf, extlink->href);
+            buf = put_opt_inl_container(buf, extlink->alias);
+        }
+        break;
+    case namuast_inltype_image:
+        {
+            struct namuast_inl_image *image = (struct namuast_inl_image *)inl;
+            buf = PUT_SDS(buf, image->src);
+            buf = PUT_SDS(buf, image->width);
+            buf = PUT_SDS(buf, image->height);
+            buf = put_uint(buf, image->align);
+        }
+        break;
+    case namuast_inltype_block:
+        {
+            struct namuast_inl_block *block = (struct namuast_inl_block *)inl;
+            buf = put_uint(buf, block->inl_block_type);
+            switch (block->inl_block_type) {
+            case inlblock_type_color:
+                buf = PUT_SDS(buf, block->data.webcolor);
+                buf = put_inl_container(buf, block->content);
+                break;
+            case inlblock_type_highlight:
+                buf = put_int(buf, block->data.highlight_level);
+                buf = put_inl_container(buf, block->content);
+                break;
+            case inlblock_type_raw:
+                buf = PUT_SDS(buf, block->data.raw);
+                break;
+            }
+        }
+        break;
+    case namuast_inltype_fnt:
+        {
+            // only a mark. Footnotes themselves are written ahead of the blocks
+            struct namuast_inl_fnt *fnt = (struct namuast_inl_fnt *)inl;
+            buf = put_int(buf, fnt->id);
+            buf = PUT_SDS(buf, fnt->raw);
+        }
+        break;
+    case namuast_inltype_fnt_section:
+        buf = put_int(buf, ((struct namuast_inl_fnt_section *)inl)->cur_footnote_id);
+        break;
+    case namuast_inltype_span:
+        {
+            struct namuast_inl_span *span = (struct namuast_inl_span *)inl;
+            buf = put_uint(buf, span->span_type);
+            buf = put_inl_container(buf, span->content);
+        }
+        break;
+    case namuast_inltype_container:
+        buf = put_inl_container(buf, (namuast_inl_container *)inl);
+        break;
+    case namuast_inltype_macro:
+        {
+            struct namuast_inl_macro *macro = (struct namuast_inl_macro *)inl;
+            buf = PUT_SDS(buf, macro->name);
+            buf = put_uint(buf, macro->is_fn);
+            buf = put_uint(buf, macro->pos_args_len);
+            for (idx = 0; idx < macro->pos_args_len; idx++) {
+                buf = PUT_SDS(buf, macro->pos_args[idx]);
+            }
+            buf = put_uint(buf, macro->kw_args_len);
+            for (idx = 0; idx < macro->kw_args_len * 2; idx++) {
+                buf = PUT_SDS(buf, macro->kw_args[idx]);
+            }
+            buf = PUT_SDS(buf, macro->raw);
+        }
+        break;
+    case namuast_inltype_toc:
+    case namuast_inltype_return:
+    case namuast_inltype_N:
+        break;
+    }
+    return buf;
+}
+
+static sds put_list(sds buf, struct namuast_list *li) {
+    struct namuast_list *sibling;
+    size_t count = 0;
+    for (sibling = li; sibling; sibling = sibling->next) {
+        count++;
+    }
+    buf = put_uint(buf, count);
+    for (sibling = li; sibling; sibling = sibling->next) {
+        buf = put_uint(buf, sibling->type);
+        buf = put_opt_inl_container(buf, sibling->content);
+        if (sibling->sublist) {
+            buf = put_uint(buf, 1);
+            buf = put_list(buf, sibling->sublist);
+        } else {
+            buf = put_uint(buf, 0);
+        }
+    }
+    return buf;
+}
+
+static sds put_table(sds buf, struct namuast_table *table) {
+    size_t row_idx, col_idx;
+    buf = put_int(buf, table->align);
+    buf = PUT_SDS(buf, table->bg_webcolor);
+    buf = PUT_SDS(buf, table->width);
+    buf = PUT_SDS(buf, table->height);
+    buf = PUT_SDS(buf, table->border_webcolor);
+    buf = put_opt_inl_container(buf, table->caption);
+    buf = put_uint(buf, table->row_count);
+    for (row_idx = 0; row_idx < table->row_count; row_idx++) {
+        struct namuast_table_row *row = &table->rows[row_idx];
+        buf = PUT_SDS(buf, row->bg_webcolor);
+        buf = put_uint(buf, row->col_count);
+        for (col_idx = 0; col_idx < row->col_count; col_idx++) {
+            struct namuast_table_cell *cell = &row->cols[col_idx];
+            buf = put_opt_inl_container(buf, cell->content);
+            buf = put_int(buf, cell->rowspan);
+            buf = put_int(buf, cell->colspan);
+            buf = put_uint(buf, cell->align);
+            buf = put_uint(buf, cell->valign);
+            buf = PUT_SDS(buf, cell->bg_webcolor);
+            buf = PUT_SDS(buf, cell->width);
+            buf = PUT_SDS(buf, cell->height);
+        }
+    }
+    return buf;
+}
+
+static sds put_block(sds buf, namuast_base *base) {
+    buf = put_uint(buf, base->ast_type);
+    switch (base->ast_type) {
+    case namuast_type_quotation:
+        buf = put_inl_container(buf, ((struct namuast_quotation *)base)->content);
+        break;
+    case namuast_type_block:
+        {
+            struct namuast_block *block = (struct namuast_block *)base;
+            buf = put_uint(buf, block->block_type);
+            buf = PUT_SDS(buf, block->block_type == block_type_html? block->data.html : block->data.raw);
+        }
+        break;
+    case namuast_type_table:
+        buf = put_table(buf, (struct namuast_table *)base);
+        break;
+    case namuast_type_list:
+        buf = put_list(buf, (struct namuast_list *)base);
+        break;
+    case namuast_type_heading:
+        {
+            struct namuast_heading *hd = (struct namuast_heading *)base;
+            buf = put_int(buf, hd->h_num);
+            buf = put_opt_inl_container(buf, hd->content);
+        }
+        break;
+    case namuast_type_inline:
+        buf = put_inl_container(buf, (namuast_inl_container *)base);
+        break;
+    case namuast_type_container:
+    case namuast_type_return:
+    case namuast_type_hr:
+    case namuast_type_N:
+        break;
+    }
+    return buf;
+}
+
+sds namuast_serialize(namuast_container *ast, const char *doc_name, sds buf) {
+    struct list_elem *e;
+    size_t idx;
+
+    buf = sdscatlen(buf, ASTCODEC_MAGIC, ASTCODEC_MAGIC_LEN);
+    buf = put_uint(buf, ASTCODEC_VERSION);
+    buf = put_str(buf, doc_name, strlen(doc_name));
+
+    // footnote ids are given in registration order, so the position in the list is the id
+    buf = put_uint(buf, list_size(&ast->fnt_list));
+    for (e = list_begin(&ast->fnt_list); e != list_end(&ast->fnt_list); e = list_next(e)) {
+        struct namuast_inl_fnt *fnt = list_entry(e, struct namuast_inl_fnt, elem);
+        buf = PUT_SDS(buf, fnt->is_named? fnt->repr.name : NULL);
+        buf = put_inl_container(buf, fnt->content);
+    }
+
+    buf = put_uint(buf, ast->len);
+    for (idx = 0; idx < ast->len; idx++) {
+        buf = put_block(buf, ast->children[idx]);
+    }
+    return buf;
+}
+
+/*
+ * Reader
+ * Nodes are rebuilt through the same nm_emit_* operations the scanner uses.
+ * Once the reader is broken every get_* yields zero, and whatever was built so far is released.
+ */
+
+struct ast_reader {
+    char *p;
+    char *border;
+    bool broken;
+    int depth;
+    namugen_ctx *ctx;
+};
+
+static uint64_t get_uint(struct ast_reader *rd) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (!rd->broken) {
+        if (rd->p >= rd->border || shift > 63) {
+            rd->broken = true;
+            break;
+        }
+        unsigned char b = (unsigned char)*rd->p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return v;
+        shift += 7;
+    }
+    return 0;
+}
+
+static int64_t get_int(struct ast_reader *rd) {
+    uint64_t v = get_uint(rd);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// every element takes at least a byte, so a count can't exceed what is left
+static size_t get_count(struct ast_reader *rd) {
+    uint64_t count = get_uint(rd);
+    if (count > (uint64_t)(rd->border - rd->p)) {
+        rd->broken = true;
+        return 0;
+    }
+    return (size_t)count;
+}
+
+// str of the result is NULL for a NULL string
+static bndstr get_str(struct ast_reader *rd) {
+    bndstr ret = {NULL, 0};
+    uint64_t len = get_uint(rd);
+    if (len == 0)
+        return ret;
+    len--;
+    if (len > (uint64_t)(rd->border - rd->p)) {
+        rd->broken = true;
+        return ret;
+    }
+    ret.str = rd->p;
+    ret.len = len;
+    rd->p += len;
+    return ret;
+}
+
+static sds get_sds(struct ast_reader *rd) {
+    bndstr s = get_str(rd);
+    if (!s.str)
+        return NULL;
+    return sdsnewlen(s.str, s.len);
+}
+
+static void read_inline(struct ast_reader *rd, namuast_inl_container *container);
+static namuast_inl_container* read_inl_container(struct ast_reader *rd) {
+    if (rd->broken)
+        return NULL;
+    if (rd->depth >= ASTCODEC_MAX_DEPTH) {
+        rd->broken = true;
+        return NULL;
+    }
+    rd->depth++;
+    namuast_inl_container *container = namuast_make_inline(rd->ctx);
+    size_t count = get_count(rd);
+    size_t idx;
+    for (idx = 0; idx < count && !rd->broken; idx++) {
+        read_inline(rd, container);
+    }
+    rd->depth--;
+    if (rd->broken) {
+        RELEASE_NAMUAST(container);
+        return NULL;
+    }
+    return container;
+}
+
+static namuast_inl_container* read_opt_inl_container(struct ast_reader *rd) {
+    if (!get_uint(rd))
+        return NULL;
+    return read_inl_container(rd);
+}
+
+static void read_macro(struct ast_reader *rd, namuast_inl_container *container) {
+    size_t idx;
+    bndstr name = get_str(rd);
+    bool is_fn = get_uint(rd) != 0;
+
+    size_t pos_args_len = get_count(rd);
+    bndstr *pos_args = calloc(pos_args_len + 1, sizeof(bndstr));
+    for (idx = 0; idx < pos_args_len; idx++) {
+        pos_args[idx] = get_str(rd);
+    }
+    size_t kw_args_len = get_count(rd);
+    bndstr *kw_args = calloc(kw_args_len * 2 + 1, sizeof(bndstr));
+    for (idx = 0; idx < kw_args_len * 2; idx++) {
+        kw_args[idx] = get_str(rd);
+    }
+    bndstr raw = get_str(rd);
+
+    if (!rd->broken) {
+        nm_inl_emit_macro(container, rd->ctx, name, is_fn, pos_args_len, pos_args, kw_args_len, kw_args, raw);
+    }
+    free(pos_args);
+    free(kw_args);
+}
+
+static void read_inline(struct ast_reader *rd, namuast_inl_container *container) {
+    namugen_ctx *ctx = rd->ctx;
+    uint64_t inl_type = get_uint(rd);
+    if (rd->broken)
+        return;
+
+    switch (inl_type) {
+    case namuast_inltype_str:
+        {
+            bndstr s = get_str(rd);
+            if (!rd->broken)
+                nm_inl_emit_str(container, s);
+        }
+        break;
+    case namuast_inltype_link:
+        {
+            bndstr name = get_str(rd);
+            bndstr section = get_str(rd);
+            namuast_inl_container *alias = read_opt_inl_container(rd);
+            if (!rd->broken)
+                nm_inl_emit_link(container, ctx, name, alias, section);
+        }
+        break;
+    case namuast_inltype_extlink:
+        {
+            bndstr href = get_str(rd);
+            namuast_inl_container *alias = read_opt_inl_container(rd);
+            if (!rd->broken)
+                nm_inl_emit_external_link(container, href, alias);
+        }
+        break;
+    case namuast_inltype_image:
+        {
+            bndstr src = get_str(rd);
+            bndstr width = get_str(rd);
+            bndstr height = get_str(rd);
+            int align = (int)get_uint(rd);
+            if (!rd->broken)
+                nm_inl_emit_image(container, src, width, height, align);
+        }
+        break;
+    case namuast_inltype_block:
+        switch (get_uint(rd)) {
+        case inlblock_type_color:
+            {
+                bndstr webcolor = get_str(rd);
+                namuast_inl_container *content = read_inl_container(rd);
+                if (!rd->broken)
+                    block_emitter_ops_inline.emit_colored_block(ctx, container, content, webcolor);
+            }
+            break;
+        case inlblock_type_highlight:
+            {
+                int level = (int)get_int(rd);
+                namuast_inl_container *content = read_inl_container(rd);
+                if (!rd->broken)
+                    block_emitter_ops_inline.emit_highlighted_block(ctx, container, content, level);
+            }
+            break;
+        case inlblock_type_raw:
+            {
+                bndstr raw = get_str(rd);
+                if (!rd->broken)
+                    block_emitter_ops_inline.emit_raw(ctx, container, raw);
+            }
+            break;
+        default:
+            rd->broken = true;
+            break;
+        }
+        break;
+    case namuast_inltype_fnt:
+        {
+            int64_t id = get_int(rd);
+            bndstr raw = get_str(rd);
+            if (id < 1 || id > ctx->last_footnote_id)
+                rd->broken = true;
+            if (!rd->broken)
+                nm_inl_emit_footnote_mark(container, ctx, (int)id, raw);
+        }
+        break;
+    case namuast_inltype_fnt_section:
+        {
+            int cur_footnote_id = (int)get_int(rd);
+            if (!rd->broken) {
+                struct namuast_inl_fnt_section *fnt_section = (struct namuast_inl_fnt_section *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_fnt_section);
+                fnt_section->cur_footnote_id = cur_footnote_id;
+                inl_container_add_steal(container, &fnt_section->_base);
+            }
+        }
+        break;
+    case namuast_inltype_toc:
+        OBTAIN_NAMUAST(ctx->shared_toc);
+        inl_container_add_steal(container, &ctx->shared_toc->_base);
+        break;
+    case namuast_inltype_span:
+        {
+            enum nm_span_type span_type = (enum nm_span_type)get_uint(rd);
+            namuast_inl_container *content = read_inl_container(rd);
+            if (!rd->broken)
+                nm_inl_emit_span(container, content, span_type);
+        }
+        break;
+    case namuast_inltype_return:
+        inl_container_add_return(container, ctx);
+        break;
+    case namuast_inltype_container:
+        {
+            namuast_inl_container *sub = read_inl_container(rd);
+            if (!rd->broken)
+                inl_container_add_steal(container, &sub->_base);
+        }
+        break;
+    case namuast_inltype_macro:
+        read_macro(rd, container);
+        break;
+    default:
+        rd->broken = true;
+        break;
+    }
+}
+
+static struct namuast_list* read_list(struct ast_reader *rd) {
+    struct namuast_list *head = NULL;
+    struct namuast_list *tail = NULL;
+    size_t count = get_count(rd);
+    size_t idx;
+
+    if (count == 0 || rd->depth >= ASTCODEC_MAX_DEPTH) {
+        rd->broken = true;
+        return NULL;
+    }
+    rd->depth++;
+    for (idx = 0; idx < count && !rd->broken; idx++) {
+        int type = (int)get_uint(rd);
+        namuast_inl_container *content = read_opt_inl_container(rd);
+        if (rd->broken)
+            break;
+        struct namuast_list *li = namuast_make_list(rd->ctx, type, content);
+        if (!head)
+            head = li;
+        else
+            tail->next = li;
+        tail = li;
+        if (get_uint(rd))
+            li->sublist = read_list(rd);
+    }
+    rd->depth--;
+    if (rd->broken) {
+        XRELEASE_NAMUAST(head);
+        return NULL;
+    }
+    return head;
+}
+
+static struct namuast_table* read_table(struct ast_reader *rd) {
+    struct namuast_table *table = namuast_make_table(rd->ctx);
+    size_t row_count, row_idx;
+
+    table->align = (int)get_int(rd);
+    table->bg_webcolor = get_sds(rd);
+    table->width = get_sds(rd);
+    table->height = get_sds(rd);
+    table->border_webcolor = get_sds(rd);
+    table->caption = read_opt_inl_container(rd);
+    row_count = get_count(rd);
+    for (row_idx = 0; row_idx < row_count && !rd->broken; row_idx++) {
+        struct namuast_table_row *row = namuast_add_table_row(table);
+        row->bg_webcolor = get_sds(rd);
+        size_t col_count = get_count(rd);
+        size_t col_idx;
+        for (col_idx = 0; col_idx < col_count && !rd->broken; col_idx++) {
+            struct namuast_table_cell *cell = namuast_add_table_cell(table, row);
+            cell->content = read_opt_inl_container(rd);
+            cell->rowspan = (int)get_int(rd);
+            cell->colspan = (int)get_int(rd);
+            cell->align = (enum nm_align_type)get_uint(rd);
+            cell->valign = (enum nm_align_type)get_uint(rd);
+            cell->bg_webcolor = get_sds(rd);
+            cell->width = get_sds(rd);
+            cell->height = get_sds(rd);
+        }
+    }
+    if (rd->broken) {
+        RELEASE_NAMUAST(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void read_block(struct ast_reader *rd) {
+    namugen_ctx *ctx = rd->ctx;
+    uint64_t ast_type = get_uint(rd);
+    if (rd->broken)
+        return;
+
+    switch (ast_type) {
+    case namuast_type_return:
+        nm_emit_return(ctx);
+        break;
+    case namuast_type_hr:
+        nm_emit_hr(ctx, 4);
+        break;
+    case namuast_type_quotation:
+        {
+            namuast_inl_container *content = read_inl_container(rd);
+            if (!rd->broken)
+                nm_emit_quotation(ctx, content);
+        }
+        break;
+    case namuast_type_block:
+        {
+            uint64_t block_type = get_uint(rd);
+            bndstr data = get_str(rd);
+            if (rd->broken)
+                break;
+            if (block_type == block_type_html)
+                block_emitter_ops_paragraphic.emit_html(ctx, NULL, data);
+            else if (block_type == block_type_raw)
+                block_emitter_ops_paragraphic.emit_raw(ctx, NULL, data);
+            else
+                rd->broken = true;
+        }
+        break;
+    case namuast_type_table:
+        {
+            struct namuast_table *table = read_table(rd);
+            if (!rd->broken)
+                nm_emit_table(ctx, table);
+        }
+        break;
+    case namuast_type_list:
+        {
+            struct namuast_list *li = read_list(rd);
+            if (!rd->broken)
+                nm_emit_list(ctx, li);
+        }
+        break;
+    case namuast_type_heading:
+        {
+            int h_num = (int)get_int(rd);
+            namuast_inl_container *content = read_opt_inl_container(rd);
+            if (!rd->broken)
+                nm_emit_heading(ctx, h_num, content);
+        }
+        break;
+    case namuast_type_inline:
+        {
+            namuast_inl_container *content = read_inl_container(rd);
+            if (!rd->broken)
+                nm_emit_inline(ctx, content);
+        }
+        break;
+    default:
+        rd->broken = true;
+        break;
+    }
+}
+
+namuast_container* namuast_deserialize(const char *doc_name, char *buf, size_t len) {
+    struct ast_reader rd = {
+        .p = buf,
+        .border = buf + len,
+        .broken = false,
+        .depth = 0,
+        .ctx = NULL
+    };
+    size_t count, idx;
+
+    if (len < ASTCODEC_MAGIC_LEN || memcmp(buf, ASTCODEC_MAGIC, ASTCODEC_MAGIC_LEN))
+        return NULL;
+    rd.p += ASTCODEC_MAGIC_LEN;
+    if (get_uint(&rd) != ASTCODEC_VERSION)
+        return NULL;
+    bndstr name = get_str(&rd);
+    if (rd.broken || !name.str || name.len != strlen(doc_name) || memcmp(name.str, doc_name, name.len))
+        return NULL;
+
+    namugen_ctx ctx;
+    namugen_init_with_arena(&ctx, doc_name);
+    rd.ctx = &ctx;
+
+    count = get_count(&rd);
+    for (idx = 0; idx < count && !rd.broken; idx++) {
+        bndstr fnt_name = get_str(&rd);
+        namuast_inl_container *content = read_inl_container(&rd);
+        if (rd.broken)
+            break;
+        nm_register_footnote(&ctx, content, fnt_name);
+    }
+
+    count = get_count(&rd);
+    for (idx = 0; idx < count && !rd.broken; idx++) {
+        read_block(&rd);
+    }
+    if (rd.p != rd.border)
+        rd.broken = true;
+
+    namuast_container *result = rd.broken? NULL : namugen_obtain_ast(&ctx);
+    namugen_remove(&ctx);
+    return result;
+}
@@ -0,0 +1,27 @@
+#ifndef _ASTCODEC_H
+#define _ASTCODEC_H
+
+#include "sds/sds.h"
+#include "namugen.h"
+
+/*
+ * Binary encoding of namuast_container
+ * ===
+ * "NMAST" version:u8 doc_name
+ * footnote_count (name content)*
+ * block_count block*
+ *
+ * Integers are LEB128 varints (ints are zigzagged) and strings are varint(len + 1) followed by the bytes, 0 meaning NULL.
+ * Each block or inline node starts with its namuast_type or namuast_inltype.
+ * Shared nodes (hr, returns, toc) and the heading tree are not written, as loading replays the nm_emit_* operations.
+ */
+
+#define ASTCODEC_VERSION 1
+
+sds namuast_serialize(namuast_container *ast, const char *doc_name, sds buf);
+
+// returns NULL if buf is broken, of another version or made for another document.
+// The AST gets an arena of its own and strings are copied straight out of buf, so buf can be freed right after.
+namuast_container* namuast_deserialize(const char *doc_name, char *buf, size_t len);
+
+#endif // !_ASTCODEC_H
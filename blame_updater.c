@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sds/sds.h"
+#include "mariadb-connector-c/include/mysql.h"
+#include "hiredis/hiredis.h"
+#include "namudiff.h"
+
+/*
+ * Brings the blame of a document up to date with the revisions archived by the crawler
+ * ===
+ * blame_updater [-f snapshot_file] <document>
+ *
+ * The blame is kept as a snapshot (see namublame_serialize) in Redis at wiki-blame-<document>, or in snapshot_file.
+ * Only revisions newer than the one the snapshot ends at are read from Archive, so each edit costs a single diff
+ * however long the history is. Without a usable snapshot, the whole history is replayed once.
+ */
+
+#define BLAME_SNAPSHOT_KEY "wiki-blame-%s"
+
+static const DiffOption blame_option = {.dmax_algorithm = diff_dmax_none, .coherency_algorithm = diff_coherency_none};
+
+static sds escape_sql_str(MYSQL *mysql, const char* s) {
+    size_t len = strlen(s);
+    sds escaped_s = sdsnewlen(NULL, len * 2 + 1);
+    mysql_real_escape_string(mysql, escaped_s, s, len);
+    sdsupdatelen(escaped_s);
+    return escaped_s;
+}
+
+// NULL if there is no snapshot yet. The result is malloc'ed
+static char* read_snapshot(redisContext *redis, const char *path, const char *document, size_t *size_out) {
+    char *buf = NULL;
+    if (path) {
+        FILE *fp = fopen(path, "rb");
+        if (!fp)
+            return NULL;
+        fseek(fp, 0L, SEEK_END);
+        long filesize = ftell(fp);
+        fseek(fp, 0L, SEEK_SET);
+        buf = malloc(filesize > 0? filesize : 1);
+        *size_out = fread(buf, 1, filesize, fp);
+        fclose(fp);
+    } else {
+        redisReply *reply = redisCommand(redis, "GET " BLAME_SNAPSHOT_KEY, document);
+        if (reply && reply->type == REDIS_REPLY_STRING) {
+            buf = malloc(reply->len > 0? reply->len : 1);
+            memcpy(buf, reply->str, reply->len);
+            *size_out = reply->len;
+        }
+        if (reply)
+            freeReplyObject(reply);
+    }
+    return buf;
+}
+
+static bool write_snapshot(redisContext *redis, const char *path, const char *document, const char *buf, size_t size) {
+    if (path) {
+        // written aside and renamed, so that a reader never sees half of it
+        sds tmp_path = sdscatprintf(sdsempty(), "%s.tmp", path);
+        FILE *fp = fopen(tmp_path, "wb");
+        bool success = fp && fwrite(buf, 1, size, fp) == size;
+        if (fp)
+            success = fclose(fp) == 0 && success;
+        success = success && rename(tmp_path, path) == 0;
+        sdsfree(tmp_path);
+        return success;
+    } else {
+        redisReply *reply = redisCommand(redis, "SET " BLAME_SNAPSHOT_KEY " %b", document, buf, size);
+        bool success = reply && reply->type != REDIS_REPLY_ERROR;
+        if (reply)
+            freeReplyObject(reply);
+        return success;
+    }
+}
+
+// returns the number of revisions added, or -1 on a query error
+static int add_new_revisions(MYSQL *mysql, const char *document, NamuBlameContext *ctx, bool *has_ctx, int last_revision_id) {
+    sds escaped_document = escape_sql_str(mysql, document);
+    sds query = sdscatprintf(sdsempty(),
+        "SELECT Archive.revision_id, Archive.source, IFNULL(Archive.author_name, Archive.ip), Archive.updated_time, Archive.comment "
+        "FROM Archive JOIN DocumentLog ON DocumentLog.id = Archive.document_log_id "
+        "WHERE DocumentLog.name = '%s' AND Archive.revision_id > %d "
+        "ORDER BY Archive.revision_id",
+        escaped_document, last_revision_id);
+    sdsfree(escaped_document);
+
+    int ret = mysql_real_query(mysql, query, sdslen(query));
+    sdsfree(query);
+    if (ret) {
+        fprintf(stderr, "Error received from MariaDB: %s\n", mysql_error(mysql));
+        return -1;
+    }
+
+    // rows are streamed, so that only one source is held at a time
+    MYSQL_RES *res = mysql_use_result(mysql);
+    MYSQL_ROW row;
+    int count = 0;
+    while ((row = mysql_fetch_row(res))) {
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        int revision_id = atoi(row[0]);
+
+        char *buffer = malloc(lengths[1] + 1);
+        memcpy(buffer, row[1], lengths[1]);
+        buffer[lengths[1]] = 0;
+        Revision *rev = Revision_new(revision_id, buffer, lengths[1]);
+        if (*has_ctx) {
+            namublame_add(ctx, rev, &blame_option);
+        } else {
+            namublame_init(ctx, document, rev);
+            *has_ctx = true;
+        }
+
+        RevisionInfo *info = RevisionInfo_new(row[2]? row[2] : "", revision_id, row[3], row[4]);
+        namublame_add_revision_info(ctx, info);
+        RevisionInfo_release(info);
+        count++;
+    }
+    mysql_free_result(res);
+    return count;
+}
+
+int main(int argc, char** argv) {
+    const char *snapshot_path = NULL;
+    int argi = 1;
+    if (argc > 2 && !strcmp(argv[1], "-f")) {
+        snapshot_path = argv[2];
+        argi = 3;
+    }
+    if (argi + 1 != argc) {
+        fprintf(stderr, "usage: %s [-f snapshot_file] <document>\n", argv[0]);
+        return 1;
+    }
+    const char *document = argv[argi];
+
+    MYSQL *mysql = mysql_init(NULL);
+    if (!mysql_real_connect(mysql, NULL, "root", NULL, "test", 0, "/tmp/mysql.sock", 0)) {
+        fprintf(stderr, "Cannot connect to MariaDB: %s\n", mysql_error(mysql));
+        mysql_close(mysql);
+        return 1;
+    }
+    redisContext *redis = NULL;
+    if (!snapshot_path) {
+        redis = redisConnect("localhost", 6379);
+        if (!redis || redis->err) {
+            fprintf(stderr, "Cannot connect to Redis\n");
+            mysql_close(mysql);
+            return 1;
+        }
+    }
+
+    NamuBlameContext ctx;
+    bool has_ctx = false;
+    size_t snapshot_size;
+    char *snapshot = read_snapshot(redis, snapshot_path, document, &snapshot_size);
+    if (snapshot) {
+        enum namublame_error err = namublame_deserialize(&ctx, snapshot, snapshot_size);
+        if (err == namublame_error_ok)
+            has_ctx = true;
+        else
+            fprintf(stderr, "Discarding the snapshot of %s (error %d)\n", document, err);
+        free(snapshot);
+    }
+
+    int last_revision_id = has_ctx? namublame_recent_revision(&ctx)->revision_id : 0;
+    int added = add_new_revisions(mysql, document, &ctx, &has_ctx, last_revision_id);
+    int exit_code = 0;
+    if (added < 0) {
+        exit_code = 1;
+    } else if (added > 0) {
+        enum namublame_error err = namublame_serialize(&ctx, &snapshot, &snapshot_size);
+        if (err != namublame_error_ok) {
+            fprintf(stderr, "Cannot serialize the blame of %s (error %d)\n", document, err);
+            exit_code = 1;
+        } else {
+            if (!write_snapshot(redis, snapshot_path, document, snapshot, snapshot_size)) {
+                fprintf(stderr, "Cannot store the snapshot of %s\n", document);
+                exit_code = 1;
+            }
+            free(snapshot);
+        }
+    }
+    if (has_ctx) {
+        printf("%s: %d revision(s) added, at r%d\n", document, added > 0? added : 0, namublame_recent_revision(&ctx)->revision_id);
+        namublame_remove(&ctx);
+    }
+
+    if (redis)
+        redisFree(redis);
+    mysql_close(mysql);
+    return exit_code;
+}
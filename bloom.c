@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bloom.h"
+
+// FNV-1a followed by the finalizer of MurmurHash3, so that both halves are usable
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t idx;
+    for (idx = 0; idx < len; idx++) {
+        h ^= (unsigned char)key[idx];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void bloom_init(struct bloom *bloom, size_t capacity, int bits_per_key) {
+    if (capacity < 64)
+        capacity = 64;
+    bloom->bit_count = capacity * bits_per_key;
+    bloom->bits = calloc((bloom->bit_count + 7) / 8, 1);
+    // bits_per_key * ln 2 minimizes false positives
+    bloom->hash_count = bits_per_key * 69 / 100;
+    if (bloom->hash_count < 1)
+        bloom->hash_count = 1;
+    bloom->capacity = capacity;
+    bloom->count = 0;
+}
+
+void bloom_remove(struct bloom *bloom) {
+    free(bloom->bits);
+    bloom->bits = NULL;
+}
+
+// The i-th probe is h1 + i * h2 (Kirsch and Mitzenmacher)
+void bloom_add(struct bloom *bloom, const char *key, size_t len) {
+    uint64_t h = hash_key(key, len);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    bool is_new = false;
+    int idx;
+    for (idx = 0; idx < bloom->hash_count; idx++) {
+        size_t bit = (h1 + (uint64_t)idx * h2) % bloom->bit_count;
+        unsigned char mask = 1 << (bit % 8);
+        if (!(bloom->bits[bit / 8] & mask)) {
+            bloom->bits[bit / 8] |= mask;
+            is_new = true;
+        }
+    }
+    // names seen again on every refresh would make the filter look full
+    if (is_new)
+        bloom->count++;
+}
+
+bool bloom_may_contain(const struct bloom *bloom, const char *key, size_t len) {
+    uint64_t h = hash_key(key, len);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    int idx;
+    for (idx = 0; idx < bloom->hash_count; idx++) {
+        size_t bit = (h1 + (uint64_t)idx * h2) % bloom->bit_count;
+        if (!(bloom->bits[bit / 8] & (1 << (bit % 8))))
+            return false;
+    }
+    return true;
+}
@@ -5,8 +5,10 @@
 
 #include "namugen.h"
 #include "htmlgen.h"
+#include "astcodec.h"
+#include "threadpool.h"
 
-static void dummy_docs_exist(struct namugen_doc_itfc* x, int argc, char** docnames, bool* results) {
+static void dummy_docs_exist(struct namugen_doc_itfc* x, const char *linking_doc_name, int argc, char** docnames, bool* results) {
     int idx;
     for (idx = 0; idx < argc; idx++) {
         results[idx] = false;
@@ -26,6 +28,8 @@ typedef struct my_itfc {
     struct namugen_doc_itfc base;
     char *buffer;
     size_t buffer_size;
+    bool through_astcodec; // serialize and load the AST again before rendering
+    struct threadpool *pool; // scans and renders in parallel. may be NULL
 } my_itfc;
 
 struct namuast_container* get_ast (struct namugen_doc_itfc *_itfc, const char *doc_name) {
@@ -43,10 +47,17 @@ struct namuast_container* get_ast (struct namugen_doc_itfc *_itfc, const char *d
         return NULL;
 
     namugen_ctx namugen;
-    namugen_init(&namugen, "MyDocument");
-    namugen_scan(&namugen, buffer, buffer_size);
+    namugen_init_with_arena(&namugen, "MyDocument");
+    namugen_scan_parallel(&namugen, buffer, buffer_size, itfc->pool);
     struct namuast_container* result = namugen_obtain_ast(&namugen);
     namugen_remove(&namugen);
+
+    if (itfc->through_astcodec) {
+        sds serialized = namuast_serialize(result, doc_name, sdsempty());
+        RELEASE_NAMUAST(result);
+        result = namuast_deserialize(doc_name, serialized, sdslen(serialized));
+        sdsfree(serialized);
+    }
     return result;
 }
 
@@ -58,6 +69,16 @@ int main(int argc, char** argv) {
     if (argc < 2) {
         return 1;
     }
+    bool through_astcodec = false;
+    struct threadpool *pool = NULL;
+    int arg_idx;
+    for (arg_idx = 2; arg_idx < argc; arg_idx++) {
+        if (!strcmp(argv[arg_idx], "--through-astcodec"))
+            through_astcodec = true;
+        else if (!strncmp(argv[arg_idx], "--threads=", 10))
+            pool = threadpool_new(atoi(argv[arg_idx] + 10));
+    }
+    htmlgen_use_thread_pool(pool);
     FILE *fp = fopen(argv[1], "r");
     if (!fp) {
         fprintf(stderr, "Cannot open the file\n");
@@ -77,7 +98,9 @@ int main(int argc, char** argv) {
             .doc_href = doc_href
         },
         .buffer = buffer,
-        .buffer_size = filesize
+        .buffer_size = filesize,
+        .through_astcodec = through_astcodec,
+        .pool = pool
     };
 
     sds result = sdsnewlen(NULL, filesize * 2);
@@ -91,5 +114,7 @@ int main(int argc, char** argv) {
     sdsfree(result);
     free(buffer);
     fclose(fp);
+    if (pool)
+        threadpool_free(pool);
     return 0;
 }
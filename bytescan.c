@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "bytescan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BYTESCAN_X86
+#include <immintrin.h>
+#endif
+
+// below this, broadcasting the needles costs more than it saves
+#define VECTOR_MIN_LEN 16
+
+typedef const char* (*vector_find_fn)(const char *p, const char *border, const unsigned char *bytes, int len);
+
+#ifdef BYTESCAN_X86
+// Each of these returns a hit, or the position where less than a vector is left. The caller looks at the rest.
+__attribute__((target("sse2")))
+static const char* find_any_sse2(const char *p, const char *border, const unsigned char *bytes, int len) {
+    __m128i needles[BYTESET_MAX];
+    int idx;
+    for (idx = 0; idx < len; idx++) {
+        needles[idx] = _mm_set1_epi8((char)bytes[idx]);
+    }
+    while (border - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_cmpeq_epi8(chunk, needles[0]);
+        for (idx = 1; idx < len; idx++) {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(chunk, needles[idx]));
+        }
+        int mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return p;
+}
+
+__attribute__((target("avx2")))
+static const char* find_any_avx2(const char *p, const char *border, const unsigned char *bytes, int len) {
+    __m256i needles[BYTESET_MAX];
+    int idx;
+    for (idx = 0; idx < len; idx++) {
+        needles[idx] = _mm256_set1_epi8((char)bytes[idx]);
+    }
+    while (border - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_cmpeq_epi8(chunk, needles[0]);
+        for (idx = 1; idx < len; idx++) {
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, needles[idx]));
+        }
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return p;
+}
+#endif
+
+static vector_find_fn vector_find_any = NULL;
+
+__attribute__((constructor))
+static void initmod_bytescan() {
+#ifdef BYTESCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        vector_find_any = find_any_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        vector_find_any = find_any_sse2;
+#endif
+}
+
+char* bytescan_find_set(const char *p, const char *border, const struct byteset *set) {
+    if (vector_find_any && border - p >= VECTOR_MIN_LEN)
+        p = vector_find_any(p, border, set->bytes, set->len);
+    while (p < border && !set->member[(unsigned char)*p]) {
+        p++;
+    }
+    return (char *)p;
+}
+
+char* bytescan_find_any(const char *p, const char *border, const char *bytes, int len) {
+    if (p >= border)
+        return (char *)border;
+    if (len == 1) {
+        const char *hit = memchr(p, bytes[0], border - p);
+        return (char *)(hit? hit : border);
+    }
+    if (vector_find_any && border - p >= VECTOR_MIN_LEN)
+        p = vector_find_any(p, border, (const unsigned char *)bytes, len);
+    for (; p < border; p++) {
+        int idx;
+        for (idx = 0; idx < len; idx++) {
+            if (*p == bytes[idx])
+                return (char *)p;
+        }
+    }
+    return (char *)border;
+}
@@ -0,0 +1,52 @@
+#ifndef _BYTESCAN_H
+#define _BYTESCAN_H
+
+#include <stddef.h>
+
+/*
+ * Finding the next special byte
+ * ===
+ * Both functions return the first position in [p, border) holding one of the given bytes, or border if there is none.
+ * Bytes are tested 32 or 16 at a time with AVX2 or SSE2, whichever the CPU supports, and one by one elsewhere.
+ */
+
+#define BYTESET_MAX 16
+
+struct byteset {
+    int len;
+    unsigned char bytes[BYTESET_MAX];
+    unsigned char member[256]; // for the scalar path
+};
+
+// BYTESET('\n', '[', ...) makes a constant byteset of up to BYTESET_MAX bytes
+#define BYTESET(...) { \
+    .len = _BYTESET_NARG(__VA_ARGS__), \
+    .bytes = { __VA_ARGS__ }, \
+    .member = { _BYTESET_CAT(_BYTESET_MEMBER, _BYTESET_NARG(__VA_ARGS__))(__VA_ARGS__) } \
+}
+
+char* bytescan_find_set(const char *p, const char *border, const struct byteset *set);
+char* bytescan_find_any(const char *p, const char *border, const char *bytes, int len);
+
+#define _BYTESET_NARG(...) _BYTESET_NARG_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define _BYTESET_NARG_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define _BYTESET_CAT(a, b) _BYTESET_CAT_(a, b)
+#define _BYTESET_CAT_(a, b) a##b
+#define _BYTESET_MEMBER1(c) [(unsigned char)(c)] = 1
+#define _BYTESET_MEMBER2(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER1(__VA_ARGS__)
+#define _BYTESET_MEMBER3(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER2(__VA_ARGS__)
+#define _BYTESET_MEMBER4(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER3(__VA_ARGS__)
+#define _BYTESET_MEMBER5(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER4(__VA_ARGS__)
+#define _BYTESET_MEMBER6(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER5(__VA_ARGS__)
+#define _BYTESET_MEMBER7(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER6(__VA_ARGS__)
+#define _BYTESET_MEMBER8(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER7(__VA_ARGS__)
+#define _BYTESET_MEMBER9(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER8(__VA_ARGS__)
+#define _BYTESET_MEMBER10(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER9(__VA_ARGS__)
+#define _BYTESET_MEMBER11(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER10(__VA_ARGS__)
+#define _BYTESET_MEMBER12(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER11(__VA_ARGS__)
+#define _BYTESET_MEMBER13(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER12(__VA_ARGS__)
+#define _BYTESET_MEMBER14(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER13(__VA_ARGS__)
+#define _BYTESET_MEMBER15(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER14(__VA_ARGS__)
+#define _BYTESET_MEMBER16(c, ...) _BYTESET_MEMBER1(c), _BYTESET_MEMBER15(__VA_ARGS__)
+
+#endif // !_BYTESCAN_H
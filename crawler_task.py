@@ -2,6 +2,7 @@
 import time
 import os
 import errno
+import subprocess
 import MySQLdb
 
 from pprint import pprint
@@ -38,9 +39,13 @@ class Serializer(object):
 
 app = Celery("crawler_task")
 app.conf.CELERY_ROUTES = {
-    'crawler_task.keep_track_of_history': {'queue': 'history-crawler'}
+    'crawler_task.keep_track_of_history': {'queue': 'history-crawler'},
+    # consumed by a single worker, so that no two updates of a snapshot overlap
+    'crawler_task.update_blame': {'queue': 'blame-updater'}
 }
 
+BLAME_UPDATER_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "blame_updater")
+
 app.conf.CELERYBEAT_SCHEDULE = {
     'periodic-rc-crawling': {
         'task': 'crawler_task.keep_track_of_recent_document',
@@ -217,6 +222,7 @@ def keep_track_of_history(document):
                     retrieve_history,
                     args=(document, ))
                 most_recent_revision_id = history_records[0].revision_id
+                has_new_revision = last_revision_id < most_recent_revision_id
                 while last_revision_id < most_recent_revision_id:
                     history_records = _serializer(
                         retrieve_history,
@@ -233,6 +239,8 @@ def keep_track_of_history(document):
 
                         wiki_data.incremental_add(record, source, is_recent)
                         db.commit() # a transaction per history
+                if has_new_revision:
+                    update_blame.apply_async(args=(document,), queue='blame-updater')
             except SpoofingUrlopenException as exc:
                 if is_sane_404(exc):
                     document_may_moved(document)
@@ -246,3 +254,16 @@ def keep_track_of_history(document):
             db.close()
     finally:
         _serializer.close()
+
+
+@app.task
+def update_blame(document):
+    '''
+    Appends the revisions archived since the last update to the blame snapshot of the document.
+    Only the new revisions are diffed (see blame_updater.c).
+    '''
+    if isinstance(document, unicode):
+        document = document.encode("UTF-8")
+    ret = subprocess.call([BLAME_UPDATER_PATH, document])
+    if ret != 0:
+        print "[ERROR] failed to update the blame of '%s' (exit code %d)"%(document, ret)
@@ -1,8 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #include "data.h"
+#include "lru.h"
+#include "bloom.h"
 #include "uthash/src/uthash.h"
 #include "lz4/lib/lz4.h"
 #include "lz4/lib/lz4hc.h"
@@ -11,6 +16,53 @@
 
 // 1 hour
 #define CACHE_VALID_MILLIS (60L * 60L * 1000L) 
+// in-process tiers, per worker
+#define RENDERED_LRU_BUDGET (32L * 1024L * 1024L)
+// pages with more links are not cached, and records claiming more are rejected
+#define RENDERED_MAX_LINK_COUNT 8192
+// the link names and html of a page
+#define RENDERED_MAX_SIZE (64L * 1024L * 1024L)
+#define DOCUMENT_LRU_BUDGET (64L * 1024L * 1024L)
+// the source of a page
+#define DOCUMENT_MAX_SIZE (16L * 1024L * 1024L)
+
+// an LZ4 block never decompresses to more than this many times its size
+#define LZ4_MAX_RATIO 255
+
+#define DOC_RECORD_MAGIC "NMDC"
+#define DOC_RECORD_VERSION 1
+#define DOC_RECORD_HEADER_SIZE 44
+
+// "NMAZ" original_size:u32 followed by the AST blob compressed with LZ4
+#define AST_RECORD_MAGIC "NMAZ"
+#define AST_RECORD_HEADER_SIZE 8
+#define AST_BLOB_MAX_SIZE (2 * DOCUMENT_MAX_SIZE)
+
+struct doc_record_header {
+    int dict_version;
+    long long updated_time;
+    long long collected_time;
+    long long cached_time;
+    uint32_t original_size;
+    uint32_t name_len;
+    uint32_t rev_len;
+    const char *name;
+    const char *rev;
+    const char *compressed;
+    size_t compressed_size;
+};
+
+// ~0.3% of missing links go past the name index
+#define NAME_INDEX_BITS_PER_NAME 12
+#define NAME_INDEX_REFRESH_MILLIS (10L * 1000L)
+#define NAME_INDEX_REBUILD_BATCH 10000
+#define EXISTENCE_LRU_BUDGET (4L * 1024L * 1024L)
+#define EXISTENCE_VALID_MILLIS (10L * 60L * 1000L)
+
+#define FLIGHT_TIMEOUT_SECS 5
+// a worker fetching a document from MariaDB holds a lock in Redis for at most this long
+#define FETCH_LOCK_MILLIS 5000
+#define FETCH_LOCK_WAIT_TRIES 3
 
 
 static long long get_epoch() {
@@ -124,14 +176,40 @@ static sds escape_sql_str(MYSQL *mysql, char* s) {
  * Redis
  * (always used as LRU cache)
  * 
- * existing headers + original_size
+ * wiki-recent-document-<name>
  * ===
+ * offset 0  "NMDC" version:u8 dict_version:u8 reserved:u8[2]
+ *        8  updated_time:i64 collected_time:i64 cached_time:i64
+ *        32 original_size:u32 name_len:u32 rev_len:u32
+ *        44 name rev lz4_compressed_data
+ * (little-endian. Entries of the old textual form below are still read)
+ * A non-zero dict_version means the data was compressed with that version of wiki-lz4-dict,
+ * and entries made with another one are treated as misses.
+ *
  * (Header : Value\n)*
  * \n
  * lz4_compressed_data
+ *
+ * wiki-recent-ast-<rev>-<name>
+ * ===
+ * parsed AST of the revision, encoded by astcodec.c. Expires after CACHE_VALID_MILLIS
+ *
+ * wiki-rendered-<renderer_version>-<rev>-<name>
+ * ===
+ * headers as above + link_count + link_exists ('0' or '1' for each link) + block_count
+ * \n
+ * (compressed_size:u32 lz4_block)*
+ * The first block holds the link names, each terminated by '\0', and the rest the html in the chunks it was
+ * generated in. Blocks are compressed as one LZ4 stream, so they are decoded in order.
+ * Expires after CACHE_VALID_MILLIS. The same records are kept in an LRU of the worker in front of Redis.
+ *
+ * wiki-lz4-dict
+ * ===
+ * "NMDI" version:u8 dictionary (at most 64KB, built by dict_builder.c)
  */
 
-bool deserialize_document(Document *doc_out, char *s, size_t len) {
+// entries written before DOC_RECORD_MAGIC, kept until they expire from Redis
+static bool deserialize_document_text(Document *doc_out, char *s, size_t len) {
     if (len == 0)
         return false;
     char *s_ed = s + len;
@@ -212,27 +290,167 @@ bool deserialize_document(Document *doc_out, char *s, size_t len) {
     return true;
 }
 
+/*
+ * Little-endian fixed-width fields, read and written bytewise as records are not aligned
+ */
+static void put_u32(unsigned char *p, uint32_t v) {
+    int idx;
+    for (idx = 0; idx < 4; idx++)
+        p[idx] = (unsigned char)(v >> (8 * idx));
+}
+
+static void put_i64(unsigned char *p, long long v) {
+    uint64_t u = (uint64_t)v;
+    int idx;
+    for (idx = 0; idx < 8; idx++)
+        p[idx] = (unsigned char)(u >> (8 * idx));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    int idx;
+    for (idx = 0; idx < 4; idx++)
+        v |= (uint32_t)p[idx] << (8 * idx);
+    return v;
+}
+
+static long long get_i64(const unsigned char *p) {
+    uint64_t u = 0;
+    int idx;
+    for (idx = 0; idx < 8; idx++)
+        u |= (uint64_t)p[idx] << (8 * idx);
+    return (long long)u;
+}
+
+/*
+ * Shared LZ4 dictionary of the worker
+ * Short pages are mostly namu markup, which compresses poorly on its own.
+ * The dictionary is hashed once into dict_stream, whose state is copied into stream for each document compressed.
+ */
+static struct {
+    int version; // 0 if none is loaded
+    char *data;
+    int size;
+    LZ4_streamHC_t *dict_stream;
+    LZ4_streamHC_t *stream;
+} compression_dict;
+
+bool set_compression_dict(const char *blob, size_t len) {
+    const unsigned char *p = (const unsigned char *)blob;
+    if (len <= 5 || len - 5 > COMPRESSION_DICT_MAX_SIZE || memcmp(p, COMPRESSION_DICT_MAGIC, 4) || p[4] == 0)
+        return false;
+    if (!compression_dict.stream) {
+        compression_dict.dict_stream = LZ4_createStreamHC();
+        compression_dict.stream = LZ4_createStreamHC();
+    }
+    free(compression_dict.data);
+    compression_dict.size = len - 5;
+    compression_dict.data = malloc(compression_dict.size);
+    memcpy(compression_dict.data, blob + 5, compression_dict.size);
+    compression_dict.version = p[4];
+    LZ4_resetStreamHC(compression_dict.dict_stream, 4);
+    LZ4_loadDictHC(compression_dict.dict_stream, compression_dict.data, compression_dict.size);
+    return true;
+}
+
+bool load_compression_dict(ConnCtx* ctx) {
+    bool loaded = false;
+    redisReply* reply = redisCommand(ctx->redis, "GET wiki-lz4-dict");
+    REDIS_NOT_ERROR(reply) {
+        if (reply->type == REDIS_REPLY_STRING)
+            loaded = set_compression_dict(reply->str, reply->len);
+    }
+    freeReplyObject(reply);
+    return loaded;
+}
+
+// validates the header of a binary record, pointing hdr_out into s. Nothing is allocated.
+static bool read_doc_record_header(const char *s, size_t len, struct doc_record_header *hdr_out) {
+    const unsigned char *p = (const unsigned char *)s;
+    if (len < DOC_RECORD_HEADER_SIZE || memcmp(p, DOC_RECORD_MAGIC, 4) || p[4] != DOC_RECORD_VERSION)
+        return false;
+    hdr_out->dict_version = p[5];
+    hdr_out->updated_time = get_i64(p + 8);
+    hdr_out->collected_time = get_i64(p + 16);
+    hdr_out->cached_time = get_i64(p + 24);
+    hdr_out->original_size = get_u32(p + 32);
+    hdr_out->name_len = get_u32(p + 36);
+    hdr_out->rev_len = get_u32(p + 40);
+
+    size_t rest = len - DOC_RECORD_HEADER_SIZE;
+    if (hdr_out->original_size == 0 || hdr_out->original_size > DOCUMENT_MAX_SIZE)
+        return false;
+    if (hdr_out->name_len > rest || hdr_out->rev_len > rest - hdr_out->name_len)
+        return false;
+    hdr_out->name = s + DOC_RECORD_HEADER_SIZE;
+    hdr_out->rev = hdr_out->name + hdr_out->name_len;
+    hdr_out->compressed = hdr_out->rev + hdr_out->rev_len;
+    hdr_out->compressed_size = rest - hdr_out->name_len - hdr_out->rev_len;
+    if (hdr_out->compressed_size == 0 || hdr_out->compressed_size > INT_MAX)
+        return false;
+    // deserialize_document allocates original_size before decompressing
+    return hdr_out->original_size <= hdr_out->compressed_size * LZ4_MAX_RATIO;
+}
+
+bool deserialize_document(Document *doc_out, char *s, size_t len) {
+    struct doc_record_header hdr;
+    if (len >= 4 && !memcmp(s, DOC_RECORD_MAGIC, 4)) {
+        if (!read_doc_record_header(s, len, &hdr))
+            return false;
+    } else
+        return deserialize_document_text(doc_out, s, len);
+
+    if (hdr.dict_version && hdr.dict_version != compression_dict.version)
+        return false;
+
+    sds original_source = sdsnewlen(NULL, hdr.original_size);
+    int dec_size;
+    if (hdr.dict_version)
+        dec_size = LZ4_decompress_safe_usingDict(hdr.compressed, original_source, (int)hdr.compressed_size, (int)hdr.original_size,
+                                                 compression_dict.data, compression_dict.size);
+    else
+        dec_size = LZ4_decompress_safe(hdr.compressed, original_source, (int)hdr.compressed_size, (int)hdr.original_size);
+    if (dec_size != (int)hdr.original_size) {
+        sdsfree(original_source);
+        return false;
+    }
+    doc_out->source = original_source;
+    doc_out->name = sdsnewlen(hdr.name, hdr.name_len);
+    doc_out->rev = sdsnewlen(hdr.rev, hdr.rev_len);
+    doc_out->updated_time = hdr.updated_time;
+    doc_out->collected_time = hdr.collected_time;
+    doc_out->cached_time = hdr.cached_time;
+    return true;
+}
+
 char* serialize_document(Document *slot, long long cached_time, size_t *buf_size_out) {
-    RAII_SDS sds header = sdsempty();
-#define MAKE_CACHE_HEADER(expr, name, percent) do {  \
-    header = sdscatprintf(header, name":"percent"\n", expr); \
-    } while (0)
+    size_t name_len = sdslen(slot->name);
+    size_t rev_len = sdslen(slot->rev);
+    size_t source_len = sdslen(slot->source);
+    size_t header_len = DOC_RECORD_HEADER_SIZE + name_len + rev_len;
 
-    MAKE_CACHE_HEADER(slot->name, "name", "%s");
-    MAKE_CACHE_HEADER((long long)slot->updated_time, "updated_time", "%lld");
-    MAKE_CACHE_HEADER((long long)slot->collected_time, "collected_time", "%lld");
-    MAKE_CACHE_HEADER(slot->rev, "rev", "%s");
-    MAKE_CACHE_HEADER(sdslen(slot->source), "original_size", "%zu");
-    MAKE_CACHE_HEADER(cached_time, "cached_time", "%lld");
-    header = sdscat(header, "\n");
-    size_t header_len = sdslen(header);
+    int compress_bound = LZ4_compressBound(source_len); 
+    unsigned char* buf = calloc(header_len + compress_bound, 1);
+    memcpy(buf, DOC_RECORD_MAGIC, 4);
+    buf[4] = DOC_RECORD_VERSION;
+    buf[5] = (unsigned char)compression_dict.version;
+    put_i64(buf + 8, slot->updated_time);
+    put_i64(buf + 16, slot->collected_time);
+    put_i64(buf + 24, cached_time);
+    put_u32(buf + 32, (uint32_t)source_len);
+    put_u32(buf + 36, (uint32_t)name_len);
+    put_u32(buf + 40, (uint32_t)rev_len);
+    memcpy(buf + DOC_RECORD_HEADER_SIZE, slot->name, name_len);
+    memcpy(buf + DOC_RECORD_HEADER_SIZE + name_len, slot->rev, rev_len);
 
-    int compress_bound = LZ4_compressBound(sdslen(slot->source)); 
-    char* buf = calloc(header_len + compress_bound, 1);
-    memcpy(buf, header, header_len * sizeof(char));
-    int compr_size = LZ4_compress_HC(slot->source, buf + header_len, sdslen(slot->source), compress_bound, 4);
+    int compr_size;
+    if (compression_dict.version) {
+        memcpy(compression_dict.stream, compression_dict.dict_stream, sizeof(LZ4_streamHC_t));
+        compr_size = LZ4_compress_HC_continue(compression_dict.stream, slot->source, (char *)buf + header_len, source_len, compress_bound);
+    } else
+        compr_size = LZ4_compress_HC(slot->source, (char *)buf + header_len, source_len, compress_bound, 4);
     *buf_size_out = header_len + compr_size;
-    return buf;
+    return (char *)buf;
 }
 
 typedef struct {
@@ -248,7 +466,7 @@ static int _p_strcmp(const void *lhs, const void *rhs) {
     return strcmp(*(char **)lhs, *(char **)rhs);
 }
 
-void documents_exist(ConnCtx *ctx, int argc, char** docnames, bool *result) {
+static void documents_exist_remotely(ConnCtx *ctx, int argc, char** docnames, bool *result) {
     _RemainingSlot slots[argc];
     int slot_cnt = 0;
 
@@ -310,11 +528,202 @@ void documents_exist(ConnCtx *ctx, int argc, char** docnames, bool *result) {
     }
 }
 
+/*
+ * Name index
+ * documents_exist is asked about every link of a rendered page. A Bloom filter over all names in RecentDocument
+ * answers "no" without a round trip, and recent answers for the names it lets through are kept in an LRU.
+ * Names updated since the last look are added every NAME_INDEX_REFRESH_MILLIS. Once the filter has taken more names
+ * than it was sized for, another one is built to drop deleted ones, NAME_INDEX_REBUILD_BATCH names in name order per call,
+ * and replaces it when the last names are in. Only init_name_index reads all names at once.
+ * Copies of updated documents in the worker tier are dropped on the way, as they may be of an older revision.
+ */
+struct existence {
+    bool exists;
+    long long checked_time;
+};
+
+static struct {
+    bool ready;
+    struct bloom filter;
+    long long updated_until; // UNIX_TIMESTAMP(updated_time) of the latest name added
+    long long refreshed_time;
+    struct lru known;
+
+    // the filter being built again while the one above keeps answering
+    bool rebuilding;
+    bool rebuild_batch_running; // by another async core
+    struct bloom next_filter;
+    sds next_cursor; // the last name added to next_filter
+} name_index;
+
+static struct lru* get_document_lru();
+
+// names updated meanwhile may be behind the cursor of the filter being built, so they go to both
+static void index_name(const char *name) {
+    size_t len = strlen(name);
+    bloom_add(&name_index.filter, name, len);
+    if (name_index.rebuilding)
+        bloom_add(&name_index.next_filter, name, len);
+}
+
+static void add_names_updated_since(ConnCtx* ctx, long long since) {
+    RAII_SDS sds query;
+    if (since < 0)
+        query = sdsnew("SELECT name, UNIX_TIMESTAMP(updated_time) FROM RecentDocument");
+    else
+        query = sdscatprintf(sdsempty(), "SELECT name, UNIX_TIMESTAMP(updated_time) FROM RecentDocument WHERE updated_time >= FROM_UNIXTIME(%lld)", since);
+    MYSQL_RES *res = query_seq(ctx, query);
+    MYSQL_ROW row;
+    while (async_fetch_row(ctx, res, &row)) {
+        index_name(row[0]);
+        if (name_index.ready) {
+            // a remembered "no" is wrong from now on
+            lru_del(&name_index.known, row[0]);
+            lru_del(get_document_lru(), row[0]);
+        }
+        long long updated_time = row[1]? strtoll(row[1], NULL, 10) : 0;
+        if (updated_time > name_index.updated_until)
+            name_index.updated_until = updated_time;
+    }
+    mysql_free_result(res);
+}
+
+static void build_name_index(ConnCtx* ctx) {
+    size_t name_cnt = 0;
+    RAII_SDS sds query = sdsnew("SELECT COUNT(*) FROM RecentDocument");
+    MYSQL_RES *res = query_seq(ctx, query);
+    MYSQL_ROW row;
+    if (async_fetch_row(ctx, res, &row) && row[0])
+        name_cnt = strtoll(row[0], NULL, 10);
+    while (async_fetch_row(ctx, res, &row));
+    mysql_free_result(res);
+
+    bloom_init(&name_index.filter, name_cnt + name_cnt / 2 + 1024, NAME_INDEX_BITS_PER_NAME);
+    add_names_updated_since(ctx, -1);
+    lru_init(&name_index.known, EXISTENCE_LRU_BUDGET, free);
+    name_index.ready = true;
+}
+
+static void begin_rebuilding_name_index() {
+    // names counted since the last build, deleted ones included, are more than there are now
+    size_t name_cnt = name_index.filter.count;
+    bloom_init(&name_index.next_filter, name_cnt + name_cnt / 2 + 1024, NAME_INDEX_BITS_PER_NAME);
+    name_index.next_cursor = sdsempty();
+    name_index.rebuilding = true;
+}
+
+static void continue_rebuilding_name_index(ConnCtx* ctx) {
+    name_index.rebuild_batch_running = true;
+    RAII_SDS sds escaped_cursor = escape_sql_str(ctx->mysql, name_index.next_cursor);
+    RAII_SDS sds query = sdscatprintf(sdsempty(), "SELECT name FROM RecentDocument WHERE name > '%s' ORDER BY name LIMIT %d", escaped_cursor, NAME_INDEX_REBUILD_BATCH);
+    MYSQL_RES *res = query_seq(ctx, query);
+    MYSQL_ROW row;
+    int row_cnt = 0;
+    while (async_fetch_row(ctx, res, &row)) {
+        bloom_add(&name_index.next_filter, row[0], strlen(row[0]));
+        name_index.next_cursor = sdscpy(name_index.next_cursor, row[0]);
+        row_cnt++;
+    }
+    mysql_free_result(res);
+    name_index.rebuild_batch_running = false;
+
+    if (row_cnt < NAME_INDEX_REBUILD_BATCH) {
+        bloom_remove(&name_index.filter);
+        name_index.filter = name_index.next_filter;
+        sdsfree(name_index.next_cursor);
+        name_index.next_cursor = NULL;
+        name_index.rebuilding = false;
+    }
+}
+
+void init_name_index(ConnCtx* ctx) {
+    if (name_index.ready)
+        return;
+    name_index.refreshed_time = get_epoch();
+    build_name_index(ctx);
+}
+
+static void refresh_name_index(ConnCtx* ctx) {
+    if (!name_index.ready)
+        return;
+    if (name_index.rebuilding && !name_index.rebuild_batch_running)
+        continue_rebuilding_name_index(ctx);
+    long long now = get_epoch();
+    if (now - name_index.refreshed_time < NAME_INDEX_REFRESH_MILLIS)
+        return;
+    name_index.refreshed_time = now;
+    if (!name_index.rebuilding && name_index.filter.count > name_index.filter.capacity)
+        begin_rebuilding_name_index();
+    add_names_updated_since(ctx, name_index.updated_until);
+}
+
+static void remember_existence(char* docname, bool exists, long long now) {
+    struct existence *known = malloc(sizeof(struct existence));
+    known->exists = exists;
+    known->checked_time = now;
+    lru_put(&name_index.known, docname, known, sizeof(struct existence) + sizeof(struct lru_entry) + strlen(docname));
+}
+
+static void note_document_exists(char* docname) {
+    if (!name_index.ready)
+        return;
+    index_name(docname);
+    remember_existence(docname, true, get_epoch());
+}
+
+void documents_exist(ConnCtx *ctx, int argc, char** docnames, bool *result) {
+    if (!name_index.ready) {
+        documents_exist_remotely(ctx, argc, docnames, result);
+        return;
+    }
+    refresh_name_index(ctx);
+
+    char* remaining[argc];
+    int remaining_idx[argc];
+    int remaining_cnt = 0;
+    long long now = get_epoch();
+
+    int idx;
+    for (idx = 0; idx < argc; idx++) {
+        char* docname = docnames[idx];
+        if (!bloom_may_contain(&name_index.filter, docname, strlen(docname))) {
+            result[idx] = false;
+            continue;
+        }
+        struct existence *known = lru_get(&name_index.known, docname);
+        if (known && now - known->checked_time < EXISTENCE_VALID_MILLIS) {
+            result[idx] = known->exists;
+            continue;
+        }
+        remaining[remaining_cnt] = docname;
+        remaining_idx[remaining_cnt++] = idx;
+    }
+
+    if (remaining_cnt > 0) {
+        bool remaining_result[remaining_cnt];
+        documents_exist_remotely(ctx, remaining_cnt, remaining, remaining_result);
+        for (idx = 0; idx < remaining_cnt; idx++) {
+            result[remaining_idx[idx]] = remaining_result[idx];
+            remember_existence(remaining[idx], remaining_result[idx], now);
+        }
+    }
+}
+
+// whether the record was compressed with a dictionary set in Redis after the one of this worker. Versions wrap around
+static bool has_newer_dict_version(const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s;
+    if (len < DOC_RECORD_HEADER_SIZE || memcmp(p, DOC_RECORD_MAGIC, 4) || p[4] != DOC_RECORD_VERSION || p[5] == 0)
+        return false;
+    return !compression_dict.version || (signed char)(p[5] - compression_dict.version) > 0;
+}
+
 static bool find_document_from_cache(ConnCtx* ctx, char* docname, Document* doc_out) {
     bool found = false;
     redisReply* reply = redisCommand(ctx->redis, "GET wiki-recent-document-%s", docname);
     REDIS_NOT_ERROR(reply) {
         if (reply->type == REDIS_REPLY_STRING) {
+            if (has_newer_dict_version(reply->str, reply->len))
+                load_compression_dict(ctx);
             if (deserialize_document(doc_out, reply->str, reply->len)) {
                 if (!strcmp(doc_out->name, docname))
                     found = true;
@@ -341,11 +750,313 @@ static void evict_cache(ConnCtx* ctx, char* docname) {
 
 static void cache_document(ConnCtx* ctx, Document* doc) {
     size_t cache_len;
-    char* cache = serialize_document(doc, get_epoch(), &cache_len);
+    doc->cached_time = get_epoch();
+    char* cache = serialize_document(doc, doc->cached_time, &cache_len);
     freeReplyObject(redisCommand(ctx->redis, "SET wiki-recent-document-%s %b", doc->name, cache, cache_len));
     free(cache);
 }
 
+// decompressed straight out of the reply, NULL if the record is broken
+static sds decompress_ast_record(const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s;
+    if (len <= AST_RECORD_HEADER_SIZE || memcmp(p, AST_RECORD_MAGIC, 4))
+        return NULL;
+    uint32_t original_size = get_u32(p + 4);
+    size_t compressed_size = len - AST_RECORD_HEADER_SIZE;
+    if (original_size == 0 || original_size > AST_BLOB_MAX_SIZE || compressed_size > INT_MAX ||
+        original_size > compressed_size * LZ4_MAX_RATIO)
+        return NULL;
+    sds blob = sdsnewlen(NULL, original_size);
+    if (LZ4_decompress_safe(s + AST_RECORD_HEADER_SIZE, blob, (int)compressed_size, (int)original_size) != (int)original_size) {
+        sdsfree(blob);
+        return NULL;
+    }
+    return blob;
+}
+
+// returns NULL if the AST of this revision has not been cached
+sds find_document_ast_blob(ConnCtx* ctx, Document* doc) {
+    sds blob = NULL;
+    redisReply* reply = redisCommand(ctx->redis, "GET wiki-recent-ast-%s-%s", doc->rev, doc->name);
+    REDIS_NOT_ERROR(reply) {
+        if (reply->type == REDIS_REPLY_STRING) {
+            blob = decompress_ast_record(reply->str, reply->len);
+        }
+    }
+    freeReplyObject(reply);
+    return blob;
+}
+
+void cache_document_ast_blob(ConnCtx* ctx, Document* doc, const char *blob, size_t len) {
+    if (len > AST_BLOB_MAX_SIZE)
+        return;
+    int compress_bound = LZ4_compressBound(len);
+    char *record = malloc(AST_RECORD_HEADER_SIZE + compress_bound);
+    memcpy(record, AST_RECORD_MAGIC, 4);
+    put_u32((unsigned char *)record + 4, (uint32_t)len);
+    int compr_size = LZ4_compress_HC(blob, record + AST_RECORD_HEADER_SIZE, len, compress_bound, 4);
+    // keys differ per revision, so nothing else would ever remove the ones of past revisions
+    freeReplyObject(redisCommand(ctx->redis, "SET wiki-recent-ast-%s-%s %b PX %ld", doc->rev, doc->name, record, (size_t)(AST_RECORD_HEADER_SIZE + compr_size), CACHE_VALID_MILLIS));
+    free(record);
+}
+
+#define MAKE_CACHE_HEADER(expr, name, percent) do {  \
+    header = sdscatprintf(header, name":"percent"\n", expr); \
+    } while (0)
+
+char* serialize_rendered_document(RenderedDocument *rendered, const struct iovec *html, int html_count, long long cached_time, size_t *buf_size_out) {
+    RAII_SDS sds header = sdsempty();
+    RAII_SDS sds link_names = sdsempty();
+    int idx;
+
+    RAII_SDS sds link_exists = sdsnewlen(NULL, rendered->link_count);
+    for (idx = 0; idx < rendered->link_count; idx++) {
+        link_names = sdscatlen(link_names, rendered->links[idx], sdslen(rendered->links[idx]) + 1);
+        link_exists[idx] = rendered->link_exists[idx]? '1' : '0';
+    }
+    // link names go first as a block of their own. Empty chunks make no block
+    size_t original_size = sdslen(link_names);
+    size_t compress_bound = 4 + LZ4_compressBound(sdslen(link_names));
+    int block_count = 1;
+    for (idx = 0; idx < html_count; idx++) {
+        if (html[idx].iov_len == 0)
+            continue;
+        original_size += html[idx].iov_len;
+        compress_bound += 4 + LZ4_compressBound(html[idx].iov_len);
+        block_count++;
+    }
+
+    MAKE_CACHE_HEADER(rendered->name, "name", "%s");
+    MAKE_CACHE_HEADER(rendered->rev, "rev", "%s");
+    MAKE_CACHE_HEADER(rendered->renderer_version, "renderer_version", "%d");
+    MAKE_CACHE_HEADER(rendered->link_count, "link_count", "%d");
+    MAKE_CACHE_HEADER(link_exists, "link_exists", "%s");
+    MAKE_CACHE_HEADER(original_size, "original_size", "%zu");
+    MAKE_CACHE_HEADER(block_count, "block_count", "%d");
+    MAKE_CACHE_HEADER(cached_time, "cached_time", "%lld");
+    header = sdscat(header, "\n");
+    size_t header_len = sdslen(header);
+
+    char* buf = malloc(header_len + compress_bound);
+    memcpy(buf, header, header_len * sizeof(char));
+    // blocks refer back to the ones before them, which all stay where they are until the end
+    LZ4_streamHC_t *stream = LZ4_createStreamHC();
+    LZ4_resetStreamHC(stream, 4);
+    size_t offset = header_len;
+    for (idx = -1; idx < html_count; idx++) {
+        const char *src = idx < 0? link_names : html[idx].iov_base;
+        int src_len = idx < 0? (int)sdslen(link_names) : (int)html[idx].iov_len;
+        if (idx >= 0 && src_len == 0)
+            continue;
+        int bound = LZ4_compressBound(src_len);
+        int compr_size = LZ4_compress_HC_continue(stream, src, buf + offset + 4, src_len, bound);
+        put_u32((unsigned char *)buf + offset, (uint32_t)compr_size);
+        offset += 4 + compr_size;
+    }
+    LZ4_freeStreamHC(stream);
+    *buf_size_out = offset;
+    return buf;
+}
+
+// header values are not NUL-terminated when they end the buffer
+static long long header_to_ll(const char *val, size_t val_len) {
+    char tmp[32];
+    if (val_len >= sizeof(tmp))
+        return -1;
+    memcpy(tmp, val, val_len);
+    tmp[val_len] = 0;
+    return strtoll(tmp, NULL, 10);
+}
+
+bool deserialize_rendered_document(RenderedDocument *rendered_out, char *s, size_t len) {
+    char *s_ed = s + len;
+    char *p = s;
+    int idx;
+
+    long long original_size = -1;
+    long long block_count = -1;
+    char *link_exists = NULL;
+    size_t link_exists_len = 0;
+    bool renderer_version_supplied = false;
+    bool cached_time_supplied = false;
+    while (p < s_ed && *p != '\n') {
+        char *key = p;
+        while (p < s_ed && *p != ':' && *p != '\n') 
+            p++;
+        if (p >= s_ed || *p == '\n')
+            goto failure;
+        size_t key_len = p - key;
+        p++;
+        char *val = p;
+        while (p < s_ed && *p != '\n') 
+            p++;
+        size_t val_len = p - val;
+        if (p < s_ed)
+            p++;
+
+#define KEY_IS(name) (key_len == strlen(name) && !strncmp(key, name, key_len))
+        if (KEY_IS("name")) {
+            rendered_out->name = sdsnewlen(val, val_len);
+        } else if (KEY_IS("rev")) {
+            rendered_out->rev = sdsnewlen(val, val_len);
+        } else if (KEY_IS("renderer_version")) {
+            renderer_version_supplied = true;
+            rendered_out->renderer_version = (int)header_to_ll(val, val_len);
+        } else if (KEY_IS("link_count")) {
+            rendered_out->link_count = (int)header_to_ll(val, val_len);
+        } else if (KEY_IS("link_exists")) {
+            link_exists = val;
+            link_exists_len = val_len;
+        } else if (KEY_IS("original_size")) {
+            original_size = header_to_ll(val, val_len);
+        } else if (KEY_IS("block_count")) {
+            block_count = header_to_ll(val, val_len);
+        } else if (KEY_IS("cached_time")) {
+            cached_time_supplied = true;
+            rendered_out->cached_time = header_to_ll(val, val_len);
+        }
+#undef KEY_IS
+    }
+    if (!rendered_out->name || !rendered_out->rev || !renderer_version_supplied || !cached_time_supplied ||
+        original_size <= 0 || original_size > RENDERED_MAX_SIZE || block_count < 1 ||
+        rendered_out->link_count < 0 || rendered_out->link_count > RENDERED_MAX_LINK_COUNT ||
+        link_exists_len != (size_t)rendered_out->link_count)
+        goto failure;
+    if (p >= s_ed)
+        goto failure;
+    p++; // consume '\n'
+    // a forged size would have the buffer allocated before any block fails to decode
+    if (original_size > (long long)(s_ed - p) * LZ4_MAX_RATIO)
+        goto failure;
+
+    // blocks are decoded one after another into the same buffer, where the ones they refer back to already are
+    sds payload = sdsnewlen(NULL, original_size);
+    LZ4_streamDecode_t stream;
+    LZ4_setStreamDecode(&stream, NULL, 0);
+    long long dec_size = 0;
+    long long block_idx;
+    for (block_idx = 0; block_idx < block_count; block_idx++) {
+        if (s_ed - p < 4)
+            break;
+        uint32_t compr_size = get_u32((const unsigned char *)p);
+        p += 4;
+        if (compr_size > (size_t)(s_ed - p) || compr_size > INT_MAX)
+            break;
+        int block_size = LZ4_decompress_safe_continue(&stream, p, payload + dec_size, (int)compr_size, (int)(original_size - dec_size));
+        if (block_size < 0)
+            break;
+        dec_size += block_size;
+        p += compr_size;
+    }
+    if (block_idx != block_count || p != s_ed || dec_size != original_size) {
+        sdsfree(payload);
+        goto failure;
+    }
+
+    char *q = payload;
+    char *payload_ed = payload + original_size;
+    rendered_out->links = calloc(rendered_out->link_count, sizeof(sds));
+    rendered_out->link_exists = calloc(rendered_out->link_count, sizeof(bool));
+    for (idx = 0; idx < rendered_out->link_count; idx++) {
+        char *link_ed = memchr(q, '\0', payload_ed - q);
+        if (!link_ed) {
+            sdsfree(payload);
+            goto failure;
+        }
+        rendered_out->links[idx] = sdsnewlen(q, link_ed - q);
+        rendered_out->link_exists[idx] = link_exists[idx] == '1';
+        q = link_ed + 1;
+    }
+    // the html stays in the decompression buffer
+    sdsrange(payload, q - payload, -1);
+    rendered_out->html = payload;
+    return true;
+
+failure:
+    RenderedDocument_remove(rendered_out);
+    return false;
+}
+
+static void sds_value_free(void *value) {
+    sdsfree(value);
+}
+
+static struct lru* get_rendered_lru() {
+    static struct lru rendered_lru;
+    static bool initialized = false;
+    if (!initialized) {
+        lru_init(&rendered_lru, RENDERED_LRU_BUDGET, sds_value_free);
+        initialized = true;
+    }
+    return &rendered_lru;
+}
+
+static sds rendered_cache_key(char *name, char *rev, int renderer_version) {
+    return sdscatprintf(sdsempty(), "wiki-rendered-%d-%s-%s", renderer_version, rev, name);
+}
+
+bool find_rendered_document(ConnCtx* ctx, Document* doc, int renderer_version, RenderedDocument* rendered_out) {
+    RAII_SDS sds key = rendered_cache_key(doc->name, doc->rev, renderer_version);
+    struct lru *lru = get_rendered_lru();
+    bool cached = false;
+    bool found = false;
+
+    sds blob = lru_get(lru, key);
+    if (blob) {
+        cached = true;
+        found = deserialize_rendered_document(rendered_out, blob, sdslen(blob));
+    } else {
+        redisReply* reply = redisCommand(ctx->redis, "GET %s", key);
+        REDIS_NOT_ERROR(reply) {
+            if (reply->type == REDIS_REPLY_STRING) {
+                cached = true;
+                found = deserialize_rendered_document(rendered_out, reply->str, reply->len);
+                if (found)
+                    lru_put(lru, key, sdsnewlen(reply->str, reply->len), reply->len);
+            }
+        }
+        freeReplyObject(reply);
+    }
+    if (!found)
+        goto miss;
+    if (strcmp(rendered_out->name, doc->name) || strcmp(rendered_out->rev, doc->rev) || rendered_out->renderer_version != renderer_version)
+        goto miss;
+
+    if (rendered_out->link_count > 0) {
+        // red links turn blue and vice versa without the page itself changing
+        bool *link_exists = malloc(sizeof(bool) * rendered_out->link_count);
+        documents_exist(ctx, rendered_out->link_count, rendered_out->links, link_exists);
+        bool changed = false;
+        int idx;
+        for (idx = 0; idx < rendered_out->link_count && !changed; idx++)
+            changed = link_exists[idx] != rendered_out->link_exists[idx];
+        free(link_exists);
+        if (changed)
+            goto miss;
+    }
+    return true;
+
+miss:
+    if (cached) {
+        lru_del(lru, key);
+        freeReplyObject(redisCommand(ctx->redis, "DEL %s", key));
+    }
+    RenderedDocument_remove(rendered_out);
+    return false;
+}
+
+void cache_rendered_document(ConnCtx* ctx, RenderedDocument* rendered, const struct iovec *html, int html_count) {
+    if (rendered->link_count > RENDERED_MAX_LINK_COUNT)
+        return;
+    RAII_SDS sds key = rendered_cache_key(rendered->name, rendered->rev, rendered->renderer_version);
+    size_t cache_len;
+    char* cache = serialize_rendered_document(rendered, html, html_count, get_epoch(), &cache_len);
+    // keys differ per revision and renderer version, so nothing else would ever remove the ones of past revisions
+    freeReplyObject(redisCommand(ctx->redis, "SET %s %b PX %ld", key, cache, cache_len, CACHE_VALID_MILLIS));
+    lru_put(get_rendered_lru(), key, sdsnewlen(cache, cache_len), cache_len);
+    free(cache);
+}
+
 static bool is_cache_up_to_date(Document* doc) {
     long long cur_epoch = get_epoch();
     if (cur_epoch >= doc->cached_time + CACHE_VALID_MILLIS) {
@@ -377,21 +1088,257 @@ static bool find_document_from_main_storage(ConnCtx* ctx, char* docname, Documen
 }
 
 
-bool find_document(ConnCtx* ctx, char* docname, Document* doc_out) {
+/*
+ * Worker tier
+ * Decoded documents are kept in the worker, saving a round trip to Redis and a decompression.
+ * Each copy keeps cached_time of the Redis record it came from, so it expires along with the record,
+ * and is dropped earlier once the name index sees the document updated.
+ */
+static void Document_free(void *value) {
+    Document_remove(value);
+    free(value);
+}
+
+static struct lru* get_document_lru() {
+    static struct lru document_lru;
+    static bool initialized = false;
+    if (!initialized) {
+        lru_init(&document_lru, DOCUMENT_LRU_BUDGET, Document_free);
+        initialized = true;
+    }
+    return &document_lru;
+}
+
+static void Document_copy(Document *dst, Document *src) {
+    dst->name = sdsdup(src->name);
+    dst->rev = sdsdup(src->rev);
+    dst->source = sdsdup(src->source);
+    dst->updated_time = src->updated_time;
+    dst->collected_time = src->collected_time;
+    dst->cached_time = src->cached_time;
+}
+
+static bool find_document_from_worker(char* docname, Document* doc_out) {
+    struct lru *lru = get_document_lru();
+    Document *cached = lru_get(lru, docname);
+    if (!cached)
+        return false;
+    if (!is_cache_up_to_date(cached)) {
+        lru_del(lru, docname);
+        return false;
+    }
+    Document_copy(doc_out, cached);
+    return true;
+}
+
+// replaces the copy of an older revision, if any
+static void keep_document_in_worker(Document* doc) {
+    Document *copy = malloc(sizeof(Document));
+    Document_copy(copy, doc);
+    size_t size = sizeof(Document) + sdslen(copy->name) + sdslen(copy->rev) + sdslen(copy->source);
+    lru_put(get_document_lru(), copy->name, copy, size);
+}
+
+/*
+ * Single-flight
+ * When a document is missing from the worker, only the first async core asking for it goes to Redis and MariaDB.
+ * The others sleep on the pipe of its flight, which is written once the document is in the worker tier (or known not to exist).
+ * Across workers, the one fetching from MariaDB holds wiki-fetching-document-<name> in Redis, set to a nonce of the fetch.
+ * The others count themselves in wiki-fetch-waiters-<nonce> and block on the list wiki-fetched-document-<nonce>,
+ * into which the holder pushes a token for each of them once Redis is filled and the lock is released.
+ */
+struct flight {
+    char *docname;
+    int pipe_fds[2];
+    int waiters;
+    bool done;
+    bool found;
+    UT_hash_handle hh;
+};
+
+static struct flight *flights = NULL;
+
+static void free_flight(struct flight *flight) {
+    close(flight->pipe_fds[0]);
+    close(flight->pipe_fds[1]);
+    free(flight->docname);
+    free(flight);
+}
+
+// returns NULL if a flight for docname is already on the way
+static struct flight* begin_flight(char* docname) {
+    struct flight *flight;
+    HASH_FIND_STR(flights, docname, flight);
+    if (flight)
+        return NULL;
+    flight = malloc(sizeof(struct flight));
+    if (pipe(flight->pipe_fds)) {
+        free(flight);
+        return NULL;
+    }
+    flight->docname = strdup(docname);
+    flight->waiters = 0;
+    flight->done = false;
+    flight->found = false;
+    HASH_ADD_KEYPTR(hh, flights, flight->docname, strlen(flight->docname), flight);
+    return flight;
+}
+
+static void end_flight(struct flight* flight, bool found) {
+    if (!flight)
+        return;
+    HASH_DEL(flights, flight);
+    flight->done = true;
+    flight->found = found;
+    if (flight->waiters > 0) {
+        // wakes every waiter, as nobody reads it
+        ssize_t written = write(flight->pipe_fds[1], "", 1);
+        (void)written;
+    } else
+        free_flight(flight);
+}
+
+// returns false if the flight has found that the document doesn't exist
+static bool wait_for_flight(ConnCtx* ctx, struct flight* flight) {
+    flight->waiters++;
+    while (!flight->done) {
+        if (ctx->wait_read_hook(flight->pipe_fds[0], FLIGHT_TIMEOUT_SECS) <= 0)
+            break;
+    }
+    flight->waiters--;
+
+    bool not_found = flight->done && !flight->found;
+    if (flight->done && flight->waiters == 0)
+        free_flight(flight);
+    return !not_found;
+}
+
+static sds new_fetch_nonce() {
+    static unsigned int fetch_cnt = 0;
+    return sdscatprintf(sdsempty(), "%d-%lld-%u", (int)getpid(), get_epoch(), fetch_cnt++);
+}
+
+static bool try_fetch_lock(ConnCtx* ctx, char* docname, char* nonce) {
+    redisReply* reply = redisCommand(ctx->redis, "SET wiki-fetching-document-%s %s NX PX %d", docname, nonce, FETCH_LOCK_MILLIS);
+    bool acquired = reply && reply->type == REDIS_REPLY_STATUS && !strcmp(reply->str, "OK");
+    freeReplyObject(reply);
+    return acquired;
+}
+
+// NULL if nobody holds the lock
+static sds get_fetch_lock_nonce(ConnCtx* ctx, char* docname) {
+    sds nonce = NULL;
+    redisReply* reply = redisCommand(ctx->redis, "GET wiki-fetching-document-%s", docname);
+    if (reply && reply->type == REDIS_REPLY_STRING)
+        nonce = sdsnewlen(reply->str, reply->len);
+    freeReplyObject(reply);
+    return nonce;
+}
+
+// wakes every worker blocked in wait_for_fetch on this fetch. Tokens are gone by FETCH_LOCK_MILLIS if nobody takes them
+static void release_fetch_lock(ConnCtx* ctx, char* docname, char* nonce) {
+    freeReplyObject(redisCommand(ctx->redis, "DEL wiki-fetching-document-%s", docname));
+
+    // counted after the lock is gone, as waiters who find it gone don't wait
+    long long waiter_cnt = 0;
+    redisReply* reply = redisCommand(ctx->redis, "GET wiki-fetch-waiters-%s", nonce);
+    if (reply && reply->type == REDIS_REPLY_STRING)
+        waiter_cnt = strtoll(reply->str, NULL, 10);
+    freeReplyObject(reply);
+    if (waiter_cnt <= 0)
+        return;
+
+    long long idx;
+    for (idx = 0; idx < waiter_cnt; idx++)
+        redisAppendCommand(ctx->redis, "RPUSH wiki-fetched-document-%s 1", nonce);
+    redisAppendCommand(ctx->redis, "PEXPIRE wiki-fetched-document-%s %d", nonce, FETCH_LOCK_MILLIS);
+    for (idx = 0; idx <= waiter_cnt; idx++) {
+        redisGetReply(ctx->redis, (void **)&reply);
+        freeReplyObject(reply);
+    }
+}
+
+// returns false if the lock holder has not notified within the lifetime of its lock
+static bool wait_for_fetch(ConnCtx* ctx, char* docname) {
+    RAII_SDS sds nonce = get_fetch_lock_nonce(ctx, docname);
+    if (!nonce)
+        return true;
+    freeReplyObject(redisCommand(ctx->redis, "INCR wiki-fetch-waiters-%s", nonce));
+    freeReplyObject(redisCommand(ctx->redis, "PEXPIRE wiki-fetch-waiters-%s %d", nonce, FETCH_LOCK_MILLIS));
+
+    // released before the holder could count this one in
+    RAII_SDS sds current_nonce = get_fetch_lock_nonce(ctx, docname);
+    if (!current_nonce || sdscmp(current_nonce, nonce))
+        return true;
+
+    redisReply* reply = redisCommand(ctx->redis, "BLPOP wiki-fetched-document-%s %d", nonce, FETCH_LOCK_MILLIS / 1000);
+    bool notified = reply && reply->type == REDIS_REPLY_ARRAY;
+    freeReplyObject(reply);
+    return notified;
+}
+
+static bool fetch_document(ConnCtx* ctx, char* docname, Document* doc_out) {
     if (find_document_from_cache(ctx, docname, doc_out)) {
         if (is_cache_up_to_date(doc_out)) {
             // HAPPY HAPPY
+            keep_document_in_worker(doc_out);
             return true;
         }
         evict_cache(ctx, doc_out->name);
     }
+    // whatever a stale or mismatching record left behind
+    Document_remove(doc_out);
 
-    if (find_document_from_main_storage(ctx, docname, doc_out)) {
+    bool locked = false;
+    RAII_SDS sds nonce = ctx->lock_across_workers? new_fetch_nonce() : NULL;
+    if (ctx->lock_across_workers) {
+        int tries;
+        for (tries = 0; tries < FETCH_LOCK_WAIT_TRIES; tries++) {
+            if ((locked = try_fetch_lock(ctx, docname, nonce)))
+                break;
+            // another worker is on it
+            if (!wait_for_fetch(ctx, docname))
+                continue;
+            if (find_document_from_cache(ctx, docname, doc_out) && is_cache_up_to_date(doc_out)) {
+                keep_document_in_worker(doc_out);
+                return true;
+            }
+            Document_remove(doc_out);
+        }
+    }
+
+    bool found = find_document_from_main_storage(ctx, docname, doc_out);
+    if (found) {
+        note_document_exists(doc_out->name);
         // hoping that LRU caching be done automatically
         cache_document(ctx, doc_out); 
-        return true;
+        keep_document_in_worker(doc_out);
     }
-    return false;
+    if (locked)
+        release_fetch_lock(ctx, docname, nonce);
+    return found;
+}
+
+bool find_document(ConnCtx* ctx, char* docname, Document* doc_out) {
+    struct flight *flight;
+    int tries;
+    // drops copies of documents updated since the last look
+    refresh_name_index(ctx);
+    for (tries = 0; ; tries++) {
+        if (find_document_from_worker(docname, doc_out)) {
+            return true;
+        }
+        HASH_FIND_STR(flights, docname, flight);
+        if (!flight || tries == 2)
+            break;
+        if (!wait_for_flight(ctx, flight))
+            return false;
+    }
+
+    flight = begin_flight(docname);
+    bool found = fetch_document(ctx, docname, doc_out);
+    end_flight(flight, found);
+    return found;
 }
 
 void Document_init(Document* doc) {
@@ -409,3 +1356,30 @@ void Document_remove(Document* doc) {
     SAFELY_SDS_FREE(doc->rev);
     SAFELY_SDS_FREE(doc->source);
 }
+
+void RenderedDocument_init(RenderedDocument* rendered) {
+    rendered->name = NULL;
+    rendered->rev = NULL;
+    rendered->renderer_version = -1;
+    rendered->cached_time = -1;
+    rendered->link_count = 0;
+    rendered->links = NULL;
+    rendered->link_exists = NULL;
+    rendered->html = NULL;
+}
+
+void RenderedDocument_remove(RenderedDocument* rendered) {
+    int idx;
+    if (rendered->links) {
+        for (idx = 0; idx < rendered->link_count; idx++) {
+            SAFELY_SDS_FREE(rendered->links[idx]);
+        }
+        free(rendered->links);
+    }
+    if (rendered->link_exists)
+        free(rendered->link_exists);
+    SAFELY_SDS_FREE(rendered->name);
+    SAFELY_SDS_FREE(rendered->rev);
+    SAFELY_SDS_FREE(rendered->html);
+    RenderedDocument_init(rendered);
+}
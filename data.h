@@ -2,6 +2,7 @@
 #define _DATA_H
 
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #include "sds/sds.h"
 #include "mariadb-connector-c/include/mysql.h"
@@ -17,6 +18,9 @@ typedef struct {
 
     int (*wait_read_hook)(int fd, int timeout);
     int (*wait_write_hook)(int fd, int timeout);
+
+    // also coordinate cache misses with other workers through a short lock in Redis
+    bool lock_across_workers;
 } ConnCtx;
 
 typedef struct {
@@ -34,11 +38,52 @@ void Document_remove(Document* doc);
 
 #define RAII_Document RAII(Document_remove)
 
+typedef struct {
+    sds name;
+    sds rev;
+    int renderer_version;
+    long long cached_time;
+
+    // internal links of the page and whether each of them existed at rendering time
+    int link_count;
+    sds *links;
+    bool *link_exists;
+
+    sds html; // only read back. The page is written from the chunks it was generated in
+} RenderedDocument;
+
+void RenderedDocument_init(RenderedDocument* rendered);
+void RenderedDocument_remove(RenderedDocument* rendered);
+
+#define RAII_RenderedDocument RAII(RenderedDocument_remove)
+
 bool find_document(ConnCtx* ctx, sds docname, Document* doc_out);
 
 char* serialize_document(Document *slot, long long cached_time, size_t* buf_size_out);
 bool deserialize_document(Document *doc_out, char *s, size_t len);
 
+// "NMDI" version:u8 followed by the dictionary, as written by dict_builder
+#define COMPRESSION_DICT_MAGIC "NMDI"
+#define COMPRESSION_DICT_MAX_SIZE (64 * 1024)
+
+// Documents are compressed with the dictionary once it is set, which also needs to be done before reading entries made with it.
+// find_document loads it again when it reads an entry made with a newer one. Both return false if no valid dictionary is given.
+bool set_compression_dict(const char *blob, size_t len);
+bool load_compression_dict(ConnCtx* ctx);
+
 void documents_exist(ConnCtx *ctx, int argc, sds* docnames, bool *result);
+// Builds the name index of the worker, after which documents_exist only asks Redis and MariaDB about names it cannot rule out
+void init_name_index(ConnCtx *ctx);
+
+// The rendered page of doc, if its revision was rendered by the same renderer_version and none of its links has appeared or disappeared since
+bool find_rendered_document(ConnCtx* ctx, Document* doc, int renderer_version, RenderedDocument* rendered_out);
+void cache_rendered_document(ConnCtx* ctx, RenderedDocument* rendered, const struct iovec *html, int html_count);
+
+char* serialize_rendered_document(RenderedDocument *rendered, const struct iovec *html, int html_count, long long cached_time, size_t* buf_size_out);
+bool deserialize_rendered_document(RenderedDocument *rendered_out, char *s, size_t len);
+
+// Parsed ASTs are cached per revision next to the source, compressed with LZ4. The blob is opaque here (see astcodec.h)
+sds find_document_ast_blob(ConnCtx* ctx, Document* doc);
+void cache_document_ast_blob(ConnCtx* ctx, Document* doc, const char *blob, size_t len);
 
 #endif
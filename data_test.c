@@ -23,6 +23,7 @@ int main(int argc, char** argv) {
     ConnCtx conn;
     conn.wait_read_hook = wait_read;
     conn.wait_write_hook = wait_write;
+    conn.lock_across_workers = false;
 
     MYSQL mysql_mem;
     conn.mysql = mysql_init(&mysql_mem);
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4/lib/lz4.h"
+#include "lz4/lib/lz4hc.h"
+#include "uthash/src/uthash.h"
+
+/*
+ * Builds the LZ4 dictionary for cached documents out of sample pages
+ * ===
+ * dict_builder <output> <version(1-255)> <sample>...
+ *
+ * LZ4 has no trainer of its own, so segments found in the most samples are packed in the dictionary,
+ * the most common ones last as LZ4 reaches them with the shortest offsets.
+ * The output is "NMDI" version:u8 dictionary (see data.h), ready to be stored with
+ *   redis-cli -x SET wiki-lz4-dict < output
+ */
+
+#define SEGMENT_LEN 16
+#define DICT_MAX_SIZE (64 * 1024)
+
+struct segment {
+    char key[SEGMENT_LEN];
+    int sample_count;
+    int last_sample;
+    UT_hash_handle hh;
+};
+
+static void pfree(char **p) {
+    free(*p);
+    *p = NULL;
+}
+
+#define AUTOF __attribute__((cleanup(pfree)))
+
+static char* read_file(const char *path, long *size_out) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return NULL;
+    }
+    fseek(fp, 0L, SEEK_END);
+    long filesize = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    char *buffer = calloc(filesize + 1, 1);
+    fread(buffer, 1, filesize, fp);
+    fclose(fp);
+    *size_out = filesize;
+    return buffer;
+}
+
+static int by_sample_count(struct segment *lhs, struct segment *rhs) {
+    return rhs->sample_count - lhs->sample_count;
+}
+
+static long compressed_size(char *src, long size, char *dict, int dict_size) {
+    int bound = LZ4_compressBound(size);
+    char *dst AUTOF = malloc(bound);
+    LZ4_streamHC_t *stream = LZ4_createStreamHC();
+    LZ4_resetStreamHC(stream, 4);
+    if (dict_size > 0)
+        LZ4_loadDictHC(stream, dict, dict_size);
+    long ret = LZ4_compress_HC_continue(stream, src, dst, size, bound);
+    LZ4_freeStreamHC(stream);
+    return ret;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <output> <version(1-255)> <sample>...\n", argv[0]);
+        return 1;
+    }
+    int version = atoi(argv[2]);
+    if (version < 1 || version > 255) {
+        fprintf(stderr, "version should be in 1-255\n");
+        return 1;
+    }
+    int sample_cnt = argc - 3;
+    char *samples[sample_cnt];
+    long sample_sizes[sample_cnt];
+
+    struct segment *table = NULL, *seg, *tmp;
+    int idx;
+    for (idx = 0; idx < sample_cnt; idx++) {
+        samples[idx] = read_file(argv[idx + 3], &sample_sizes[idx]);
+        if (!samples[idx])
+            return 1;
+        long offset;
+        for (offset = 0; offset + SEGMENT_LEN <= sample_sizes[idx]; offset++) {
+            char *p = samples[idx] + offset;
+            HASH_FIND(hh, table, p, SEGMENT_LEN, seg);
+            if (!seg) {
+                seg = calloc(1, sizeof(struct segment));
+                memcpy(seg->key, p, SEGMENT_LEN);
+                seg->last_sample = -1;
+                HASH_ADD(hh, table, key, SEGMENT_LEN, seg);
+            }
+            // counted once per sample so that one long page doesn't dominate
+            if (seg->last_sample != idx) {
+                seg->last_sample = idx;
+                seg->sample_count++;
+            }
+        }
+    }
+    HASH_SORT(table, by_sample_count);
+
+    // filled from the back, with the most common segments
+    char *dict AUTOF = malloc(DICT_MAX_SIZE);
+    int dict_size = 0;
+    HASH_ITER(hh, table, seg, tmp) {
+        if (seg->sample_count < 2 || dict_size + SEGMENT_LEN > DICT_MAX_SIZE)
+            break;
+        char *filled = dict + DICT_MAX_SIZE - dict_size;
+        if (memmem(filled, dict_size, seg->key, SEGMENT_LEN))
+            continue;
+        memcpy(filled - SEGMENT_LEN, seg->key, SEGMENT_LEN);
+        dict_size += SEGMENT_LEN;
+    }
+    char *dict_st = dict + DICT_MAX_SIZE - dict_size;
+
+    FILE *out = fopen(argv[1], "wb");
+    if (!out) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    unsigned char version_byte = (unsigned char)version;
+    fwrite("NMDI", 1, 4, out);
+    fwrite(&version_byte, 1, 1, out);
+    fwrite(dict_st, 1, dict_size, out);
+    fclose(out);
+
+    long total = 0, plain = 0, with_dict = 0;
+    for (idx = 0; idx < sample_cnt; idx++) {
+        total += sample_sizes[idx];
+        plain += compressed_size(samples[idx], sample_sizes[idx], NULL, 0);
+        with_dict += compressed_size(samples[idx], sample_sizes[idx], dict_st, dict_size);
+        free(samples[idx]);
+    }
+    printf("Dictionary version %d: %.2lfKB\n", version, (double)dict_size / 1000.);
+    printf("Samples: %.2lfKB\n", (double)total / 1000.);
+    printf("Compressed without dictionary: %.2lfKB\n", (double)plain / 1000.);
+    printf("Compressed with dictionary: %.2lfKB\n", (double)with_dict / 1000.);
+
+    HASH_ITER(hh, table, seg, tmp) {
+        HASH_DEL(table, seg);
+        free(seg);
+    }
+    return 0;
+}
@@ -38,6 +38,8 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <limits.h>
 #include <assert.h>
 
@@ -52,6 +54,7 @@
 struct _ctx {
     diff_cmp_fn cmp;
     void *context;
+    int32_t unmatchable;
     int *buf;
     struct diff_edit *ses;
     int ses_capacity;
@@ -86,87 +89,6 @@ static inline int _v(struct _ctx *ctx, int k, int reverse) {
     return ctx->buf[j];
 }
 
-static int _find_middle_snake(const void *a, int aoff, int n,
-                              const void *b, int boff, int m,
-                              struct _ctx *ctx,
-                              struct middle_snake *ms) {
-    int delta, odd, mid, d;
-
-    delta = n - m;
-    odd = delta & 1;
-    mid = (n + m) / 2;
-    mid += odd;
-
-    SET_FORWARD_V(1, 0);
-    SET_REVERSE_V(delta - 1, n);
-
-    for (d = 0; d <= mid; d++) {
-        int k, x, y;
-
-        // EXPERIMENTIAL
-        if ((2 * d - 1) > ctx->dmax) {
-            return -1;
-        }
-
-        // going ahead
-        for (k = d; k >= -d; k -= 2) {
-            if (k == -d || (k != d && FOWARD_V(k - 1) < FOWARD_V(k + 1))) {
-                x = FOWARD_V(k + 1);
-            } else {
-                x = FOWARD_V(k - 1) + 1;
-            }
-            y = x - k;
-
-            ms->x = x;
-            ms->y = y;
-            while (x < n && y < m && 
-                   ctx->cmp(a, b, aoff + x, boff + y, ctx->context) == 0) {
-                x++; y++;
-            }
-            SET_FORWARD_V(k, x);
-
-            if (odd && k >= (delta - (d - 1)) && k <= (delta + (d - 1))) {
-                if (x >= REVERSE_V(k)) {
-                    ms->u = x;
-                    ms->v = y;
-                    return 2 * d - 1;
-                }
-            }
-        }
-
-        // going backward
-        for (k = d; k >= -d; k -= 2) {
-            int kr = (n - m) + k;
-
-            if (k == d || (k != -d && REVERSE_V(kr - 1) < REVERSE_V(kr + 1))) {
-                x = REVERSE_V(kr - 1);
-            } else {
-                x = REVERSE_V(kr + 1) - 1;
-            }
-            y = x - kr;
-
-            ms->u = x;
-            ms->v = y;
-            while (x > 0 && y > 0 && 
-                   ctx->cmp(a, b,  aoff + (x - 1), boff + (y - 1), ctx->context) == 0) {
-                x--; y--;
-            } 
-            SET_REVERSE_V(kr, x);
-
-            if (!odd && kr >= -d && kr <= d) {
-                if (x <= FOWARD_V(kr)) {
-                    ms->x = x;
-                    ms->y = y;
-                    return 2 * d;
-                }
-            }
-        }
-    }
-
-
-    return -1;
-}
-
 static void _edit(struct _ctx *ctx, int op, int off, int len)
 {
     struct diff_edit *e, *top;
@@ -213,98 +135,42 @@ static void _edit(struct _ctx *ctx, int op, int off, int len)
     e->len = len;
 }
 
-static int _ses(const void *a, int aoff, int n,
-                const void *b, int boff, int m,
-                struct _ctx *ctx)
-{
-    struct middle_snake ms;
-    int d;
+#define DIFF_SUFFIX _cb
+#define DIFF_EQ(a, b, x, y, ctx) ((ctx)->cmp((a), (b), (x), (y), (ctx)->context) == 0)
+#include "diff_core.inc"
 
-    if (n == 0) {
-        _edit(ctx, DIFF_INSERT, boff, m);
-        d = m;
-    } else if (m == 0) {
-        _edit(ctx, DIFF_DELETE, aoff, n);
-        d = n;
-    } else {
-                    /* Find the middle "snake" around which we
-                     * recursively solve the sub-problems.
-                     */
-        d = _find_middle_snake(a, aoff, n, b, boff, m, ctx, &ms);
-        if (d == -1) {
-            return -1;
-        } else if (d > ctx->dmax) {
-            return -1;
-        } else if (ctx->ses == NULL) {
-            return d;
-        } else if (d > 1) {
-            if (_ses(a, aoff, ms.x, b, boff, ms.y, ctx) == -1) {
-                return -1;
-            }
+#define DIFF_SUFFIX _u8
+#define DIFF_EQ(a, b, x, y, ctx) (((const unsigned char *)(a))[x] == ((const unsigned char *)(b))[y])
+#include "diff_core.inc"
 
-            _edit(ctx, DIFF_MATCH, aoff + ms.x, ms.u - ms.x);
+#define DIFF_SUFFIX _i32
+#define DIFF_EQ(a, b, x, y, ctx) (((const int32_t *)(a))[x] == ((const int32_t *)(b))[y])
+#include "diff_core.inc"
 
-            aoff += ms.u;
-            boff += ms.v;
-            n -= ms.u;
-            m -= ms.v;
-            if (_ses(a, aoff, n, b, boff, m, ctx) == -1) {
-                return -1;
-            }
-        } else {
-            int x = ms.x;
-            int u = ms.u;
-
-                 /* There are only 4 base cases when the
-                  * edit distance is 1.
-                  *
-                  * n > m   m > n
-                  *
-                  *   -       |
-                  *    \       \    x != u
-                  *     \       \
-                  *
-                  *   \       \
-                  *    \       \    x == u
-                  *     -       |
-                  */
-
-            if (m > n) {
-                if (x == u) {
-                    _edit(ctx, DIFF_MATCH, aoff, n);
-                    _edit(ctx, DIFF_INSERT, boff + (m - 1), 1);
-                } else {
-                    _edit(ctx, DIFF_INSERT, boff, 1);
-                    _edit(ctx, DIFF_MATCH, aoff, n);
-                }
-            } else {
-                if (x == u) {
-                    _edit(ctx, DIFF_MATCH, aoff, m);
-                    _edit(ctx, DIFF_DELETE, aoff + (n - 1), 1);
-                } else {
-                    _edit(ctx, DIFF_DELETE, aoff, 1);
-                    _edit(ctx, DIFF_MATCH, aoff + 1, m);
-                }
-            }
-        }
-    }
+// elements of a equal to ctx->unmatchable match nothing
+#define DIFF_SUFFIX _i32u
+#define DIFF_EQ(a, b, x, y, ctx) (((const int32_t *)(a))[x] == ((const int32_t *)(b))[y] && ((const int32_t *)(a))[x] != (ctx)->unmatchable)
+#include "diff_core.inc"
 
-    return d;
-}
+typedef int (*diff_core_fn)(const void *a, int aoff, int n, const void *b, int boff, int m, struct _ctx *ctx);
 
 int diff_get_vbuf_size(int m, int n) {
     return 8 * (m + n + 1);
 }
 
-int diff(const void *a, int aoff, int n,
-         const void *b, int boff, int m,
-         diff_cmp_fn cmp, void *context, int dmax,
-         int *vbuf,
-         struct diff_edit **ses_ret, int *ses_n_ret) {
-    int d, x, y;
+static int run_diff(diff_core_fn core,
+                    const void *a, int aoff, int n,
+                    const void *b, int boff, int m,
+                    diff_cmp_fn cmp, void *context, int32_t unmatchable, int dmax,
+                    int *vbuf,
+                    struct diff_edit **ses_ret, int *ses_n_ret) {
+    int d;
 
     dmax = dmax >= 0? dmax : INT_MAX;
-    const int initial_capacity = dmax > 128? dmax: 128;
+    // a script never holds more edits than there are elements, so an unbounded dmax does not reserve INT_MAX of them
+    int initial_capacity = dmax < n + m + 1? dmax : n + m + 1;
+    if (initial_capacity < 128)
+        initial_capacity = 128;
     bool vbuf_allocated = vbuf == NULL;
     if (vbuf_allocated) {
         int v_size = diff_get_vbuf_size(m, n);
@@ -314,6 +180,7 @@ int diff(const void *a, int aoff, int n,
     struct _ctx ctx = {
         .cmp = cmp,
         .context = context,
+        .unmatchable = unmatchable,
         .buf = vbuf,
         .ses = calloc(initial_capacity, sizeof(struct diff_edit)),
         .si = 0,
@@ -321,27 +188,7 @@ int diff(const void *a, int aoff, int n,
         .dmax = dmax,
     };
 
-    /* The _ses function assumes the SES will begin or end with a delete
-     * or insert. The following will insure this is true by eating any
-     * beginning matches. This is also a quick to process sequences
-     * that match entirely.
-     */
-    x = y = 0;
-    if (cmp) {
-        while (x < n && y < m && 
-               cmp(a, b, aoff + x, boff + y, context) == 0) {
-            x++; y++;
-        }
-    } else {
-        const unsigned char *a0 = (const unsigned char *)a + aoff;
-        const unsigned char *b0 = (const unsigned char *)b + boff;
-        while (x < n && y < m && a0[x] == b0[y]) {
-            x++; y++;
-        }
-    }
-    _edit(&ctx, DIFF_MATCH, aoff, x);
-
-    if ((d = _ses(a, aoff + x, n - x, b, boff + y, m - y, &ctx)) == -1) {
+    if ((d = core(a, aoff, n, b, boff, m, &ctx)) == -1) {
         goto failed;
     }
     if (vbuf_allocated)
@@ -365,6 +212,157 @@ failed:
     return -1;
 }
 
+int diff(const void *a, int aoff, int n,
+         const void *b, int boff, int m,
+         diff_cmp_fn cmp, void *context, int dmax,
+         int *vbuf,
+         struct diff_edit **ses_ret, int *ses_n_ret) {
+    return run_diff(cmp? _diff_cb : _diff_u8, a, aoff, n, b, boff, m, cmp, context, -1, dmax, vbuf, ses_ret, ses_n_ret);
+}
+
+int diff_codepoints(const int32_t *a, int aoff, int n,
+                    const int32_t *b, int boff, int m,
+                    int32_t unmatchable, int dmax,
+                    int *vbuf,
+                    struct diff_edit **ses_ret, int *ses_n_ret) {
+    return run_diff(unmatchable == -1? _diff_i32 : _diff_i32u, a, aoff, n, b, boff, m, NULL, NULL, unmatchable, dmax, vbuf, ses_ret, ses_n_ret);
+}
+
+/*
+ * Bit-parallel LCS (Allison-Dix, in the form of Hyyro 2004) for code points
+ * ---
+ * A row of the LCS table is kept in bit vector V, one bit per element of a. With PM[c], the positions of c in a,
+ *   V' = (V + (V & PM[c])) | (V & ~PM[c])
+ * moves to the next element of b, and the zero bits of the last row count the LCS.
+ * That is O(nm / 64) whatever the distance is, while diff() is O(ND).
+ *
+ * Only the distance is computed. Among scripts of the same length, diff() takes the one its middle snakes lead to,
+ * and blame is attributed by that script, so scripts are always left to diff_codepoints.
+ */
+
+struct pm_table {
+    int words;
+    int capacity; // power of two
+    int32_t *keys;
+    int *rows; // -1 for an empty slot
+    uint64_t *masks; // words per distinct code point of a
+    int row_count;
+};
+
+static inline unsigned pm_slot(int32_t c, int capacity) {
+    return ((uint32_t)c * 2654435761u) & (capacity - 1);
+}
+
+// bit n - 1 - i stands for a[i]
+static void pm_build(struct pm_table *pm, const int32_t *a, int n, int32_t unmatchable) {
+    int idx;
+    pm->words = (n + 63) / 64;
+    pm->capacity = 16;
+    while (pm->capacity < 2 * n)
+        pm->capacity *= 2;
+    pm->keys = malloc(sizeof(int32_t) * pm->capacity);
+    pm->rows = malloc(sizeof(int) * pm->capacity);
+    pm->masks = calloc((size_t)n * pm->words, sizeof(uint64_t));
+    pm->row_count = 0;
+    for (idx = 0; idx < pm->capacity; idx++)
+        pm->rows[idx] = -1;
+
+    for (idx = 0; idx < n; idx++) {
+        int32_t c = a[idx];
+        if (c == unmatchable)
+            continue;
+        unsigned slot = pm_slot(c, pm->capacity);
+        while (pm->rows[slot] != -1 && pm->keys[slot] != c)
+            slot = (slot + 1) & (pm->capacity - 1);
+        if (pm->rows[slot] == -1) {
+            pm->keys[slot] = c;
+            pm->rows[slot] = pm->row_count++;
+        }
+        int bit = n - 1 - idx;
+        pm->masks[(size_t)pm->rows[slot] * pm->words + bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static inline const uint64_t* pm_get(const struct pm_table *pm, int32_t c) {
+    unsigned slot = pm_slot(c, pm->capacity);
+    while (pm->rows[slot] != -1) {
+        if (pm->keys[slot] == c)
+            return pm->masks + (size_t)pm->rows[slot] * pm->words;
+        slot = (slot + 1) & (pm->capacity - 1);
+    }
+    return NULL;
+}
+
+static void pm_free(struct pm_table *pm) {
+    free(pm->keys);
+    free(pm->rows);
+    free(pm->masks);
+}
+
+static inline void lcs_next_row(const uint64_t *v, const uint64_t *pm, uint64_t *out, int words) {
+    uint64_t carry = 0;
+    int w;
+    for (w = 0; w < words; w++) {
+        uint64_t u = v[w] & pm[w];
+        uint64_t sum = v[w] + u;
+        uint64_t carried = sum + carry;
+        carry = (sum < v[w]) | (carried < sum);
+        out[w] = carried | (v[w] & ~pm[w]);
+    }
+}
+
+int diff_bitparallel(const int32_t *a, int n, const int32_t *b, int m,
+                     int32_t unmatchable, int dmax) {
+    int j, w;
+    dmax = dmax >= 0? dmax : INT_MAX;
+
+    // the common prefix is eaten first as diff() does, which also returns the distance over dmax when either one runs out there
+    int prefix = 0;
+    while (prefix < n && prefix < m && a[prefix] == b[prefix] && a[prefix] != unmatchable)
+        prefix++;
+    a += prefix;
+    b += prefix;
+    n -= prefix;
+    m -= prefix;
+
+    if (n == 0 || m == 0)
+        return n + m;
+    if ((n > m? n - m : m - n) > dmax)
+        return -1;
+
+    struct pm_table pm;
+    pm_build(&pm, a, n, unmatchable);
+    const int words = pm.words;
+
+    uint64_t *rows = malloc(sizeof(uint64_t) * words * 2);
+    for (w = 0; w < words; w++)
+        rows[w] = ~0ULL;
+
+    uint64_t *v = rows;
+    for (j = m - 1; j >= 0; j--) {
+        uint64_t *next = v == rows? rows + words : rows;
+        const uint64_t *mask = pm_get(&pm, b[j]);
+        if (mask)
+            lcs_next_row(v, mask, next, words);
+        else
+            memcpy(next, v, sizeof(uint64_t) * words);
+        v = next;
+    }
+    pm_free(&pm);
+
+    int lcs = 0;
+    for (w = 0; w < words; w++) {
+        uint64_t zeros = ~v[w];
+        if (w == words - 1 && n % 64)
+            zeros &= (1ULL << (n % 64)) - 1;
+        lcs += __builtin_popcountll(zeros);
+    }
+    free(rows);
+
+    int d = n + m - 2 * lcs;
+    return d > dmax? -1 : d;
+}
+
 #ifdef SIMPLE_DIFF_PROGRAM
 #include <stdio.h>
 #include <stdbool.h>
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""
+Records what the flex scanner of inlinelexer.l returned for every scn_parse_inline call.
+
+    ./test_trace.out doc.namu 2>&1 >/dev/null | python3 example/inline/flexref.py
+
+The trace of the hand-written scanner only gives the lines to scan and how calls nest.
+Each line is tokenized again here with the rules of inlinelexer.l and the semantics of flex:
+the longest match wins at each position and the earlier rule wins a tie.
+"""
+import re
+import sys
+
+LETTER = rb'[a-zA-Z0-9_]'
+IMAGE_EXT = rb'(?:jpg|jpeg|png|gif)'
+IMAGE_OPTION = rb'(?:width|height|align)'
+NORMAL_CHAR = rb"[^\n\[\]'{~\-_^,h]"
+ESCAPABLE_CHAR_IN_LINK = rb'[|\[\]]'
+NOT_A_RBRK = rb'[^\]\n]'
+
+# (token name, regular expression) in the order of inlinelexer.l
+RULES = [(name, re.compile(rx, re.S)) for name, rx in [
+    ('footnote', rb'\[\*(?:[^\[\]\n]|\[[^\]\n]*\]|\[\[(?:\]?[^\]\n])*\]\])*\]'),
+    ('link', rb'\[\[(?:\\' + ESCAPABLE_CHAR_IN_LINK + rb'|\]?' + NOT_A_RBRK + rb')*\]\]'),
+    ('macro', rb'\[(?:\\' + ESCAPABLE_CHAR_IN_LINK + rb'|' + NOT_A_RBRK + rb')*\]'),
+    ('image', rb'https?://[^ \n]*(?:\.' + IMAGE_EXT + rb'|\?\.jpg)(?:\?(?:' + IMAGE_OPTION + rb'=' + LETTER + rb'+)(?:&' +
+              IMAGE_OPTION + rb'=' + LETTER + rb'+)*)?'),
+    ('block', rb'\{\{\{(?:(?:\}\}|\}|)[^}\n])*\}\}\}'),
+    ('bold', rb"'''(?:(?:''|'|)[^'\n])+'''"),
+    ('italic', rb"''(?:'?[^'\n])+''"),
+    ('span', rb'~~(?:~?[^~\n])+~~'),
+    ('span', rb'--(?:-?[^-\n])+--'),
+    ('span', rb'__(?:_?[^_\n])+__'),
+    ('span', rb'\^\^(?:\^?[^^\n])+\^\^'),
+    ('span', rb',,(?:,?[^,\n])+,,'),
+    ('text', NORMAL_CHAR + rb'+'),
+    ('text', rb'[^\n]'),  # .
+]]
+
+
+def longest_match(rx, line, pos):
+    # re finds the first match of the alternations, flex the longest one
+    for end in range(len(line), pos, -1):
+        if rx.fullmatch(line, pos, end):
+            return end
+    return None
+
+
+def flex_tokens(line, in_footnote):
+    tokens = []
+    pos = 0
+    while pos < len(line):
+        best_name, best_end = None, None
+        for name, rx in RULES:
+            end = longest_match(rx, line, pos)
+            if end is not None and (best_end is None or end > best_end):
+                best_name, best_end = name, end
+        if best_name == 'footnote' and in_footnote:
+            best_name = 'text'
+        if best_name == 'text' and tokens and tokens[-1][0] == 'text':
+            tokens[-1] = ('text', tokens[-1][1] + line[pos:best_end])
+        else:
+            tokens.append((best_name, line[pos:best_end]))
+        pos = best_end
+    return tokens
+
+
+def unescape(s):
+    out = bytearray()
+    idx = 0
+    while idx < len(s):
+        if s[idx] == 0x5c:
+            c = s[idx + 1]
+            if c == ord('n'):
+                out.append(0x0a)
+            elif c == ord('t'):
+                out.append(0x09)
+            elif c == ord('x'):
+                out.append(int(s[idx + 2:idx + 4], 16))
+                idx += 2
+            else:
+                out.append(c)
+            idx += 2
+        else:
+            out.append(s[idx])
+            idx += 1
+    return bytes(out)
+
+
+def escape(s):
+    out = bytearray()
+    for c in s:
+        if c in b'"\\':
+            out += b'\\' + bytes([c])
+        elif c == 0x0a:
+            out += b'\\n'
+        elif c == 0x09:
+            out += b'\\t'
+        elif c < 0x20 or c == 0x7f:
+            out += b'\\x%02x' % c
+        else:
+            out.append(c)
+    return bytes(out)
+
+
+class Scan:
+    def __init__(self, line, in_footnote):
+        self.line = line
+        self.in_footnote = in_footnote
+        self.children = {}  # number of markup tokens before them -> nested scans
+
+
+def parse_trace(lines):
+    roots = []
+    stack = []  # (depth, scan, number of markup tokens so far, name of the last markup token)
+    for raw in lines:
+        stripped = raw.lstrip(b' ')
+        depth = (len(raw) - len(stripped)) // 2
+        name, _, rest = stripped.partition(b' ')
+        while stack and stack[-1][0] >= depth:
+            stack.pop()
+        if name == b'scan':
+            parent = stack[-1] if stack else None
+            in_footnote = parent is not None and (parent[1].in_footnote or parent[3] == b'footnote')
+            scan = Scan(unescape(rest[1:-1]), in_footnote)
+            if parent:
+                parent[1].children.setdefault(parent[2], []).append(scan)
+            else:
+                roots.append(scan)
+            stack.append((depth, scan, 0, None))
+        elif name != b'text' and stack:
+            depth_, scan, markup_cnt, _ = stack[-1]
+            stack[-1] = (depth_, scan, markup_cnt + 1, name)
+    return roots
+
+
+def dump(scan, depth, out):
+    indent = b'  ' * depth
+    out.append(indent + b'scan "' + escape(scan.line) + b'"')
+    markup_cnt = 0
+    tokens = flex_tokens(scan.line, scan.in_footnote)
+    for name, text in tokens:
+        out.append(indent + b'  ' + name.encode() + b' "' + escape(text) + b'"')
+        if name != 'text':
+            markup_cnt += 1
+            for child in scan.children.pop(markup_cnt, []):
+                dump(child, depth + 1, out)
+    for key in sorted(scan.children):
+        for child in scan.children[key]:
+            dump(child, depth + 1, out)
+
+
+def main():
+    out = []
+    for scan in parse_trace(sys.stdin.buffer.read().splitlines()):
+        dump(scan, 0, out)
+    sys.stdout.buffer.write(b''.join(line + b'\n' for line in out))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,65 +1,28 @@
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
 
 #include "htmlgen.h"
 #include "namugen.h"
 #include "varray.h"
+#include "outbuf.h"
+#include "lru.h"
+#include "whitelist.h"
+#include "bytescan.h"
+#include "threadpool.h"
 
 /*
  * HTML Sanitizer
+ * Raw HTML blocks are tokenized, whitelisted and balanced in one pass. The whitelists are in whitelist.c.
+ * Building with HTMLGEN_USE_TIDY brings back the former tidy-html5 based pipeline, e.g. to compare outputs.
  */
+#ifdef HTMLGEN_USE_TIDY
 #include "tidy-html5/include/tidy.h"
 #include "tidy-html5/include/buffio.h"
+#endif
 
-const char *allowed_tags[] = {
-    "p", 
-    "pre", 
-    "blockquote", 
-    "ul", 
-    "div", 
-    "a", 
-    "em", 
-    "strong", 
-    "s", 
-    "sub", 
-    "i", 
-    "b", 
-    "u", 
-    "ruby", 
-    "rt", 
-    "rp", 
-    "span", 
-    "br", 
-    "ins", 
-    "del", 
-    "img", 
-    "iframe", 
-    "embed", 
-    "object", 
-    "param", 
-    "video",
-    0
-};
-
-const char *allowed_attributes[] = {
-    "href",
-    "src",
-    "style",
-    "class",
-    "width",
-    "height", 
-    "alt", 
-    "align",
-    0
-};
-
-
-const char *allowed_link_schema [] = {
-    "http://",
-    "https://",
-    "//", 
-    "/",
-    0
-};
+#define IS_HTML_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == '\f')
 
 static const char* iter_entity(const char *p, const char* end, int32_t *cp_out) {
     if (p < end) {
@@ -164,11 +127,19 @@ static size_t filter_html_entities(char* src, size_t len) {
     return acc - src;
 }
 
+// values are checked in a decoded copy, which nearly always fits in the stack buffer
+#define DECODED_VALUE_STACK_SIZE 256
+
+static char* decode_value(const char *value, size_t *len, char *stack_buf) {
+    char *buf = *len < DECODED_VALUE_STACK_SIZE? stack_buf : malloc(*len + 1);
+    memcpy(buf, value, *len);
+    *len = filter_html_entities(buf, *len);
+    return buf;
+}
+
 static bool acceptable_src_href(const char* src, size_t len) {
-    sds buf = sdsnewlen(src, len);
-    filter_html_entities(buf, len);
-    sdsupdatelen(buf);
-    len = sdslen(buf);
+    char stack_buf[DECODED_VALUE_STACK_SIZE];
+    char *buf = decode_value(src, &len, stack_buf);
 
     const char* p = buf;
     const char *end = buf + len;
@@ -181,23 +152,16 @@ static bool acceptable_src_href(const char* src, size_t len) {
         } else
             break;
     }
-    const char **schema;
-    bool success = false;
-    for (schema = allowed_link_schema; *schema; schema++) {
-        if (!strncasecmp(*schema, p, strlen(*schema))) {
-            success = true;
-            break;
-        }
-    }
-    sdsfree(buf);
+    bool success = has_allowed_link_schema(p, end - p);
+    if (buf != stack_buf)
+        free(buf);
     return success;
 }
 
 static bool acceptable_style(const char* style, size_t len) {
-    sds buf = sdsnewlen(style, len);
-    filter_html_entities(buf, len);
-    sdsupdatelen(buf);
-    len = sdslen(buf);
+    char stack_buf[DECODED_VALUE_STACK_SIZE];
+    char *buf = decode_value(style, &len, stack_buf);
+    bool success = false;
 
     char* p = buf;
     char *end = buf + len;
@@ -205,10 +169,10 @@ static bool acceptable_style(const char* style, size_t len) {
     while (p < end) {
         if (!strncasecmp(p, "url", 3)) {
             p += 3;
-            while (p < end && *p == ' ') p++;
+            while (p < end && IS_HTML_SPACE(*p)) p++;
             if (p < end && *p == '(') {
                 p++;
-                if (!acceptable_src_href(p, len))
+                if (!acceptable_src_href(p, end - p))
                     goto error;
                 while (p < end && *p != ')')
                     p++;
@@ -216,20 +180,21 @@ static bool acceptable_style(const char* style, size_t len) {
             }
         } else if (!strncasecmp(p, "expression", 10)) {
             p += 10;
-            while (p < end && *p == ' ') p++;
+            while (p < end && IS_HTML_SPACE(*p)) p++;
             if (p < end && *p == '(') {
                 goto error;
             }
         } else
             p++;
     }
-    sdsfree(buf);
-    return true;
+    success = true;
 error:
-    sdsfree(buf);
-    return false;
+    if (buf != stack_buf)
+        free(buf);
+    return success;
 }
 
+#ifdef HTMLGEN_USE_TIDY
 static void filter_html_buffer(char *p, size_t len) {
     char *acc = p;
     char *end = p + len;
@@ -252,14 +217,7 @@ static void filter_html_buffer(char *p, size_t len) {
         }
         char *tag_ed = p;
 
-        bool valid_tag = false;
-        const char** ptag;
-        for (ptag = allowed_tags; *ptag; ptag++) {
-            if (!strncasecmp(*ptag, tag_st, tag_ed - tag_st)) {
-                valid_tag = true;
-                break;
-            }
-        }
+        bool valid_tag = find_allowed_tag(tag_st, tag_ed - tag_st) >= 0;
         if (!valid_tag) {
             while (p < end && *p != '>')
                 p++;
@@ -311,14 +269,7 @@ static void filter_html_buffer(char *p, size_t len) {
                 }
                 char *attr_end = p;
 
-                const char** aattr;
-                bool valid_attr = false;
-                for (aattr = allowed_attributes; *aattr; aattr++) {
-                    if (!strncasecmp(attr_name_st, *aattr, attr_name_ed - attr_name_st)) {
-                        valid_attr = true;
-                        break;
-                    }
-                }
+                bool valid_attr = find_allowed_attribute(attr_name_st, attr_name_ed - attr_name_st) >= 0;
 
                 if (valid_attr && attr_value_st) {
                     if (!strncasecmp(attr_name_st, "src", attr_name_ed - attr_name_st) || !strncasecmp(attr_name_st, "href", attr_name_ed - attr_name_st)) {
@@ -344,6 +295,8 @@ static void filter_html_buffer(char *p, size_t len) {
     *acc = 0;
 }
 
+#endif
+
 static sds sdscat_sanitize_src_href(sds buf, const sds src) {
     if (acceptable_src_href(src, sdslen(src))) {
         buf = sdscatsds(buf, src);
@@ -358,6 +311,7 @@ static sds sdscat_sanitize_style(sds buf, const sds style) {
     return buf;
 }
 
+#ifdef HTMLGEN_USE_TIDY
 static sds sdscat_sanitize_html(sds buf, const sds src) {
     sds src_copy = sdsdup(src);
     filter_html_entities(src_copy, sdslen(src_copy));
@@ -397,6 +351,660 @@ static sds sdscat_sanitize_html(sds buf, const sds src) {
     sdsfree(p);
     return buf;
 }
+#else
+/*
+ * The output follows the tidy pipeline, except that (make sanitizediff shows both on example/sanitize.namu)
+ * - whitespace between and inside elements is kept as written, where tidy wraps lines and collapses spaces
+ * - bodies of script and style are dropped. tidy kept a script, whose code was shown once the filter dropped its tags
+ * - a block only ends an open <p>, and text right inside a <ul> is left there. tidy puts them in <p> and <li>,
+ *   which the filter then dropped
+ * - comments are dropped whole. The filter dropped them up to the first '>' and showed the rest
+ * - of duplicated attributes, only the last one is kept. tidy joins duplicated styles instead
+ * - whitelist matches are exact, where the filter took prefixes, and elements deeper than SANITIZER_MAX_DEPTH are dropped
+ * - an attribute without a value is written bare
+ * As tidy does, formatting elements closed by a misnested end tag are opened again for what follows,
+ * text and elements between the parts of a table are moved in front of it,
+ * and a '&' is escaped unless it starts a numeric reference or a named one of HTML 4, e.g. &copy; but not &unknown;
+ */
+
+// open elements deeper than this are dropped
+#define SANITIZER_MAX_DEPTH 128
+// more than the attributes allowed, as duplicates are only kept once
+#define SANITIZER_MAX_ATTRS 16
+// content misplaced in tables nested deeper than this stays where it is
+#define SANITIZER_MAX_TABLE_DEPTH 16
+
+#define IS_ASCII_ALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+#define IS_ASCII_ALNUM(c) (IS_ASCII_ALPHA(c) || ((c) >= '0' && (c) <= '9'))
+#define IS_ASCII_HEX(c) (((c) >= '0' && (c) <= '9') || ((c) >= 'a' && (c) <= 'f') || ((c) >= 'A' && (c) <= 'F'))
+
+static const struct byteset sanitizer_text_specials = BYTESET('<', '>', '&');
+static const struct byteset sanitizer_markup_start = BYTESET('<');
+static const struct byteset sanitizer_value_specials = BYTESET('"', '<', '>', '&', ' ', '\t', '\n', '\r', '\f');
+
+// '>' of the tag, skipping quoted attribute values, or end
+static const char* find_tag_end(const char *p, const char *end) {
+    char quote = 0;
+    for (; p < end; p++) {
+        if (quote) {
+            if (*p == quote)
+                quote = 0;
+        } else if (*p == '"' || *p == '\'')
+            quote = *p;
+        else if (*p == '>')
+            return p;
+    }
+    return end;
+}
+
+// after the closing tag of a script or a style, whose content is never shown
+static const char* skip_raw_text(const char *p, const char *end, const char *name, size_t name_len) {
+    for (; p + 2 + name_len <= end; p++) {
+        if (p[0] == '<' && p[1] == '/' && !strncasecmp(p + 2, name, name_len)) {
+            p = find_tag_end(p, end);
+            return p < end? p + 1 : end;
+        }
+    }
+    return end;
+}
+
+static bool is_raw_text_tag(const char *name, size_t len) {
+    return (len == 6 && !strncasecmp(name, "script", 6)) || (len == 5 && !strncasecmp(name, "style", 5));
+}
+
+enum {
+    TABLE_PART_NONE,
+    TABLE_PART_TABLE,
+    TABLE_PART_CELL, // what may hold content
+    TABLE_PART_ROW // and the other parts around cells
+};
+
+// table tags are not allowed, but they still tell what tidy would have moved out of the table
+static int table_part(const char *name, size_t len) {
+    switch (len) {
+    case 2:
+        if (!strncasecmp(name, "td", 2) || !strncasecmp(name, "th", 2))
+            return TABLE_PART_CELL;
+        if (!strncasecmp(name, "tr", 2))
+            return TABLE_PART_ROW;
+        break;
+    case 3:
+        if (!strncasecmp(name, "col", 3))
+            return TABLE_PART_ROW;
+        break;
+    case 5:
+        if (!strncasecmp(name, "table", 5))
+            return TABLE_PART_TABLE;
+        if (!strncasecmp(name, "thead", 5) || !strncasecmp(name, "tbody", 5) || !strncasecmp(name, "tfoot", 5))
+            return TABLE_PART_ROW;
+        break;
+    case 7:
+        if (!strncasecmp(name, "caption", 7))
+            return TABLE_PART_CELL;
+        break;
+    case 8:
+        if (!strncasecmp(name, "colgroup", 8))
+            return TABLE_PART_ROW;
+        break;
+    }
+    return TABLE_PART_NONE;
+}
+
+// whether p ('<') starts a tag, a comment or a doctype, rather than being a stray '<'
+static bool starts_markup(const char *p, const char *end) {
+    const char *q = p + 1;
+    if (q < end && *q == '/')
+        q++;
+    return q < end && (IS_ASCII_ALPHA(*q) || (q == p + 1 && *q == '!'));
+}
+
+// length of the character reference at p ('&'), or 0 if it has to be escaped
+static size_t char_ref_len(const char *p, const char *end) {
+    const char *q = p + 1;
+    if (q < end && *q == '#') {
+        q++;
+        bool hex = q < end && (*q == 'x' || *q == 'X');
+        if (hex)
+            q++;
+        const char *digits = q;
+        while (q < end && (hex? IS_ASCII_HEX(*q) : (*q >= '0' && *q <= '9')))
+            q++;
+        if (q == digits)
+            return 0;
+    } else {
+        if (q >= end || !IS_ASCII_ALPHA(*q))
+            return 0;
+        while (q < end && IS_ASCII_ALNUM(*q))
+            q++;
+        if (!is_html_entity_name(p + 1, q - p - 1))
+            return 0;
+    }
+    return q < end && *q == ';'? (size_t)(q + 1 - p) : 0;
+}
+
+/*
+ * A value is written escaped, with whitespace collapsed into a space as tidy does without literal-attributes.
+ * Called once with dst NULL to size the tag, then again to write it. Returns the length either way.
+ */
+static size_t put_attr_value(char *dst, const char *p, const char *end) {
+    size_t out_len = 0;
+    bool after_space = false;
+    while (p < end) {
+        const char *run_st = p;
+        p = bytescan_find_set(p, end, &sanitizer_value_specials);
+        if (p > run_st) {
+            if (dst)
+                memcpy(dst + out_len, run_st, p - run_st);
+            out_len += p - run_st;
+            after_space = false;
+        }
+        if (p >= end)
+            break;
+
+        const char *rep;
+        size_t rep_len;
+        bool space = false;
+        switch (*p) {
+        case '"':
+            rep = "&quot;";
+            rep_len = 6;
+            break;
+        case '<':
+            rep = "&lt;";
+            rep_len = 4;
+            break;
+        case '>':
+            rep = "&gt;";
+            rep_len = 4;
+            break;
+        case '&':
+            rep_len = char_ref_len(p, end);
+            if (rep_len) {
+                rep = p;
+                p += rep_len - 1;
+            } else {
+                rep = "&amp;";
+                rep_len = 5;
+            }
+            break;
+        default:
+            if (after_space) {
+                p++;
+                continue;
+            }
+            rep = " ";
+            rep_len = 1;
+            space = true;
+            break;
+        }
+        p++;
+        if (dst)
+            memcpy(dst + out_len, rep, rep_len);
+        out_len += rep_len;
+        after_space = space;
+    }
+    return out_len;
+}
+
+struct sanitized_attr {
+    int attr; // in allowed_attributes
+    const char *value_st, *value_ed; // value_st is NULL without a value
+};
+
+// whitelisted attributes in p to end, what follows the tag name. The last one of duplicates is kept where it was
+static int parse_attrs(const char *p, const char *end, struct sanitized_attr *attrs) {
+    int count = 0;
+    while (p < end) {
+        while (p < end && (IS_HTML_SPACE(*p) || *p == '/'))
+            p++;
+        if (p >= end)
+            break;
+        const char *name_st = p;
+        while (p < end && !IS_HTML_SPACE(*p) && *p != '=' && *p != '/')
+            p++;
+        size_t name_len = p - name_st;
+        while (p < end && IS_HTML_SPACE(*p))
+            p++;
+
+        const char *value_st = NULL, *value_ed = NULL;
+        if (p < end && *p == '=') {
+            p++;
+            while (p < end && IS_HTML_SPACE(*p))
+                p++;
+            if (p < end && (*p == '"' || *p == '\'')) {
+                char quote = *p++;
+                value_st = p;
+                while (p < end && *p != quote)
+                    p++;
+                value_ed = p;
+                if (p < end)
+                    p++;
+            } else {
+                value_st = p;
+                while (p < end && !IS_HTML_SPACE(*p))
+                    p++;
+                value_ed = p;
+            }
+        }
+
+        int attr = find_allowed_attribute(name_st, name_len);
+        if (attr < 0)
+            continue;
+        int idx;
+        for (idx = 0; idx < count && attrs[idx].attr != attr; idx++);
+        if (idx < count) {
+            memmove(attrs + idx, attrs + idx + 1, sizeof(struct sanitized_attr) * (count - idx - 1));
+            count--;
+        } else if (count == SANITIZER_MAX_ATTRS)
+            continue;
+        attrs[count].attr = attr;
+        attrs[count].value_st = value_st;
+        attrs[count].value_ed = value_ed;
+        count++;
+    }
+    return count;
+}
+
+// the tag is sized first, so that it is written with one reservation
+static sds sdscat_open_tag(sds buf, int tag, const char *attrs_st, const char *attrs_ed) {
+    struct sanitized_attr attrs[SANITIZER_MAX_ATTRS];
+    int attr_count = parse_attrs(attrs_st, attrs_ed, attrs);
+    const char *tag_name = allowed_tags[tag];
+    size_t tag_name_len = strlen(tag_name);
+    size_t tag_len = tag_name_len + 2;
+    int idx, kept = 0;
+    for (idx = 0; idx < attr_count; idx++) {
+        struct sanitized_attr *attr = &attrs[idx];
+        const char *attr_name = allowed_attributes[attr->attr];
+        if (attr->value_st) {
+            if (!strcmp(attr_name, "src") || !strcmp(attr_name, "href")) {
+                if (!acceptable_src_href(attr->value_st, attr->value_ed - attr->value_st))
+                    continue;
+            } else if (!strcmp(attr_name, "style")) {
+                if (!acceptable_style(attr->value_st, attr->value_ed - attr->value_st))
+                    continue;
+            }
+            tag_len += put_attr_value(NULL, attr->value_st, attr->value_ed) + 3; // ="..."
+        }
+        tag_len += strlen(attr_name) + 1;
+        attrs[kept++] = *attr;
+    }
+
+    buf = sdsMakeRoomFor(buf, tag_len);
+    char *dst = buf + sdslen(buf);
+    *dst++ = '<';
+    memcpy(dst, tag_name, tag_name_len);
+    dst += tag_name_len;
+    for (idx = 0; idx < kept; idx++) {
+        const char *attr_name = allowed_attributes[attrs[idx].attr];
+        size_t attr_name_len = strlen(attr_name);
+        *dst++ = ' ';
+        memcpy(dst, attr_name, attr_name_len);
+        dst += attr_name_len;
+        if (attrs[idx].value_st) {
+            *dst++ = '=';
+            *dst++ = '"';
+            dst += put_attr_value(dst, attrs[idx].value_st, attrs[idx].value_ed);
+            *dst++ = '"';
+        }
+    }
+    *dst = '>';
+    sdsIncrLen(buf, tag_len);
+    return buf;
+}
+
+static sds sdscat_close_tag(sds buf, int tag) {
+    const char *tag_name = allowed_tags[tag];
+    size_t tag_name_len = strlen(tag_name);
+    buf = sdsMakeRoomFor(buf, tag_name_len + 3);
+    char *dst = buf + sdslen(buf);
+    dst[0] = '<';
+    dst[1] = '/';
+    memcpy(dst + 2, tag_name, tag_name_len);
+    dst[tag_name_len + 2] = '>';
+    sdsIncrLen(buf, tag_name_len + 3);
+    return buf;
+}
+
+struct sanitizer_element {
+    int tag;
+    const char *attrs_st, *attrs_ed; // to open it again
+};
+
+struct sanitizer_table {
+    size_t insert_at; // where content misplaced in it goes, in front of it, as tidy moves it
+    int depth; // of open elements when it started
+    bool in_cell;
+};
+
+struct sanitizer {
+    sds buf;
+    struct sanitizer_element open[SANITIZER_MAX_DEPTH];
+    int depth;
+    // formatting elements closed by the end tag of an element around them, opened again before what follows
+    struct sanitizer_element reopen[SANITIZER_MAX_DEPTH];
+    int reopen_count;
+    struct sanitizer_table tables[SANITIZER_MAX_TABLE_DEPTH];
+    int table_depth;
+    int untracked_tables; // nested deeper than SANITIZER_MAX_TABLE_DEPTH
+};
+
+static bool is_misplaced(struct sanitizer *s) {
+    return s->table_depth > 0 && !s->untracked_tables && !s->tables[s->table_depth - 1].in_cell;
+}
+
+// open elements below this are out of reach of end tags
+static int table_floor(struct sanitizer *s) {
+    return s->table_depth > 0? s->tables[s->table_depth - 1].depth : 0;
+}
+
+// moves what has been written since st in front of the innermost table, after what has been moved there before
+static void move_misplaced(struct sanitizer *s, size_t st) {
+    struct sanitizer_table *table = &s->tables[s->table_depth - 1];
+    size_t len = sdslen(s->buf) - st;
+    if (len == 0)
+        return;
+    // rare enough to take a copy
+    char *moved = malloc(len);
+    memcpy(moved, s->buf + st, len);
+    memmove(s->buf + table->insert_at + len, s->buf + table->insert_at, st - table->insert_at);
+    memcpy(s->buf + table->insert_at, moved, len);
+    free(moved);
+    table->insert_at += len;
+}
+
+static void open_element(struct sanitizer *s, int tag, const char *attrs_st, const char *attrs_ed) {
+    s->buf = sdscat_open_tag(s->buf, tag, attrs_st, attrs_ed);
+    if (allowed_tag_flags(tag) & HTML_TAG_VOID)
+        return;
+    s->open[s->depth].tag = tag;
+    s->open[s->depth].attrs_st = attrs_st;
+    s->open[s->depth].attrs_ed = attrs_ed;
+    s->depth++;
+}
+
+static void close_elements_to(struct sanitizer *s, int depth) {
+    while (s->depth > depth)
+        s->buf = sdscat_close_tag(s->buf, s->open[--s->depth].tag);
+}
+
+static void reopen_elements(struct sanitizer *s) {
+    int idx;
+    for (idx = 0; idx < s->reopen_count && s->depth < SANITIZER_MAX_DEPTH; idx++)
+        open_element(s, s->reopen[idx].tag, s->reopen[idx].attrs_st, s->reopen[idx].attrs_ed);
+    s->reopen_count = 0;
+}
+
+static void put_text(struct sanitizer *s, const char *p, const char *end) {
+    bool misplaced = is_misplaced(s);
+    if (misplaced) {
+        // whitespace between parts of a table is dropped
+        const char *q = p;
+        while (q < end && IS_HTML_SPACE(*q))
+            q++;
+        if (q == end)
+            return;
+    }
+    size_t st = sdslen(s->buf);
+    reopen_elements(s);
+    while (p < end) {
+        // text is copied in runs, up to a character to escape
+        const char *text_st = p;
+        size_t ref_len;
+        while ((p = bytescan_find_set(p, end, &sanitizer_text_specials)) < end && *p == '&' && (ref_len = char_ref_len(p, end)))
+            p += ref_len;
+        s->buf = sdscatlen(s->buf, text_st, p - text_st);
+        if (p >= end)
+            break;
+        switch (*p) {
+        case '&':
+            s->buf = sdscatlen(s->buf, "&amp;", 5);
+            break;
+        case '<':
+            s->buf = sdscatlen(s->buf, "&lt;", 4);
+            break;
+        default:
+            s->buf = sdscatlen(s->buf, "&gt;", 4);
+            break;
+        }
+        p++;
+    }
+    if (misplaced)
+        move_misplaced(s, st);
+}
+
+static void put_start_tag(struct sanitizer *s, int tag, const char *attrs_st, const char *attrs_ed) {
+    int flags = allowed_tag_flags(tag);
+    bool misplaced = is_misplaced(s);
+    size_t st = sdslen(s->buf);
+    if (flags & HTML_TAG_BLOCK) {
+        if (s->depth > table_floor(s) && (allowed_tag_flags(s->open[s->depth - 1].tag) & HTML_TAG_PARAGRAPH))
+            s->buf = sdscat_close_tag(s->buf, s->open[--s->depth].tag);
+    } else {
+        reopen_elements(s);
+    }
+    if ((flags & HTML_TAG_VOID) || s->depth < SANITIZER_MAX_DEPTH)
+        open_element(s, tag, attrs_st, attrs_ed);
+    if (misplaced)
+        move_misplaced(s, st);
+}
+
+static void put_end_tag(struct sanitizer *s, int tag) {
+    int idx = s->depth - 1;
+    while (idx >= table_floor(s) && s->open[idx].tag != tag)
+        idx--;
+    if (idx < table_floor(s)) {
+        // not opened again after all, nor what was inside it
+        for (idx = 0; idx < s->reopen_count && s->reopen[idx].tag != tag; idx++);
+        if (idx < s->reopen_count)
+            s->reopen_count = idx;
+        // stray ones are dropped
+        return;
+    }
+
+    // misnested formatting does not go past the end of a block
+    if (allowed_tag_flags(tag) & HTML_TAG_BLOCK) {
+        s->reopen_count = 0;
+    } else {
+        int kdx;
+        for (kdx = idx + 1; kdx < s->depth; kdx++) {
+            if ((allowed_tag_flags(s->open[kdx].tag) & HTML_TAG_FORMATTING) && s->reopen_count < SANITIZER_MAX_DEPTH)
+                s->reopen[s->reopen_count++] = s->open[kdx];
+        }
+    }
+    bool misplaced = is_misplaced(s);
+    size_t st = sdslen(s->buf);
+    close_elements_to(s, idx);
+    if (misplaced)
+        move_misplaced(s, st);
+}
+
+// a part of a table ends what has been opened in the part before it
+static void put_table_tag(struct sanitizer *s, int part, bool closing) {
+    if (part == TABLE_PART_TABLE && !closing) {
+        s->reopen_count = 0;
+        if (s->untracked_tables || s->table_depth == SANITIZER_MAX_TABLE_DEPTH) {
+            s->untracked_tables++;
+            return;
+        }
+        struct sanitizer_table *table = &s->tables[s->table_depth++];
+        table->insert_at = sdslen(s->buf);
+        table->depth = s->depth;
+        table->in_cell = false;
+        return;
+    }
+    if (s->untracked_tables) {
+        if (part == TABLE_PART_TABLE)
+            s->untracked_tables--;
+        return;
+    }
+    if (s->table_depth == 0)
+        return;
+
+    struct sanitizer_table *table = &s->tables[s->table_depth - 1];
+    bool misplaced = !table->in_cell;
+    size_t st = sdslen(s->buf);
+    close_elements_to(s, table->depth);
+    s->reopen_count = 0;
+    if (misplaced)
+        move_misplaced(s, st);
+    if (part == TABLE_PART_TABLE)
+        s->table_depth--;
+    else
+        table->in_cell = part == TABLE_PART_CELL && !closing;
+}
+
+static sds sdscat_sanitize_html(sds buf, const sds src) {
+    sds src_copy = sdsdup(src);
+    size_t len = filter_html_entities(src_copy, sdslen(src_copy));
+
+    struct sanitizer s;
+    s.buf = buf;
+    s.depth = 0;
+    s.reopen_count = 0;
+    s.table_depth = 0;
+    s.untracked_tables = 0;
+    // what is dropped usually outweighs what is escaped
+    s.buf = sdsMakeRoomFor(s.buf, len);
+
+    const char *p = src_copy;
+    const char *end = src_copy + len;
+    while (p < end) {
+        if (*p != '<' || !starts_markup(p, end)) {
+            // text up to the next markup, stray '<' included
+            const char *text_st = p;
+            do {
+                p = bytescan_find_set(p + 1, end, &sanitizer_markup_start);
+            } while (p < end && !starts_markup(p, end));
+            put_text(&s, text_st, p);
+            continue;
+        }
+
+        const char *q = p + 1;
+        if (*q == '!') {
+            // comments and doctypes
+            if (end - q >= 3 && !strncmp(q, "!--", 3)) {
+                const char *comment_ed = q + 3;
+                while (comment_ed + 3 <= end && strncmp(comment_ed, "-->", 3))
+                    comment_ed++;
+                p = comment_ed + 3 <= end? comment_ed + 3 : end;
+            } else {
+                p = find_tag_end(q, end);
+                p = p < end? p + 1 : end;
+            }
+            continue;
+        }
+        bool closing = false;
+        if (*q == '/') {
+            closing = true;
+            q++;
+        }
+        const char *name_st = q;
+        while (q < end && IS_ASCII_ALNUM(*q))
+            q++;
+        size_t name_len = q - name_st;
+        const char *tag_ed = find_tag_end(q, end);
+        p = tag_ed < end? tag_ed + 1 : end;
+
+        int tag = find_allowed_tag(name_st, name_len);
+        if (tag >= 0) {
+            if (closing)
+                put_end_tag(&s, tag);
+            else
+                put_start_tag(&s, tag, q, tag_ed);
+            continue;
+        }
+        int part = table_part(name_st, name_len);
+        if (part != TABLE_PART_NONE)
+            put_table_tag(&s, part, closing);
+        else if (!closing && is_raw_text_tag(name_st, name_len))
+            p = skip_raw_text(p, end, name_st, name_len);
+    }
+    close_elements_to(&s, 0);
+
+    sdsfree(src_copy);
+    return s.buf;
+}
+#endif // HTMLGEN_USE_TIDY
+
+
+/*
+ * Sanitized blocks
+ * Templates and navboxes bring the same raw HTML into many documents,
+ * so the output is kept per worker, keyed by a hash of the source.
+ * Not shared through Redis, as a round trip costs more than sanitizing a block.
+ */
+#define SANITIZED_LRU_BUDGET (8L * 1024L * 1024L)
+
+struct sanitized_block {
+    sds src; // to tell hash collisions
+    sds html;
+    int refs; // one for the memo, and one for each chunk it is in
+};
+
+// also called by the memo on eviction
+static void sanitized_block_release(void *value) {
+    struct sanitized_block *block = value;
+    if (--block->refs > 0)
+        return;
+    sdsfree(block->src);
+    sdsfree(block->html);
+    free(block);
+}
+
+static struct lru* get_sanitized_lru() {
+    static struct lru sanitized_lru;
+    static bool initialized = false;
+    if (!initialized) {
+        lru_init(&sanitized_lru, SANITIZED_LRU_BUDGET, sanitized_block_release);
+        initialized = true;
+    }
+    return &sanitized_lru;
+}
+
+static void html_block_key(const sds src, char key[17]) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t idx, len = sdslen(src);
+    for (idx = 0; idx < len; idx++) {
+        h ^= (unsigned char)src[idx];
+        h *= 1099511628211ULL;
+    }
+    for (idx = 0; idx < 16; idx++) {
+        key[idx] = "0123456789abcdef"[h & 0xf];
+        h >>= 4;
+    }
+    key[16] = 0;
+}
+
+static sds cut_chunk(htmlgen_ctx *ctx, sds buf);
+
+// with a sink, the memoized HTML goes into a chunk of its own, so that it is not copied
+static sds sdscat_sanitize_html_cached(htmlgen_ctx *ctx, sds buf, const sds src) {
+    char key[17];
+    html_block_key(src, key);
+    struct lru *lru = get_sanitized_lru();
+    struct sanitized_block *block = lru_get(lru, key);
+    bool hit = block && sdslen(block->src) == sdslen(src) && !memcmp(block->src, src, sdslen(src));
+    if (!hit) {
+        block = malloc(sizeof(struct sanitized_block));
+        block->src = sdsdup(src);
+        block->html = sdscat_sanitize_html(sdsempty(), src);
+        block->refs = 1;
+    }
+
+    if (ctx->sink) {
+        buf = cut_chunk(ctx, buf);
+        block->refs++;
+        outbuf_push_shared(&ctx->sink->pending, block->html, sdslen(block->html), sanitized_block_release, block);
+    } else {
+        buf = sdscatsds(buf, block->html);
+    }
+
+    // may evict and release block, which is why it goes last
+    if (!hit)
+        lru_put(lru, key, block, sizeof(struct sanitized_block) + sdslen(block->src) + sdslen(block->html));
+    return buf;
+}
 
 
 /*
@@ -434,6 +1042,12 @@ struct {
 } namuast_inl_html_ops[namuast_inltype_N];
 
 
+static struct threadpool *htmlgen_pool = NULL;
+
+void htmlgen_use_thread_pool(struct threadpool *pool) {
+    htmlgen_pool = pool;
+}
+
 void htmlgen_init(htmlgen_ctx *ctx, const char *cur_doc_name, struct namugen_doc_itfc *doc_itfc) {
     ctx->ne_docs = NULL;
     ctx->ne_docs_count = 0;
@@ -441,6 +1055,10 @@ void htmlgen_init(htmlgen_ctx *ctx, const char *cur_doc_name, struct namugen_doc
     ctx->last_emitted_fnt = NULL;
     ctx->cur_doc_name = sdsnew(cur_doc_name);
     ctx->includer_info = NULL;
+    ctx->sink = NULL;
+    ctx->pool = htmlgen_pool;
+    ctx->detached = false;
+    ctx->bailed_out = false;
 }
 
 void htmlgen_remove(htmlgen_ctx *ctx) {
@@ -518,6 +1136,26 @@ static char* span_type_to_str(enum nm_span_type type, bool opening_tag) {
     }
 }
 
+// pushes buf to the pending chunks and returns a fresh one. ctx->sink must be set
+static sds cut_chunk(htmlgen_ctx *ctx, sds buf) {
+    if (sdslen(buf) == 0)
+        return buf;
+    outbuf_push_sds(&ctx->sink->pending, buf);
+    return sdsMakeRoomFor(sdsempty(), HTMLGEN_MIN_CHUNK_SIZE + HTMLGEN_MIN_CHUNK_SIZE / 4);
+}
+
+// called at every block boundary, nested ones included
+static sds end_block(htmlgen_ctx *ctx, sds buf) {
+    htmlgen_sink *sink = ctx->sink;
+    if (!sink || sink->broken)
+        return buf;
+    if (sdslen(buf) >= HTMLGEN_MIN_CHUNK_SIZE)
+        buf = cut_chunk(ctx, buf);
+    if (sink->pending.len >= sink->threshold && !sink->flush(sink, &sink->pending))
+        sink->broken = true;
+    return buf;
+}
+
 static int _s_sdscmp(const void *lhs, const void *rhs) {
     return sdscmp(*(const sds *)lhs, *(const sds *)rhs);
 }
@@ -533,28 +1171,110 @@ static bool doc_doesnt_exist(htmlgen_ctx *ctx, sds docname) {
  * to_html operations
  */
 
-static sds container_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
-    namuast_container *container = (namuast_container *)base;
+// an inline followed by a return makes a paragraph
+static bool is_paragraph_at(namuast_container *container, size_t idx) {
+    return idx + 1 < container->len &&
+        container->children[idx]->ast_type == namuast_type_inline &&
+        container->children[idx + 1]->ast_type == namuast_type_return;
+}
 
-    size_t idx = 0;
-    size_t len = container->len;
-    while (idx < len) {
-        if (idx + 1 < len && 
-            container->children[idx]->ast_type == namuast_type_inline &&
-            container->children[idx + 1]->ast_type == namuast_type_return) {
+// index of the block after the one starting at idx
+static size_t next_block(namuast_container *container, size_t idx) {
+    return is_paragraph_at(container, idx)? idx + 2 : idx + 1;
+}
 
+// blocks in [st, ed) of children
+static sds blocks_to_html(namuast_container *container, size_t st, size_t ed, htmlgen_ctx *ctx, sds buf) {
+    size_t idx = st;
+    while (idx < ed && !ctx->bailed_out) {
+        if (is_paragraph_at(container, idx)) {
             buf = sdscat(buf, "<p>");
             buf = HTML_OP(container->children[idx], to_html, ctx, buf);
             buf = sdscat(buf, "</p>");
-            idx += 2;
         } else {
             buf = HTML_OP(container->children[idx], to_html, ctx, buf);
-            idx += 1;
         }
+        idx = next_block(container, idx);
+        buf = end_block(ctx, buf);
     }
     return buf;
 }
 
+static sds container_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
+    namuast_container *container = (namuast_container *)base;
+    return blocks_to_html(container, 0, container->len, ctx, buf);
+}
+
+struct render_run {
+    struct threadpool_task task; // first, so that the task is the run
+    namuast_container *container;
+    size_t st, ed;
+    htmlgen_ctx ctx;
+    sds buf;
+    size_t resume_at; // the block the run bailed out on, or ed
+};
+
+static void render_run(struct threadpool_task *task) {
+    struct render_run *run = (struct render_run *)task;
+    size_t idx = run->st;
+    while (idx < run->ed) {
+        size_t len_before = sdslen(run->buf);
+        size_t next = next_block(run->container, idx);
+        run->buf = blocks_to_html(run->container, idx, next, &run->ctx, run->buf);
+        if (run->ctx.bailed_out) {
+            // blocks before it are kept
+            if (len_before > 0)
+                sdsrange(run->buf, 0, len_before - 1);
+            else
+                sdsclear(run->buf);
+            break;
+        }
+        idx = next;
+    }
+    run->resume_at = idx;
+}
+
+// top-level blocks of ctx->ast_being_used on ctx->pool, concatenated in order
+static sds container_to_html_in_parallel(namuast_container *container, htmlgen_ctx *ctx, sds buf) {
+    struct threadpool *pool = ctx->pool;
+    size_t max_runs = pool->thread_count * HTMLGEN_PARALLEL_CHUNKS_PER_THREAD;
+    size_t blocks_per_run = (container->len + max_runs - 1) / max_runs;
+    struct render_run *runs = calloc(max_runs, sizeof(struct render_run));
+
+    size_t run_count = 0;
+    size_t idx = 0;
+    while (idx < container->len) {
+        struct render_run *run = &runs[run_count++];
+        run->container = container;
+        run->st = idx;
+        while (idx < container->len && idx - run->st < blocks_per_run)
+            idx = next_block(container, idx);
+        run->ed = idx;
+        run->ctx = *ctx;
+        run->ctx.sink = NULL;
+        run->ctx.detached = true;
+        run->buf = sdsempty();
+        run->task.run = render_run;
+        threadpool_submit(pool, &run->task);
+    }
+
+    for (idx = 0; idx < run_count; idx++) {
+        struct render_run *run = &runs[idx];
+        threadpool_wait(pool, &run->task);
+        if (ctx->sink && sdslen(run->buf) > 0) {
+            buf = cut_chunk(ctx, buf);
+            outbuf_push_sds(&ctx->sink->pending, run->buf);
+        } else {
+            buf = sdscatsds(buf, run->buf);
+            sdsfree(run->buf);
+        }
+        buf = end_block(ctx, buf);
+        buf = blocks_to_html(container, run->resume_at, run->ed, ctx, buf);
+    }
+    free(runs);
+    return buf;
+}
+
 
 static sds return_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
     return sdscat(buf, "<br>");
@@ -576,7 +1296,11 @@ static sds block_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
     struct namuast_block *block = (struct namuast_block *)base;
     switch (block->block_type) {
     case block_type_html:
-        buf = sdscat_sanitize_html(buf, block->data.html);
+        // the memo belongs to the owner of the pool
+        if (ctx->detached)
+            buf = sdscat_sanitize_html(buf, block->data.html);
+        else
+            buf = sdscat_sanitize_html_cached(ctx, buf, block->data.html);
         break;
     case block_type_raw:
         {
@@ -625,6 +1349,28 @@ static inline sds add_html_style(sds s, const char* key, char* value) {
     return s;
 }
 
+// formats without going through vsnprintf
+static sds sdscat_int(sds s, long long value) {
+    char digits[21];
+    char *p = digits + sizeof(digits);
+    unsigned long long v = value < 0? -(unsigned long long)value : (unsigned long long)value;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0)
+        *--p = '-';
+    return sdscatlen(s, p, digits + sizeof(digits) - p);
+}
+
+static inline sds add_html_int_attr(sds s, const char* key, long long value) {
+    s = sdscat(s, " ");
+    s = sdscat(s, key);
+    s = sdscat(s, "='");
+    s = sdscat_int(s, value);
+    return sdscat(s, "'");
+}
+
 #define APPEND(buf, x) (buf = sdscat(buf, x))
 
 static sds table_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
@@ -700,16 +1446,10 @@ static sds table_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
             sds cell_attr = sdsempty();
             sds cell_style = sdsempty();
 
-            if (cell->rowspan > 1) {
-                sds n = sdsfromlonglong(cell->rowspan);
-                cell_attr = add_html_attr(cell_attr, "rowspan", n);
-                sdsfree(n);
-            }
-            if (cell->colspan > 1) {
-                sds n = sdsfromlonglong(cell->colspan);
-                cell_attr = add_html_attr(cell_attr, "colspan", n);
-                sdsfree(n);
-            }
+            if (cell->rowspan > 1)
+                cell_attr = add_html_int_attr(cell_attr, "rowspan", cell->rowspan);
+            if (cell->colspan > 1)
+                cell_attr = add_html_int_attr(cell_attr, "colspan", cell->colspan);
 
             cell_attr = add_html_attr(cell_attr, "width", cell->width);
             cell_attr = add_html_attr(cell_attr, "height", cell->height);
@@ -732,6 +1472,7 @@ static sds table_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
             sdsfree(cell_style);
         }
         buf = sdscat(buf, "</tr>");
+        buf = end_block(ctx, buf);
     }
 
     buf = sdscat(buf, 
@@ -804,6 +1545,7 @@ static sds emit_list_rec(struct namuast_list* li, htmlgen_ctx *ctx, sds buf) {
         if (p->sublist) {
             buf = emit_list_rec(p->sublist, ctx, buf);
         }
+        buf = end_block(ctx, buf);
     }
     buf = sdscat(buf, ul_ed_tag);
     return buf;
@@ -816,11 +1558,17 @@ static sds list_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
 
 static sds heading_to_html(namuast_base *base, htmlgen_ctx *ctx, sds buf) {
     struct namuast_heading* hd = (struct namuast_heading*)base;
-    buf = sdscatprintf(buf, 
-        "<h%d><a class='wiki-heading' href='#toc' id='s-%s'>%s</a>. ", 
-        hd->h_num, hd->section_name, hd->section_name);
+    buf = sdscat(buf, "<h");
+    buf = sdscat_int(buf, hd->h_num);
+    buf = sdscat(buf, "><a class='wiki-heading' href='#toc' id='s-");
+    buf = sdscat(buf, hd->section_name);
+    buf = sdscat(buf, "'>");
+    buf = sdscat(buf, hd->section_name);
+    buf = sdscat(buf, "</a>. ");
     buf = INL_HTML_OP(hd->content, to_html, ctx, buf);
-    buf = sdscatprintf(buf, "</h%d>", hd->h_num);
+    buf = sdscat(buf, "</h");
+    buf = sdscat_int(buf, hd->h_num);
+    buf = sdscat(buf, ">");
     return buf;
 }
 
@@ -856,7 +1604,7 @@ static sds link_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
     buf = sdscat(buf, "' data-internal-link-section='");
     if (link->section)
         buf = sdscat_escape_html_attr(buf, link->section);
-    buf = sdscatprintf(buf, "' data-internal-link-exists='%d", (int)(!doesnt_exist));
+    buf = sdscat(buf, doesnt_exist? "' data-internal-link-exists='0" : "' data-internal-link-exists='1");
     buf = sdscat(buf, "'>");
 
     sdsfree(href);
@@ -874,7 +1622,7 @@ static sds link_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
 static sds extlink_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
     struct namuast_inl_extlink *extlink = (struct namuast_inl_extlink *)inl;
 
-    buf = sdscatprintf(buf, "<a href='");
+    buf = sdscat(buf, "<a href='");
     sds sanitized_link = sdscat_sanitize_src_href(sdsempty(), extlink->href);
     buf = sdscat_escape_html_attr(buf, sanitized_link);
     buf = sdscat(buf, "' class='external-link'>");
@@ -941,7 +1689,9 @@ static sds block_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
         buf = sdscat(buf, "</span>");
         break;
     case inlblock_type_highlight:
-        buf = sdscatprintf(buf, "<span class='wiki-size wiki-%d'>", inl_block->data.highlight_level);
+        buf = sdscat(buf, "<span class='wiki-size wiki-");
+        buf = sdscat_int(buf, inl_block->data.highlight_level);
+        buf = sdscat(buf, "'>");
         buf = INL_HTML_OP(inl_block->content, to_html, ctx, buf);
         buf = sdscat(buf, "</span>");
         break;
@@ -957,7 +1707,11 @@ static sds block_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
 
 static sds fnt_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
     struct namuast_inl_fnt *fnt = (struct namuast_inl_fnt *)inl;
-    buf = sdscatprintf(buf, "<a class='wiki-fn-link' id='rfn-%d' href='#fn-%d' title='", fnt->id, fnt->id);
+    buf = sdscat(buf, "<a class='wiki-fn-link' id='rfn-");
+    buf = sdscat_int(buf, fnt->id);
+    buf = sdscat(buf, "' href='#fn-");
+    buf = sdscat_int(buf, fnt->id);
+    buf = sdscat(buf, "' title='");
     buf = sdscat_escape_html_attr(buf, fnt->raw);
     buf = sdscat(buf, "'>");
     if (fnt->is_named) {
@@ -965,7 +1719,9 @@ static sds fnt_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
         buf = sdscat_escape_html_content(buf, fnt->repr.name);
         buf = sdscat(buf, "]");
     } else {
-        buf = sdscatprintf(buf, "[%d]", fnt->repr.anon_num);
+        buf = sdscat(buf, "[");
+        buf = sdscat_int(buf, fnt->repr.anon_num);
+        buf = sdscat(buf, "]");
     }
     buf = sdscat(buf, "</a>");
     return buf;
@@ -974,13 +1730,19 @@ static sds fnt_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
 static sds fnt_content_to_html(struct namuast_inl_fnt *fnt, htmlgen_ctx *ctx, sds buf) {
     buf = sdscat(buf, "<li class='footnote-list'>");
 
-    buf = sdscatprintf(buf, "<a class='wiki-fn-content' id='fn-%d' href='#rfn-%d'>", fnt->id, fnt->id);
+    buf = sdscat(buf, "<a class='wiki-fn-content' id='fn-");
+    buf = sdscat_int(buf, fnt->id);
+    buf = sdscat(buf, "' href='#rfn-");
+    buf = sdscat_int(buf, fnt->id);
+    buf = sdscat(buf, "'>");
     if (fnt->is_named) {
         buf = sdscat(buf, "[");
         buf = sdscat_escape_html_content(buf, fnt->repr.name);
         buf = sdscat(buf, "]");
     } else {
-        buf = sdscatprintf(buf, "[%d]", fnt->repr.anon_num);
+        buf = sdscat(buf, "[");
+        buf = sdscat_int(buf, fnt->repr.anon_num);
+        buf = sdscat(buf, "]");
     }
     buf = sdscat(buf, "</a> ");
     buf = INL_HTML_OP(fnt->content, to_html, ctx, buf);
@@ -991,6 +1753,11 @@ static sds fnt_content_to_html(struct namuast_inl_fnt *fnt, htmlgen_ctx *ctx, sd
 
 static sds fnt_section_inl_to_html(namuast_inline *inl, htmlgen_ctx *ctx, sds buf) {
     struct namuast_inl_fnt_section *fnt_section = (struct namuast_inl_fnt_section *)inl;
+    if (ctx->detached) {
+        // it picks up where the last one has left off
+        ctx->bailed_out = true;
+        return buf;
+    }
 
     struct namuast_container *ast = ctx->ast_being_used;
     struct list *fnt_list = &ast->fnt_list;
@@ -1021,7 +1788,11 @@ static sds dfs_toc(struct htmlgen_ctx *ctx, sds buf, struct namuast_heading* hd)
     if (hd->parent) { 
         // when it is not the root: sentinel node
         buf = sdscat(buf, "<span class='toc-item'>");
-        buf = sdscatprintf(buf, "<a class='tocs-section-link' href='#s-%s'>%s</a>.", hd->section_name, hd->section_name);
+        buf = sdscat(buf, "<a class='tocs-section-link' href='#s-");
+        buf = sdscat(buf, hd->section_name);
+        buf = sdscat(buf, "'>");
+        buf = sdscat(buf, hd->section_name);
+        buf = sdscat(buf, "</a>.");
         buf = INL_HTML_OP(hd->content, to_html, ctx, buf);
         buf = sdscat(buf, "</span>");
     }
@@ -1201,14 +1972,54 @@ static void container_inl_get_lname(namuast_inline *inl, varray *arr) {
     }
 }
 
+struct htmlgen_link_counter htmlgen_link_counter;
+
+static uint32_t hash_link_name(sds name) {
+    uint32_t h = 2166136261u;
+    size_t idx, len = sdslen(name);
+    for (idx = 0; idx < len; idx++) {
+        h ^= (unsigned char)name[idx];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Leaves each link target once in unique_out, compared as doc_doesnt_exist does. Returns how many there are.
+static size_t dedupe_link_names(varray *link_names, sds *unique_out) {
+    size_t count = varray_length(link_names);
+    size_t slot_count = 16;
+    while (slot_count < count * 2)
+        slot_count *= 2;
+    sds *slots = calloc(slot_count, sizeof(sds));
+
+    size_t idx, unique_count = 0;
+    for (idx = 0; idx < count; idx++) {
+        sds name = (sds)varray_get(link_names, idx);
+        size_t slot = hash_link_name(name) & (slot_count - 1);
+        while (slots[slot] && sdscmp(slots[slot], name))
+            slot = (slot + 1) & (slot_count - 1);
+        if (!slots[slot]) {
+            slots[slot] = name;
+            unique_out[unique_count++] = name;
+        }
+    }
+    free(slots);
+    return unique_count;
+}
+
 sds htmlgen_generate(htmlgen_ctx *ctx, namuast_container *ast_container, sds buf) {
     size_t idx;
     varray *link_names = varray_init(); // just borrow all internal links (it doesn't own them)
     HTML_OP(ast_container, get_lname, link_names);
 
-    size_t docname_count = varray_length(link_names);
+    // the same article is often linked dozens of times, e.g. from navboxes
+    sds *unique_names = calloc(varray_length(link_names) + 1, sizeof(sds));
+    size_t docname_count = dedupe_link_names(link_names, unique_names);
+    htmlgen_link_counter.links += varray_length(link_names);
+    htmlgen_link_counter.unique_links += docname_count;
+
     bool results[docname_count];
-    ctx->doc_itfc->documents_exist(ctx->doc_itfc, docname_count, (char **)link_names->memory, results);
+    ctx->doc_itfc->documents_exist(ctx->doc_itfc, ctx->cur_doc_name, docname_count, (char **)unique_names, results);
 
     size_t ne_cnt = 0;
     for (idx = 0; idx < docname_count; idx++) {
@@ -1224,22 +2035,56 @@ sds htmlgen_generate(htmlgen_ctx *ctx, namuast_container *ast_container, sds buf
 
     for (idx = 0; idx < docname_count; idx++) {
         if (!results[idx]) {
-            *ne_p++ = (sds)varray_get(link_names, idx);
+            *ne_p++ = unique_names[idx];
         }
     }
     qsort(ctx->ne_docs, ne_cnt, sizeof(sds), _s_sdscmp);
     ctx->ast_being_used = ast_container;
-    buf = HTML_OP(ast_container, to_html, ctx, buf);
+    if (ctx->pool && !ctx->includer_info && ast_container->len >= HTMLGEN_PARALLEL_MIN_BLOCKS)
+        buf = container_to_html_in_parallel(ast_container, ctx, buf);
+    else
+        buf = HTML_OP(ast_container, to_html, ctx, buf);
 
     free(ctx->ne_docs);
     ctx->ne_docs = NULL;
     ctx->ast_being_used = NULL;
     ctx->ne_docs_count = 0;
+    free(unique_names);
     varray_free(link_names, NULL);
     return buf;
 }
 
+typedef struct {
+    htmlgen_sink base;
+    struct outbuf chunks;
+} collecting_sink;
+
+static bool collect_chunks(htmlgen_sink *base, struct outbuf *chunks) {
+    outbuf_move(&((collecting_sink *)base)->chunks, chunks);
+    return true;
+}
+
 sds htmlgen_generate_directly(const char *doc_name, struct namugen_doc_itfc *doc_itfc, sds buf, bool *success_out) {
+    collecting_sink sink = {
+        .base = {
+            .flush = collect_chunks,
+            .threshold = HTMLGEN_CHUNK_SIZE,
+            .broken = false
+        }
+    };
+    outbuf_init(&sink.chunks);
+    buf = htmlgen_generate_to_sink(doc_name, doc_itfc, &sink.base, buf, success_out);
+    if (sink.chunks.count == 0)
+        return buf;
+
+    // the only time the page is copied
+    outbuf_push_sds(&sink.chunks, buf);
+    sds page = outbuf_flatten(&sink.chunks, sdsempty());
+    outbuf_remove(&sink.chunks);
+    return page;
+}
+
+sds htmlgen_generate_to_sink(const char *doc_name, struct namugen_doc_itfc *doc_itfc, htmlgen_sink *sink, sds buf, bool *success_out) {
     htmlgen_ctx htmlgen;
 
     struct namuast_container* ast = doc_itfc->get_ast(doc_itfc, doc_name);
@@ -1248,10 +2093,17 @@ sds htmlgen_generate_directly(const char *doc_name, struct namugen_doc_itfc *doc
             *success_out = false;
         return buf;
     }
+    outbuf_init(&sink->pending);
     htmlgen_init(&htmlgen, doc_name, doc_itfc);
+    htmlgen.sink = sink;
     buf = htmlgen_generate(&htmlgen, ast, buf);
     htmlgen_remove(&htmlgen);
     RELEASE_NAMUAST(ast);
+
+    // what is left of pending goes out before the sds
+    if (!sink->broken && sink->pending.count > 0 && !sink->flush(sink, &sink->pending))
+        sink->broken = true;
+    outbuf_remove(&sink->pending);
     if (success_out)
         *success_out = true;
     return buf;
@@ -1268,6 +2120,11 @@ static sds inclusion_converter(htmlgen_ctx *ctx, htmlgen_macro_record *_, struct
     if (macro->pos_args_len != 1) {
         return htmlgen_macro_fallback(ctx, macro, buf);
     }
+    if (ctx->detached) {
+        // get_ast is not meant to be called off the owner thread, and the included document shares the sink
+        ctx->bailed_out = true;
+        return buf;
+    }
     sds doc_name = macro->pos_args[0];
     if (!htmlgen_already_included(ctx, doc_name)) {
         struct namuast_container *ast_to_be_included = ctx->doc_itfc->get_ast(ctx->doc_itfc, doc_name);
@@ -1279,6 +2136,7 @@ static sds inclusion_converter(htmlgen_ctx *ctx, htmlgen_macro_record *_, struct
         htmlgen_includer_info includer_info = {.includer_ctx = ctx};
         htmlgen_init(&sub_ctx, doc_name, ctx->doc_itfc);
         sub_ctx.includer_info = &includer_info;
+        sub_ctx.sink = ctx->sink;
 
         buf = htmlgen_generate(&sub_ctx, ast_to_be_included, buf);
 
@@ -3,19 +3,31 @@
 
 #include "sds/sds.h"
 #include "namugen.h"
+#include "outbuf.h"
 #include <stdbool.h>
 
 void initmod_htmlgen();
 
 struct namugen_doc_itfc {
     struct namuast_container* (*get_ast)(struct namugen_doc_itfc *, const char *doc_name); // it may return NULL
-    void (*documents_exist)(struct namugen_doc_itfc *, int argc, char** docnames, bool *results);
-    sds (*doc_href)(struct namugen_doc_itfc *, char *doc_name);
+    // docnames are the links of linking_doc_name, which is the document being generated or one included by it
+    void (*documents_exist)(struct namugen_doc_itfc *, const char *linking_doc_name, int argc, char** docnames, bool *results);
+    sds (*doc_href)(struct namugen_doc_itfc *, char *doc_name); // called from the threads of the pool too, if one is used
 };
 
+// bump whenever the markup generated for the same AST changes, so that cached pages are not served
+#define HTMLGEN_RENDERER_VERSION 1
+
 #define MAX_TOC_COUNT 100
 #define INITIAL_MAIN_BUF (4096*4)
 #define INITIAL_INTERNAL_LINKS 1024
+// output is collected in chunks of about this size instead of one growing buffer
+#define HTMLGEN_CHUNK_SIZE (64 * 1024)
+// the sds being appended to is cut off at about this size
+#define HTMLGEN_MIN_CHUNK_SIZE (4 * 1024)
+// documents with fewer top-level blocks are not worth handing to the pool
+#define HTMLGEN_PARALLEL_MIN_BLOCKS 64
+#define HTMLGEN_PARALLEL_CHUNKS_PER_THREAD 4
 
 
 struct htmlgen_ctx;
@@ -30,7 +42,24 @@ typedef struct htmlgen_simple_macro_record {
 } htmlgen_simple_macro_record;
 
 
+/*
+ * Output sink
+ * to_html ops append to an sds. With a sink, it is cut off into a chunk of pending at block boundaries,
+ * containers, table rows and list items included, once it holds HTMLGEN_MIN_CHUNK_SIZE bytes,
+ * and memoized HTML goes into pending by reference instead of being copied.
+ * pending is handed over once it holds threshold bytes, so that the page can be sent while the rest is being rendered.
+ * Without one, the whole page stays in the sds.
+ */
+typedef struct htmlgen_sink {
+    // takes the chunks over, leaving it empty. Returning false stops flushing
+    bool (*flush)(struct htmlgen_sink *sink, struct outbuf *chunks);
+    size_t threshold;
+    bool broken;
+    struct outbuf pending; // set up by htmlgen_generate_to_sink
+} htmlgen_sink;
+
 struct htmlgen_ctx;
+struct threadpool;
 typedef struct htmlgen_includer_info {
     struct htmlgen_ctx *includer_ctx;
 } htmlgen_includer_info;
@@ -40,6 +69,7 @@ typedef struct htmlgen_ctx {
     struct namuast_inl_fnt *last_emitted_fnt; // borrowed (a weak reference)
 
     sds cur_doc_name;
+    htmlgen_sink *sink; // may be NULL. Shared with included documents
 
     /* temporary values */
     sds *ne_docs; // sorted array of names of not existing documents
@@ -47,13 +77,35 @@ typedef struct htmlgen_ctx {
     namuast_container *ast_being_used;
     
     htmlgen_includer_info *includer_info;
+
+    /*
+     * Parallel rendering
+     * With a pool, top-level blocks of a big document are split into runs rendered on its threads, each with a detached copy of the ctx.
+     * Footnote sections and inclusions depend on what has been rendered before them, so a detached ctx bails out on them
+     * and the rest of the run is left to the owner of the ctx, which renders it in order.
+     */
+    struct threadpool *pool; // may be NULL
+    bool detached;
+    bool bailed_out;
 } htmlgen_ctx;
 
 void htmlgen_init(htmlgen_ctx *ctx, const char *cur_doc_name, struct namugen_doc_itfc *doc_itfc);
 sds htmlgen_generate(htmlgen_ctx *html_ctx, namuast_container *ast_container, sds buf);
 void htmlgen_remove(htmlgen_ctx *ctx);
 
+// opt-in. The pool is used by ctxs initialized after this, or none if NULL
+void htmlgen_use_thread_pool(struct threadpool *pool);
+
+// internal links met by htmlgen_generate in this process, and how many distinct targets were checked for existence
+struct htmlgen_link_counter {
+    unsigned long long links;
+    unsigned long long unique_links;
+};
+extern struct htmlgen_link_counter htmlgen_link_counter;
+
 sds htmlgen_generate_directly(const char *doc_name, struct namugen_doc_itfc *doc_itfc, sds buf, bool *success_out);
+// everything but the returned sds has been flushed to sink, unless it broke
+sds htmlgen_generate_to_sink(const char *doc_name, struct namugen_doc_itfc *doc_itfc, htmlgen_sink *sink, sds buf, bool *success_out);
 
 sds htmlgen_macro_fallback(htmlgen_ctx *ctx, struct namuast_inl_macro* macro, sds buf);
 #endif // ifndef _HTMLGEN_H
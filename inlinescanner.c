@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "namugen.h"
+
+/*
+ * Inline scanner
+ * ===
+ * Hand-written replacement of the flex scanner that used to live in inlinelexer.l.
+ * Every rule of the lexer has a matcher below which returns the end of the longest match or NULL.
+ * Like flex, the longest match wins at each position and the earlier rule wins a tie.
+ *
+ * Markup can only start with one of the bytes classified below, so runs of plain bytes are skipped in bulk
+ * (with SIMD, see bytescan.h) and stay pending until a markup is found. Adjacent strings are merged by nm_inl_emit_str anyway,
+ * so how plain text is chunked doesn't change the result.
+ */
+
+enum inl_byte_class {
+    ic_plain = 0,
+    ic_newline,
+    ic_lbrk,    // [*...], [[...]], [...]
+    ic_quote,   // '''...''', ''...''
+    ic_lbrace,  // {{{...}}}
+    ic_span,    // ~~...~~, --...--, __...__, ^^...^^, ,,...,,
+    ic_h,       // http(s)://...(image)
+    ic_special  // no rule starts with it, but it's not a normal_char either
+};
+
+static const unsigned char inl_byte_class[256] = {
+    ['\n'] = ic_newline,
+    ['['] = ic_lbrk,
+    [']'] = ic_special,
+    ['\''] = ic_quote,
+    ['{'] = ic_lbrace,
+    ['~'] = ic_span,
+    ['-'] = ic_span,
+    ['_'] = ic_span,
+    ['^'] = ic_span,
+    [','] = ic_span,
+    ['h'] = ic_h,
+};
+
+// every byte whose class is not ic_plain
+static const struct byteset inl_special_bytes = BYTESET('\n', '[', ']', '\'', '{', '~', '-', '_', '^', ',', 'h');
+
+#define IS_ESCAPABLE_IN_LINK(c) ((c) == '|' || (c) == '[' || (c) == ']')
+#define IS_IMAGE_LETTER(c) (('a' <= (c) && (c) <= 'z') || ('A' <= (c) && (c) <= 'Z') || ('0' <= (c) && (c) <= '9') || (c) == '_')
+
+/*
+ * Matchers
+ * ---
+ * Rules with alternations are run as a small NFA whose live states are kept in a bitmask.
+ */
+
+// "[*"([^[\]\n]|("["[^\]\n]*"]")|("[["("]"?[^\]\n])*"]]"))*"]"
+static char* match_footnote(char *p, char *border) {
+    enum {
+        FS_ITEM = 1,        // between items
+        FS_LBRK = 2,        // right after '[' of an item
+        FS_BRK = 4,         // in "[...]"
+        FS_DBRK = 8,        // in "[[...]]"
+        FS_DBRK_RBRK = 16   // in "[[...]]", right after ']'
+    };
+    char *matched = NULL;
+    int states = FS_ITEM;
+
+    if (!EQ(p + 1, border, '*'))
+        return NULL;
+    for (p += 2; p < border && states; p++) {
+        char c = *p;
+        int next = 0;
+        if (c == '\n')
+            break;
+        if (states & FS_ITEM) {
+            if (c == ']')
+                matched = p + 1;
+            else if (c == '[')
+                next |= FS_LBRK;
+            else
+                next |= FS_ITEM;
+        }
+        if (states & (FS_LBRK | FS_BRK)) {
+            next |= (c == ']')? FS_ITEM : FS_BRK;
+            if ((states & FS_LBRK) && c == '[')
+                next |= FS_DBRK;
+        }
+        if (states & FS_DBRK) {
+            next |= (c == ']')? FS_DBRK_RBRK : FS_DBRK;
+        }
+        if (states & FS_DBRK_RBRK) {
+            next |= (c == ']')? FS_ITEM : FS_DBRK;
+        }
+        states = next;
+    }
+    return matched;
+}
+
+// "[["(("\\"{escapable_char_in_link})|("]"|""){not_a_rbrk})*"]]"
+static char* match_link(char *p, char *border) {
+    enum {
+        LS_ITEM = 1,    // between items
+        LS_ESCAPE = 2,  // right after '\\'
+        LS_RBRK = 4     // right after ']'
+    };
+    char *matched = NULL;
+    int states = LS_ITEM;
+
+    if (!EQ(p + 1, border, '['))
+        return NULL;
+    for (p += 2; p < border && states; p++) {
+        char c = *p;
+        int next = 0;
+        if (c == '\n')
+            break;
+        if (states & LS_ITEM) {
+            if (c == ']') {
+                next |= LS_RBRK;
+            } else {
+                next |= LS_ITEM;
+                if (c == '\\')
+                    next |= LS_ESCAPE;
+            }
+        }
+        if ((states & LS_ESCAPE) && IS_ESCAPABLE_IN_LINK(c)) {
+            next |= LS_ITEM;
+        }
+        if (states & LS_RBRK) {
+            if (c == ']')
+                matched = p + 1;
+            else
+                next |= LS_ITEM;
+        }
+        states = next;
+    }
+    return matched;
+}
+
+// "["(("\\"{escapable_char_in_link})|{not_a_rbrk})*"]"
+static char* match_macro(char *p, char *border) {
+    enum {
+        MS_ITEM = 1,
+        MS_ESCAPE = 2
+    };
+    char *matched = NULL;
+    int states = MS_ITEM;
+
+    for (p += 1; p < border && states; p++) {
+        char c = *p;
+        int next = 0;
+        if (c == '\n')
+            break;
+        if (states & MS_ITEM) {
+            if (c == ']') {
+                matched = p + 1;
+            } else {
+                next |= MS_ITEM;
+                if (c == '\\')
+                    next |= MS_ESCAPE;
+            }
+        }
+        if ((states & MS_ESCAPE) && IS_ESCAPABLE_IN_LINK(c)) {
+            next |= MS_ITEM;
+        }
+        states = next;
+    }
+    return matched;
+}
+
+// {image_option}"="{letter}+
+static char* match_image_option(char *p, char *border) {
+    static const char *options[] = {"width", "height", "align"};
+    size_t idx;
+    for (idx = 0; idx < sizeof(options) / sizeof(options[0]); idx++) {
+        size_t len = strlen(options[idx]);
+        if (PREFIXSTR(p, border, options[idx]) && EQ(p + len, border, '=')) {
+            char *value_st = p + len + 1;
+            char *testp = value_st;
+            while (testp < border && IS_IMAGE_LETTER(*testp)) {
+                testp++;
+            }
+            return testp > value_st? testp : NULL;
+        }
+    }
+    return NULL;
+}
+
+// "http""s"?"://"[^ \n]*("."{image_ext}|"?.jpg")("?"({image_option}"="{letter}+)("&"{image_option}"="{letter}+)*)?
+static char* match_image(char *p, char *border) {
+    static const char *exts[] = {".jpg", ".jpeg", ".png", ".gif", "?.jpg"};
+    char *url_st, *url_ed;
+    char *matched = NULL;
+    char *testp;
+
+    if (PREFIXSTR(p, border, "http://"))
+        url_st = p + 7;
+    else if (PREFIXSTR(p, border, "https://"))
+        url_st = p + 8;
+    else
+        return NULL;
+
+    url_ed = url_st;
+    SKIP_UNTIL2(url_ed, border, ' ', '\n');
+    // [^ \n]* may give back any number of bytes, so every extension in the url is a candidate
+    for (testp = url_st; testp < url_ed; testp++) {
+        size_t idx;
+        if (*testp != '.' && *testp != '?')
+            continue;
+        for (idx = 0; idx < sizeof(exts) / sizeof(exts[0]); idx++) {
+            if (!PREFIXSTR(testp, url_ed, exts[idx]))
+                continue;
+            char *ed = testp + strlen(exts[idx]);
+            char *opt_ed;
+            if (EQ(ed, border, '?') && (opt_ed = match_image_option(ed + 1, border))) {
+                ed = opt_ed;
+                while (EQ(ed, border, '&') && (opt_ed = match_image_option(ed + 1, border))) {
+                    ed = opt_ed;
+                }
+            }
+            if (!matched || matched < ed)
+                matched = ed;
+        }
+    }
+    return matched;
+}
+
+// "{{{"(("}}"|"}"|"")[^}\n])*"}}}"
+static char* match_block(char *p, char *border) {
+    int rbrace_cnt = 0;
+    if (!PREFIXSTR(p, border, "{{{"))
+        return NULL;
+    for (p += 3; p < border && *p != '\n'; p++) {
+        if (*p != '}')
+            rbrace_cnt = 0;
+        else if (++rbrace_cnt == 3)
+            return p + 1;
+    }
+    return NULL;
+}
+
+// d{n}((d{0,n-1})[^d\n])+d{n} for spans, with n = 2 or 3
+static char* match_span(char *p, char *border, char delim, int n) {
+    int idx;
+    int delim_cnt = 0;
+    bool has_item = false;
+
+    for (idx = 0; idx < n; idx++) {
+        if (!EQ(p + idx, border, delim))
+            return NULL;
+    }
+    for (p += n; p < border && *p != '\n'; p++) {
+        if (*p != delim) {
+            has_item = true;
+            delim_cnt = 0;
+        } else if (++delim_cnt == n) {
+            return has_item? p + 1 : NULL;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Actions
+ */
+
+static void as_footnote(struct namuast_inl_container *container, struct namugen_ctx *ctx, char *st, char *ed) {
+    char *testp;
+    char *border = ed - 1;
+    char *extra_st = st + 2;
+    testp = st + 2;
+    UNTIL_REACHING2(testp, border, ' ', '\t') {
+        testp++;
+    }
+    char *extra_ed = testp;
+
+    CONSUME_SPACETAB(testp, border);
+
+    bndstr head = {extra_st, extra_ed - extra_st};
+
+    char *fnt_st_p;
+    char *dummy;
+
+    fnt_st_p = testp;
+    nm_begin_footnote(ctx);
+
+    struct namuast_inl_container *footnote_content = namuast_make_inline(ctx);
+    scn_parse_inline(footnote_content, testp, border, &dummy, ctx);
+    nm_end_footnote(ctx);
+
+    int id = nm_register_footnote(ctx, footnote_content, head);
+    bndstr s = {fnt_st_p, border - fnt_st_p};
+    nm_inl_emit_footnote_mark(container, ctx, id, s);
+}
+
+static void as_image(struct namuast_inl_container *container, char *st, char *ed) {
+    char *border = ed;
+    bndstr width = {0, 0}, height = {0, 0};
+    int align = nm_align_none;
+
+    char* url_st, *url_ed;
+    url_st = st;
+    url_ed = border;
+    // now parse the option
+    bool qm_found = false;
+    char *testp;
+    if ((testp = memchr(st, '?', ed - st))) {
+        url_ed = testp;
+        testp++;
+        if (PREFIXSTR(testp, border, ".jpg")) {
+            testp += 4;
+            if ((testp = memchr(testp, '?', border - testp))) {
+                qm_found = true;
+                testp++;
+            }
+        } else
+            qm_found = true;
+    }
+    if (qm_found) {
+        while (1) {
+            char *key_st, *key_ed;
+            char *value_st, *value_ed;
+            key_st = testp;
+            CONSUME_SPACETAB(testp, border);
+            UNTIL_REACHING2(testp, border, '=', '\n') {
+                testp++;
+            }
+            if (!EQ(testp, border, '=')) break;
+            key_ed = testp;
+            RCONSUME_SPACETAB(key_st, key_ed);
+            testp++; // consume '='
+
+            CONSUME_SPACETAB(testp, border);
+            value_st = testp;
+            UNTIL_REACHING4(testp, border, '&', '\n', ' ', '\t') {
+                testp++;
+            }
+            value_ed = testp;
+            RCONSUME_SPACETAB(value_st, value_ed);
+
+            CONSUME_SPACETAB(testp, border);
+
+            // now set up options, though it's a hard wiring hack...
+            if (EQSTR(key_st, key_ed, "width")) {
+                width = (bndstr){value_st, value_ed - value_st};
+            } else if (EQSTR(key_st, key_ed, "height")) {
+                height = (bndstr){value_st, value_ed - value_st};
+            } else if (EQSTR(key_st, key_ed, "align")) {
+                if (EQSTR(value_st, value_ed, "left")) {
+                    align = nm_align_left;
+                } else if (EQSTR(value_st, value_ed, "right")) {
+                    align = nm_align_right;
+                } else if (EQSTR(value_st, value_ed, "center")) {
+                    align = nm_align_center;
+                }
+            }
+
+            if (EQ(testp, border, '&')) {
+                testp++; // consume '&'
+                continue;
+            }
+            break;
+        }
+    }
+
+    bndstr url = {url_st, url_ed - url_st};
+    nm_inl_emit_image(container, url, width, height, align);
+}
+
+static void as_span(struct namuast_inl_container *container, struct namugen_ctx *ctx, char* st, char* ed, enum nm_span_type type) {
+    char *dummy;
+    CONSUME_SPACETAB(st, ed);
+    RCONSUME_SPACETAB(st, ed);
+    struct namuast_inl_container *span_container = namuast_make_inline(ctx);
+    scn_parse_inline(span_container, st, ed, &dummy, ctx);
+    nm_inl_emit_span(container, span_container, type);
+}
+
+static void as_link(struct namuast_inl_container *container, struct namugen_ctx *ctx, char* st, char* ed) {
+    CONSUME_SPACETAB(st, ed);
+    RCONSUME_SPACETAB(st, ed);
+
+    char *p;
+    for (p = ed - 1; p >= st; ) {
+        if (p - 1 >= st && *(p - 1) == '\\' && *p == '|')
+            p -= 2;
+        else if (*p == '|')
+            break;
+        else
+            p--;
+    }
+    if (p < st)
+        p = NULL;
+    char* pipe_pos = p;
+    scn_parse_link_content(st, ed, pipe_pos, ctx, container);
+}
+
+static void as_macro(struct namuast_inl_container *container, struct namugen_ctx *ctx, char* st, char *ed) {
+    bndstr raw = {st, ed - st};
+    bndstr name;
+    size_t pos_args_len;
+    size_t kw_args_len;
+
+    char *testp = st;
+    UNTIL_REACHING1(testp, ed, '(') {
+        testp++;
+    }
+    name.str = st;
+    name.len = testp - st;
+
+    pos_args_len = 0;
+    kw_args_len = 0;
+
+    if (EQ(testp, ed, '(')) {
+        testp++;
+        char *lpar_st = testp;
+        UNTIL_REACHING1(testp, ed, ')') {
+            UNTIL_REACHING2(testp, ed, ',', ')') {
+                UNTIL_REACHING3(testp, ed, ',', '=', ')') {
+                    testp++;
+                }
+                if (EQ(testp, ed, '=')) {
+                    testp++;
+                    UNTIL_REACHING2(testp, ed, ',', ')') {
+                        testp++;
+                    }
+                    kw_args_len++;
+                } else {
+                    pos_args_len++;
+                }
+            }
+            if (testp >= ed) {
+                goto not_a_fn_macro;
+            } else if (EQ(testp, ed, ',')) {
+                testp++;
+            }
+        }
+
+        // now it is assured that this syntax is a function-style macro
+        bndstr pos_args[pos_args_len];
+        bndstr kw_args[kw_args_len * 2];
+        size_t pos_idx = 0, kw_idx = 0;
+
+        testp = lpar_st;
+        UNTIL_REACHING1(testp, ed, ')') {
+            UNTIL_REACHING2(testp, ed, ',', ')') {
+                char *k_st = testp;
+                UNTIL_REACHING3(testp, ed, ',', '=', ')') {
+                    testp++;
+                }
+                char *k_ed = testp;
+                CONSUME_SPACETAB(k_st, k_ed);
+                RCONSUME_SPACETAB(k_st, k_ed);
+
+                if (EQ(testp, ed, '=')) {
+                    testp++;
+                    char *v_st = testp;
+                    UNTIL_REACHING2(testp, ed, ',', ')') {
+                        testp++;
+                    }
+                    char *v_ed = testp;
+                    CONSUME_SPACETAB(v_st, v_ed);
+                    RCONSUME_SPACETAB(v_st, v_ed);
+
+                    kw_args[kw_idx++] = (bndstr){k_st, k_ed - k_st};
+                    kw_args[kw_idx++] = (bndstr){v_st, v_ed - v_st};
+                } else {
+                    pos_args[pos_idx++] = (bndstr){k_st, k_ed - k_st};
+                }
+            }
+            if (EQ(testp, ed, ',')) {
+                testp++;
+            }
+        }
+        nm_inl_emit_macro(container, ctx, name, true, pos_args_len, pos_args, kw_args_len, kw_args, raw);
+        return;
+    }
+not_a_fn_macro:
+    nm_inl_emit_macro(container, ctx, name, false, 0, NULL, 0, NULL, raw);
+}
+
+static enum nm_span_type span_type_of(char delim) {
+    switch (delim) {
+    case '~':
+    case '-':
+        return nm_span_strike;
+    case '_':
+        return nm_span_underline;
+    case '^':
+        return nm_span_superscript;
+    case ',':
+        return nm_span_subscript;
+    }
+    return nm_span_none;
+}
+
+
+/*
+ * Trace
+ * ---
+ * With INLINE_SCANNER_TRACE, every call prints its line and the tokens flex would have returned for it to stderr,
+ * plain text merged as nm_inl_emit_str does. example/inline/*.expected hold the same for the rules of inlinelexer.l.
+ * Not thread safe, it's for bootest without --threads.
+ */
+#ifdef INLINE_SCANNER_TRACE
+static int trace_depth;
+
+static void trace_token(const char *rule, char *st, char *ed) {
+    fprintf(stderr, "%*s%s \"", trace_depth * 2, "", rule);
+    for (; st < ed; st++) {
+        unsigned char c = *st;
+        if (c == '"' || c == '\\')
+            fprintf(stderr, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", stderr);
+        else if (c == '\t')
+            fputs("\\t", stderr);
+        else if (c < 0x20 || c == 0x7f)
+            fprintf(stderr, "\\x%02x", c);
+        else
+            fputc(c, stderr);
+    }
+    fputs("\"\n", stderr);
+}
+
+static void trace_scan(char *p, char *border) {
+    char *line_ed = memchr(p, '\n', border - p);
+    trace_token("scan", p, line_ed? line_ed : border);
+    trace_depth++;
+}
+
+#define TRACE_TOKEN(rule, st, ed) trace_token(rule, st, ed)
+#define TRACE_SCAN(p, border) trace_scan(p, border)
+#define TRACE_END() trace_depth--
+#else
+#define TRACE_TOKEN(rule, st, ed)
+#define TRACE_SCAN(p, border)
+#define TRACE_END()
+#endif
+
+
+namuast_inl_container *scn_parse_inline(namuast_inl_container *container, char *p, char* border, char **p_out, struct namugen_ctx* ctx) {
+    char *text_st = p; // plain text from text_st to p is not emitted yet
+
+#define EMIT_PENDING_TEXT() \
+    if (text_st < p) { \
+        bndstr s = {text_st, p - text_st}; \
+        TRACE_TOKEN("text", text_st, p); \
+        nm_inl_emit_str(container, s); \
+    }
+
+    TRACE_SCAN(p, border);
+
+    while (p < border) {
+        char *ed;
+        switch (inl_byte_class[(unsigned char)*p]) {
+        case ic_plain:
+            p = bytescan_find_set(p + 1, border, &inl_special_bytes);
+            continue;
+        case ic_newline:
+            goto finish;
+        case ic_lbrk: {
+            char *fnt_ed = match_footnote(p, border);
+            char *link_ed = match_link(p, border);
+            char *macro_ed = match_macro(p, border);
+
+            if (fnt_ed && (!link_ed || fnt_ed >= link_ed) && (!macro_ed || fnt_ed >= macro_ed)) {
+                if (nm_in_footnote(ctx)) {
+                    // as plain text
+                    p = fnt_ed;
+                    continue;
+                }
+                EMIT_PENDING_TEXT();
+                TRACE_TOKEN("footnote", p, fnt_ed);
+                as_footnote(container, ctx, p, fnt_ed);
+                ed = fnt_ed;
+            } else if (link_ed && (!macro_ed || link_ed >= macro_ed)) {
+                EMIT_PENDING_TEXT();
+                TRACE_TOKEN("link", p, link_ed);
+                as_link(container, ctx, p + 2, link_ed - 2);
+                ed = link_ed;
+            } else if (macro_ed) {
+                EMIT_PENDING_TEXT();
+                TRACE_TOKEN("macro", p, macro_ed);
+                as_macro(container, ctx, p + 1, macro_ed - 1);
+                ed = macro_ed;
+            } else
+                ed = NULL;
+            break;
+        }
+        case ic_quote: {
+            char *bold_ed = match_span(p, border, '\'', 3);
+            char *italic_ed = match_span(p, border, '\'', 2);
+            if (bold_ed && (!italic_ed || bold_ed >= italic_ed)) {
+                EMIT_PENDING_TEXT();
+                TRACE_TOKEN("bold", p, bold_ed);
+                as_span(container, ctx, p + 3, bold_ed - 3, nm_span_bold);
+                ed = bold_ed;
+            } else if (italic_ed) {
+                EMIT_PENDING_TEXT();
+                TRACE_TOKEN("italic", p, italic_ed);
+                as_span(container, ctx, p + 2, italic_ed - 2, nm_span_italic);
+                ed = italic_ed;
+            } else
+                ed = NULL;
+            break;
+        }
+        case ic_lbrace:
+            if ((ed = match_block(p, border))) {
+                char *dummyp;
+                EMIT_PENDING_TEXT();
+                TRACE_TOKEN("block", p, ed);
+                scn_parse_block(p, ed, &dummyp, &block_emitter_ops_inline, ctx, container);
+            }
+            break;
+        case ic_span:
+            if ((ed = match_span(p, border, *p, 2))) {
+                EMIT_PENDING_TEXT();
+                TRACE_TOKEN("span", p, ed);
+                as_span(container, ctx, p + 2, ed - 2, span_type_of(*p));
+            }
+            break;
+        case ic_h:
+            if ((ed = match_image(p, border))) {
+                EMIT_PENDING_TEXT();
+                TRACE_TOKEN("image", p, ed);
+                as_image(container, p, ed);
+            }
+            break;
+        default:
+            ed = NULL;
+            break;
+        }
+
+        if (ed) {
+            p = text_st = ed;
+        } else {
+            p++; // a special character which starts nothing is plain text as well
+        }
+    }
+finish:
+    EMIT_PENDING_TEXT();
+#undef EMIT_PENDING_TEXT
+    TRACE_END();
+
+    *p_out = p;
+    return container;
+}
@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lru.h"
+
+static void free_entry(struct lru *lru, struct lru_entry *entry) {
+    HASH_DEL(lru->table, entry);
+    lru->used -= entry->size;
+    if (lru->value_free)
+        lru->value_free(entry->value);
+    free(entry->key);
+    free(entry);
+}
+
+void lru_init(struct lru *lru, size_t budget, void (*value_free)(void *value)) {
+    lru->table = NULL;
+    lru->budget = budget;
+    lru->used = 0;
+    lru->value_free = value_free;
+}
+
+void lru_remove(struct lru *lru) {
+    struct lru_entry *entry, *tmp;
+    HASH_ITER(hh, lru->table, entry, tmp) {
+        free_entry(lru, entry);
+    }
+}
+
+void* lru_get(struct lru *lru, const char *key) {
+    struct lru_entry *entry;
+    HASH_FIND_STR(lru->table, key, entry);
+    if (!entry)
+        return NULL;
+    // uthash keeps insertion order, so re-adding moves it to the most recently used end
+    HASH_DEL(lru->table, entry);
+    HASH_ADD_KEYPTR(hh, lru->table, entry->key, strlen(entry->key), entry);
+    return entry->value;
+}
+
+bool lru_put(struct lru *lru, const char *key, void *value, size_t size) {
+    lru_del(lru, key);
+    if (size > lru->budget) {
+        if (lru->value_free)
+            lru->value_free(value);
+        return false;
+    }
+
+    struct lru_entry *entry, *tmp;
+    HASH_ITER(hh, lru->table, entry, tmp) {
+        if (lru->used + size <= lru->budget)
+            break;
+        free_entry(lru, entry);
+    }
+
+    entry = malloc(sizeof(struct lru_entry));
+    entry->key = strdup(key);
+    entry->value = value;
+    entry->size = size;
+    HASH_ADD_KEYPTR(hh, lru->table, entry->key, strlen(entry->key), entry);
+    lru->used += size;
+    return true;
+}
+
+void lru_del(struct lru *lru, const char *key) {
+    struct lru_entry *entry;
+    HASH_FIND_STR(lru->table, key, entry);
+    if (entry)
+        free_entry(lru, entry);
+}
@@ -0,0 +1,39 @@
+#ifndef _LRU_H
+#define _LRU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "uthash/src/uthash.h"
+
+/*
+ * Byte-budgeted LRU map from strings to values
+ * ===
+ * Values are owned by the map and freed with value_free on eviction.
+ * Not thread-safe; meant to live in one worker, shared by its async cores.
+ */
+
+struct lru_entry {
+    char *key;
+    void *value;
+    size_t size; // bytes charged against the budget
+    UT_hash_handle hh;
+};
+
+struct lru {
+    struct lru_entry *table; // iterated from the least recently used
+    size_t budget;
+    size_t used;
+    void (*value_free)(void *value);
+};
+
+void lru_init(struct lru *lru, size_t budget, void (*value_free)(void *value));
+void lru_remove(struct lru *lru);
+
+// the value is borrowed, and valid until the next lru_put or lru_del
+void* lru_get(struct lru *lru, const char *key);
+// steals value. Returns false if it alone is over the budget, in which case value has been freed.
+bool lru_put(struct lru *lru, const char *key, void *value, size_t size);
+void lru_del(struct lru *lru, const char *key);
+
+#endif // !_LRU_H
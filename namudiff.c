@@ -298,6 +298,28 @@ void DiffNodeConnection_free(DiffNodeConnection *conn) {
     free(conn);
 }
 
+// FNV-1a over code points
+static void hash_content(DiffNode *node) {
+    uint64_t hash = 14695981039346656037ULL;
+    int space_count = 0;
+    if (node->source_len > 0) {
+        const int32_t *p = node->source_revision->uni_buffer + node->source_offset;
+        const int32_t *end = p + node->source_len;
+        for (; p < end; p++) {
+            hash = (hash ^ (uint32_t)*p) * 1099511628211ULL;
+            if (*p == ' ')
+                space_count++;
+        }
+    }
+    node->content_hash = hash;
+    node->space_count = space_count;
+}
+
+// 64 bits of hash along with the length are taken as equality
+static inline bool same_content(const DiffNode *a, const DiffNode *b) {
+    return a->content_hash == b->content_hash && a->source_len == b->source_len && a->space_count == b->space_count;
+}
+
 DiffNode* DiffNode_new(enum diff_node_type type, int owner_revision_id, const Revision *source_revision, size_t source_offset, size_t source_len) {
     DiffNode *node = malloc(sizeof(DiffNode));
     node->refcount = 1;
@@ -309,6 +331,14 @@ DiffNode* DiffNode_new(enum diff_node_type type, int owner_revision_id, const Re
     node->source_offset = source_offset;
     node->source_len = source_len;
 
+    // only paragraphs and sentences are compared as a whole. Words are resized after being made
+    if (type == diff_node_type_paragraph || type == diff_node_type_sentence) {
+        hash_content(node);
+    } else {
+        node->content_hash = 0;
+        node->space_count = 0;
+    }
+
     node->children = varray_init();
     return node;
 }
@@ -438,28 +468,6 @@ void DiffNode_release(DiffNode *node) {
     }
 }
 
-struct txt_diff_ctx {
-    const int32_t *old_uni_buf;
-    const int32_t *new_uni_buf;
-    size_t old_node_offset, new_node_offset;
-};
-
-static int txt_cmp_fn(const void* dataA, const void* dataB, int idxA, int idxB, void *context) {
-    struct txt_diff_ctx *ctx = context;
-    int32_t a = ctx->old_uni_buf[ctx->old_node_offset + (size_t)idxA];
-    int32_t b = ctx->new_uni_buf[ctx->new_node_offset + (size_t)idxB];
-    return (a == b)? 0 : 1;
-}
-
-static int txt_cmp_fn_ignore_space(const void* dataA, const void* dataB, int idxA, int idxB, void *context) {
-    struct txt_diff_ctx *ctx = context;
-    int32_t a = ctx->old_uni_buf[ctx->old_node_offset + (size_t)idxA];
-    int32_t b = ctx->new_uni_buf[ctx->new_node_offset + (size_t)idxB];
-    if (a == ' ')
-        return 1;
-    return (a == b)? 0 : 1;
-}
-
 
 typedef struct {
     DiffOption public_option;
@@ -485,7 +493,15 @@ static int node_cmp_fn(const void *dataA, const void *dataB, int idxA, int idxB,
     DiffNode* new_ = varray_get(ctx->new_node->children, idxB);
     int dmax = MAX(old_min_d[idxA], new_min_d[idxB]);
     int diff_distance;
-    if ((diff_distance = diff_only_txt(old, new_, dmax, true, false, ctx->prepared_vbuf, ctx->option, NULL, NULL)) != -1) {
+    if (same_content(old, new_)) {
+        // spaces of old never match when ignored, and everything else does
+        diff_distance = 2 * old->space_count;
+        if (diff_distance > dmax)
+            diff_distance = -1;
+    } else {
+        diff_distance = diff_only_txt(old, new_, dmax, true, false, ctx->prepared_vbuf, ctx->option, NULL, NULL);
+    }
+    if (diff_distance != -1) {
         if (old_min_d[idxA] > diff_distance) { 
             old_min_d[idxA] = diff_distance;
         }
@@ -620,15 +636,20 @@ static int nodewise_diff(DiffNode *old_node, DiffNode *new_node, DiffInternalOpt
 }
 
 static int diff_only_txt(DiffNode *old_node, DiffNode *new_node, int dmax, bool ignore_space, bool fixup, int *vbuf, DiffInternalOption *option, struct diff_edit **ed_ret, int *ed_len_ret) {
-    struct txt_diff_ctx ctx = {
-        .old_uni_buf = old_node->source_revision->uni_buffer,
-        .new_uni_buf = new_node->source_revision->uni_buffer,
-        .old_node_offset = old_node->source_offset,
-        .new_node_offset = new_node->source_offset
-    };
+    const int32_t *old_txt = old_node->source_revision->uni_buffer + old_node->source_offset;
+    const int32_t *new_txt = new_node->source_revision->uni_buffer + new_node->source_offset;
+    // spaces of old match nothing when they are ignored
+    int32_t unmatchable = ignore_space? ' ' : -1;
     int diff_distance;
     if (dmax >= 0) {
-        diff_distance = diff(NULL, 0, old_node->source_len, NULL, 0, new_node->source_len, ignore_space? txt_cmp_fn_ignore_space : txt_cmp_fn, &ctx, dmax, vbuf, ed_ret, ed_len_ret);
+        // only a distance is wanted when there is nowhere to put a script
+        if (!ed_ret && old_node->source_len <= DIFF_BITPARALLEL_MAX_LEN && new_node->source_len <= DIFF_BITPARALLEL_MAX_LEN) {
+            diff_distance = diff_bitparallel(old_txt, old_node->source_len, new_txt, new_node->source_len,
+                                             unmatchable, dmax);
+        } else {
+            diff_distance = diff_codepoints(old_txt, 0, old_node->source_len, new_txt, 0, new_node->source_len,
+                                            unmatchable, dmax, vbuf, ed_ret, ed_len_ret);
+        }
         if (fixup) {
             if (ed_ret && ed_len_ret && diff_distance >= 0) {
                 fixup_txt_fragmentation(old_node, new_node, &diff_distance, *ed_ret, ed_len_ret);
@@ -649,7 +670,10 @@ static bool diff_node(DiffNode *old_node, DiffNode *new_node, DiffInternalOption
     enum diff_node_type node_type = new_node->type;
 
     DiffNodeConnection *result = NULL; 
-    if (node_type == diff_node_type_sentence) {
+    if (node_type == diff_node_type_sentence && same_content(old_node, new_node)) {
+        result = DiffNodeConnection_new(node_type, 0, old_node, new_node);
+        DiffNodeConnection_add(result, 0, 0, new_node->source_len, NULL);
+    } else if (node_type == diff_node_type_sentence) {
         int diff_distance;
         int dmax = MAX(old_node->source_len, new_node->source_len);
         if ((diff_distance = diff_only_txt(old_node, new_node, dmax, false, true, NULL, option, &ed, &ed_len)) == -1)
@@ -893,12 +917,19 @@ int namublame_add(NamuBlameContext *ctx, Revision *revision, const DiffOption *o
         diff_distance = -1;
         ctx->previous_revision_id = ctx->source_revision->revision_id;
     }
+    // nodes of the old article point into the old revision
+    DiffNode_release(ctx->article);
     Revision_free(ctx->source_revision);
     ctx->source_revision = revision;
     ctx->article = rev_node;
     return diff_distance;
 }
 
+void namublame_add_revision_info(NamuBlameContext *ctx, RevisionInfo *info) {
+    RevisionInfo_obtain(info);
+    varray_push(ctx->revision_info_array, info);
+}
+
 const Revision* namublame_recent_revision(const NamuBlameContext *ctx) {
     return ctx->source_revision;
 }
@@ -909,14 +940,298 @@ DiffNode* namublame_obtain_article(const NamuBlameContext *ctx) {
     return result;
 }
 
-enum namublame_error namublame_serialize(const NamuBlameContext *ctx, const char **buf_ret, size_t *buf_size_ret) {
-    // TODO
+/*
+ * Snapshot format
+ * "NMBL" version:u8 reserved:u8[3]
+ * document:str previous_revision_id:int
+ * revision info count:uint, (revision_id:int author:str date:str comment:str)*
+ * source revision_id:int has_buffer:u8 buffer:str
+ * article in preorder, (type:u8 owner_revision_id:int source_offset:int source_len:uint child_count:uint)*
+ *
+ * uint is LEB128, int is zigzag-encoded LEB128 and str is its length in uint followed by the bytes.
+ * Every node comes from the source revision, so it is not written per node
+ * and source_offset is relative to the one of the parent.
+ */
+#define BLAME_SNAPSHOT_MAGIC "NMBL"
+#define BLAME_SNAPSHOT_VERSION 1
+#define BLAME_SNAPSHOT_HEADER_SIZE 8
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} SnapshotWriter;
+
+typedef struct {
+    const unsigned char *p, *end;
+} SnapshotReader;
+
+static void snapshot_put(SnapshotWriter *w, const void *src, size_t size) {
+    if (w->len + size > w->cap) {
+        size_t cap = w->cap > 0? w->cap : 256;
+        while (cap < w->len + size)
+            cap *= 2;
+        w->buf = realloc(w->buf, cap);
+        w->cap = cap;
+    }
+    memcpy(w->buf + w->len, src, size);
+    w->len += size;
+}
+
+static void snapshot_put_uint(SnapshotWriter *w, uint64_t val) {
+    unsigned char b[10];
+    size_t n = 0;
+    do {
+        b[n] = val & 0x7F;
+        val >>= 7;
+        if (val)
+            b[n] |= 0x80;
+        n++;
+    } while (val);
+    snapshot_put(w, b, n);
+}
+
+static void snapshot_put_int(SnapshotWriter *w, int64_t val) {
+    snapshot_put_uint(w, ((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+}
+
+static void snapshot_put_str(SnapshotWriter *w, const char *str, size_t len) {
+    snapshot_put_uint(w, len);
+    snapshot_put(w, str, len);
+}
+
+static bool snapshot_get_uint(SnapshotReader *r, uint64_t *ret) {
+    uint64_t val = 0;
+    int shift;
+    for (shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        unsigned char b = *r->p++;
+        val |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *ret = val;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool snapshot_get_int(SnapshotReader *r, int64_t *ret) {
+    uint64_t val;
+    if (!snapshot_get_uint(r, &val))
+        return false;
+    *ret = (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+    return true;
+}
+
+static bool snapshot_get_revision_id(SnapshotReader *r, int *ret) {
+    int64_t val;
+    if (!snapshot_get_int(r, &val) || val < INT_MIN || val > INT_MAX)
+        return false;
+    *ret = (int)val;
+    return true;
+}
+
+// the result is malloc'ed and null-terminated
+static char* snapshot_get_str(SnapshotReader *r, size_t *len_ret) {
+    uint64_t len;
+    if (!snapshot_get_uint(r, &len) || len > (uint64_t)(r->end - r->p))
+        return NULL;
+    char *str = malloc(len + 1);
+    memcpy(str, r->p, len);
+    str[len] = 0;
+    r->p += len;
+    if (len_ret)
+        *len_ret = len;
+    return str;
+}
+
+static enum namublame_error serialize_node(const NamuBlameContext *ctx, const DiffNode *node, size_t parent_offset, SnapshotWriter *w) {
+    if (node->type < 0 || node->type >= diff_node_type_N)
+        return namublame_error_invalid_node_type;
+    if (node->source_revision != ctx->source_revision)
+        return namublame_error_revision_id_mismatch;
+
+    unsigned char type = node->type;
+    snapshot_put(w, &type, 1);
+    snapshot_put_int(w, node->owner_revision_id);
+    snapshot_put_int(w, (int64_t)node->source_offset - (int64_t)parent_offset);
+    snapshot_put_uint(w, node->source_len);
+
+    size_t idx, len = varray_length(node->children);
+    snapshot_put_uint(w, len);
+    for (idx = 0; idx < len; idx++) {
+        enum namublame_error error;
+        if ((error = serialize_node(ctx, varray_get(node->children, idx), node->source_offset, w)) != namublame_error_ok)
+            return error;
+    }
+    return namublame_error_ok;
+}
+
+static DiffNode* deserialize_node(const Revision *source_revision, SnapshotReader *r, size_t parent_offset, enum diff_node_type max_type, enum namublame_error *error_ret) {
+    DiffNode *result = NULL;
+    int owner_revision_id;
+    int64_t rel_offset;
+    uint64_t source_len, child_count, idx;
+
+    if (r->p >= r->end) {
+        *error_ret = namublame_error_invalid_snapshot;
+        goto error;
+    }
+    enum diff_node_type type = *r->p++;
+    // each level holds lower ones only, which also bounds the depth of recursion
+    if (type > max_type) {
+        *error_ret = namublame_error_invalid_node_type;
+        goto error;
+    }
+    if (!snapshot_get_revision_id(r, &owner_revision_id)) {
+        *error_ret = namublame_error_invalid_owner_revision_id;
+        goto error;
+    }
+    if (!snapshot_get_int(r, &rel_offset) || rel_offset < -(int64_t)parent_offset
+        || (uint64_t)((int64_t)parent_offset + rel_offset) > source_revision->uni_len) {
+        *error_ret = namublame_error_invalid_source_offset;
+        goto error;
+    }
+    size_t source_offset = (size_t)((int64_t)parent_offset + rel_offset);
+    if (!snapshot_get_uint(r, &source_len) || source_len > source_revision->uni_len - source_offset) {
+        *error_ret = namublame_error_invalid_source_len;
+        goto error;
+    }
+    // a child takes at least 5 bytes, which keeps a broken count from reserving much
+    if (!snapshot_get_uint(r, &child_count) || child_count > (uint64_t)(r->end - r->p) / 5 || (child_count > 0 && type == diff_node_type_word)) {
+        *error_ret = namublame_error_invalid_children;
+        goto error;
+    }
+
+    result = DiffNode_new(type, owner_revision_id, source_revision, source_offset, source_len);
+    if (child_count > 0) {
+        varray_free(result->children, NULL);
+        result->children = varray_initc(child_count);
+    }
+    for (idx = 0; idx < child_count; idx++) {
+        DiffNode *child;
+        if ((child = deserialize_node(source_revision, r, source_offset, type - 1, error_ret)) == NULL)
+            goto error;
+        varray_push(result->children, child);
+    }
+    return result;
+error:
+    if (result)
+        DiffNode_release(result);
+    return NULL;
+}
+
+enum namublame_error namublame_serialize(const NamuBlameContext *ctx, char **buf_ret, size_t *buf_size_ret) {
+    SnapshotWriter w = {NULL, 0, 0};
+    size_t idx, len;
+    enum namublame_error error;
+
+    unsigned char header[BLAME_SNAPSHOT_HEADER_SIZE] = {0, };
+    memcpy(header, BLAME_SNAPSHOT_MAGIC, 4);
+    header[4] = BLAME_SNAPSHOT_VERSION;
+    snapshot_put(&w, header, BLAME_SNAPSHOT_HEADER_SIZE);
+
+    snapshot_put_str(&w, ctx->document, strlen(ctx->document));
+    snapshot_put_int(&w, ctx->previous_revision_id);
+
+    len = varray_length(ctx->revision_info_array);
+    snapshot_put_uint(&w, len);
+    for (idx = 0; idx < len; idx++) {
+        RevisionInfo *info = varray_get(ctx->revision_info_array, idx);
+        snapshot_put_int(&w, info->revision_id);
+        snapshot_put_str(&w, info->author, strlen(info->author));
+        snapshot_put_str(&w, info->date, strlen(info->date));
+        snapshot_put_str(&w, info->comment, strlen(info->comment));
+    }
+
+    const Revision *rev = ctx->source_revision;
+    unsigned char has_buffer = rev->buffer != NULL;
+    snapshot_put_int(&w, rev->revision_id);
+    snapshot_put(&w, &has_buffer, 1);
+    snapshot_put_str(&w, rev->buffer, has_buffer? rev->buffer_size : 0);
+
+    if ((error = serialize_node(ctx, ctx->article, 0, &w)) != namublame_error_ok) {
+        free(w.buf);
+        return error;
+    }
+    *buf_ret = w.buf;
+    *buf_size_ret = w.len;
     return namublame_error_ok;
 }
 
 enum namublame_error namublame_deserialize(NamuBlameContext *ctx, const char *buf, size_t buf_size) {
-    // TODO
+    SnapshotReader r = {(const unsigned char *)buf, (const unsigned char *)buf + buf_size};
+    enum namublame_error error = namublame_error_invalid_snapshot;
+    char *document = NULL;
+    varray *revision_info_array = varray_init();
+    Revision *source_revision = NULL;
+    int previous_revision_id;
+    uint64_t idx, info_count;
+
+    if (buf_size < BLAME_SNAPSHOT_HEADER_SIZE || memcmp(buf, BLAME_SNAPSHOT_MAGIC, 4) != 0 || buf[4] != BLAME_SNAPSHOT_VERSION)
+        goto error;
+    r.p += BLAME_SNAPSHOT_HEADER_SIZE;
+
+    if ((document = snapshot_get_str(&r, NULL)) == NULL)
+        goto error;
+    if (!snapshot_get_revision_id(&r, &previous_revision_id))
+        goto error;
+
+    if (!snapshot_get_uint(&r, &info_count))
+        goto error;
+    for (idx = 0; idx < info_count; idx++) {
+        int revision_id;
+        char *author = NULL, *date = NULL, *comment = NULL;
+        bool valid = snapshot_get_revision_id(&r, &revision_id)
+            && (author = snapshot_get_str(&r, NULL)) != NULL
+            && (date = snapshot_get_str(&r, NULL)) != NULL
+            && (comment = snapshot_get_str(&r, NULL)) != NULL;
+        if (valid)
+            varray_push(revision_info_array, RevisionInfo_new(author, revision_id, date, comment));
+        free(author);
+        free(date);
+        free(comment);
+        if (!valid)
+            goto error;
+    }
+
+    int source_revision_id;
+    char *source_buffer;
+    size_t source_buffer_size;
+    if (!snapshot_get_revision_id(&r, &source_revision_id) || r.p >= r.end) {
+        error = namublame_error_invalid_source_revision;
+        goto error;
+    }
+    bool has_buffer = *r.p++ != 0;
+    if ((source_buffer = snapshot_get_str(&r, &source_buffer_size)) == NULL) {
+        error = namublame_error_invalid_source_revision;
+        goto error;
+    }
+    if (!has_buffer) {
+        free(source_buffer);
+        source_buffer = NULL;
+    }
+    source_revision = Revision_new(source_revision_id, source_buffer, source_buffer_size);
+
+    DiffNode *article = deserialize_node(source_revision, &r, 0, diff_node_type_article, &error);
+    if (!article)
+        goto error;
+    if (article->type != diff_node_type_article || r.p != r.end) {
+        error = article->type != diff_node_type_article? namublame_error_invalid_node_type : namublame_error_invalid_snapshot;
+        DiffNode_release(article);
+        goto error;
+    }
+
+    ctx->document = document;
+    ctx->revision_info_array = revision_info_array;
+    ctx->source_revision = source_revision;
+    ctx->previous_revision_id = previous_revision_id;
+    ctx->article = article;
     return namublame_error_ok;
+error:
+    free(document);
+    varray_free(revision_info_array, (void (*)(void *))RevisionInfo_release);
+    if (source_revision)
+        Revision_free(source_revision);
+    return error;
 }
 
 
@@ -1047,6 +1362,15 @@ DiffNode* DiffNode_parse_json(NamuBlameContext *ctx, JSON_Value *json, enum namu
         *error_ret = namublame_error_revision_id_mismatch;
         goto error;
     }
+    // the text is read when the node is made
+    if (source_offset > source_revision->uni_len) {
+        *error_ret = namublame_error_invalid_source_offset;
+        goto error;
+    }
+    if (source_len > source_revision->uni_len - source_offset) {
+        *error_ret = namublame_error_invalid_source_len;
+        goto error;
+    }
 
     result = DiffNode_new(node_type, owner_revision_id, source_revision, source_offset, source_len);
 
@@ -1470,6 +1794,7 @@ error:
     return 0;
 }
 #elif SIMPLE_NAMUBLAME_PROGRAM
+#include <stdio.h>
 
 static void print_blame_node(DiffNode *node) {
     const char *tag = diff_node_type_to_str(node->type);
@@ -1538,7 +1863,6 @@ int main(int argc, char **argv) {
         char* buffer = calloc(revfile_size + 1, 1);
         fread(buffer, 1, revfile_size, revfile);
         Revision *rev = Revision_new(revision_id, buffer, revfile_size);
-        RevisionInfo_release(rev_info);
         // NOTE: Revision_new steals buffer. So there's no need to free buffer
 
         fclose(revfile);
@@ -1549,13 +1873,29 @@ int main(int argc, char **argv) {
             DiffOption opt = {.dmax_algorithm = diff_dmax_none, .coherency_algorithm = diff_coherency_none};
             namublame_add(&context, rev, &opt);
         }
+        namublame_add_revision_info(&context, rev_info);
+        RevisionInfo_release(rev_info);
     }
     fclose(specfile);
 
     if (!is_first) {
+        // go through a snapshot, so that what is printed is what has been restored from it
+        char *snapshot;
+        size_t snapshot_size;
+        enum namublame_error err;
+        if ((err = namublame_serialize(&context, &snapshot, &snapshot_size)) != namublame_error_ok) {
+            fprintf(stderr, "Failed to serialize: %d\n", err);
+            return 1;
+        }
+        namublame_remove(&context);
+        if ((err = namublame_deserialize(&context, snapshot, snapshot_size)) != namublame_error_ok) {
+            fprintf(stderr, "Failed to deserialize: %d\n", err);
+            return 1;
+        }
+        free(snapshot);
+
         DiffNode* article = namublame_obtain_article(&context);
         print_blame_node(article);
-        enum namublame_error err;
         JSON_Value *val = DiffNode_jsonify(article, &err);
         char *con = json_serialize_to_string_pretty(val);
         printf("%s", con);
@@ -1,6 +1,7 @@
 #ifndef _DIFF_H
 #define _DIFF_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <wchar.h>
 
 #include "varray.h"
@@ -26,6 +27,18 @@ int diff(const void *a, int aoff, int n,
          diff_cmp_fn cmp, void *context, int dmax,
          int *vbuf,
          struct diff_edit **ses_ret, int *ses_n_ret);
+// the same without a call per comparison. Code points of a equal to unmatchable match nothing (-1 for none)
+int diff_codepoints(const int32_t *a, int aoff, int n,
+                    const int32_t *b, int boff, int m,
+                    int32_t unmatchable, int dmax,
+                    int *vbuf,
+                    struct diff_edit **ses_ret, int *ses_n_ret);
+
+// beyond this many code points in either text, distances are left to diff_codepoints. Its tables take n * n / 8 bytes
+#define DIFF_BITPARALLEL_MAX_LEN (64 * 64)
+// the distance diff_codepoints returns, in bit vectors. There is no script, as ties between scripts are not broken alike
+int diff_bitparallel(const int32_t *a, int n, const int32_t *b, int m,
+                     int32_t unmatchable, int dmax);
 
 
 enum diff_node_type {
@@ -60,7 +73,8 @@ enum namublame_error {
     namublame_error_invalid_source_len,
     namublame_error_invalid_index_array,
     namublame_error_invalid_children,
-    namublame_error_revision_id_mismatch
+    namublame_error_revision_id_mismatch,
+    namublame_error_invalid_snapshot
 };
 
 typedef struct {
@@ -89,6 +103,10 @@ typedef struct DiffNode {
     size_t source_offset;
     size_t source_len; // utf8 length
 
+    // of the text of paragraphs and sentences, so that equal ones are told without diffing them. 0 for the others
+    uint64_t content_hash;
+    int space_count;
+
     varray* children;
 } DiffNode;
 
@@ -155,5 +173,12 @@ int namublame_add(NamuBlameContext *ctx, Revision *revision, const DiffOption *o
 void namublame_remove(NamuBlameContext *ctx);
 DiffNode* namublame_obtain_article(const NamuBlameContext *ctx);
 const Revision* namublame_recent_revision(const NamuBlameContext *ctx);
+void namublame_add_revision_info(NamuBlameContext *ctx, RevisionInfo *info);
+
+// compact binary snapshot of ctx, to be restored without going through JSON
+// *buf_ret is malloc'ed
+enum namublame_error namublame_serialize(const NamuBlameContext *ctx, char **buf_ret, size_t *buf_size_ret);
+// initializes ctx as namublame_init does, on success only
+enum namublame_error namublame_deserialize(NamuBlameContext *ctx, const char *buf, size_t buf_size);
 
 #endif // _DIFF_H
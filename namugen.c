@@ -15,29 +15,63 @@ struct namuast_inl_toc *namuast_inl_toc_shared;
  * Constructor definitions
  */
 
-namuast_base* _init_namuast_base(namuast_base * base, int type) {
+static void release_node_strings(void *node) {
+    namuast_base *base = node;
+    if (base->ast_type == namuast_type_inline) {
+        namuast_inline *inl = node;
+        namuast_inl_optbl[inl->inl_type].free_strings(inl);
+    } else
+        namuast_optbl[base->ast_type].free_strings(base);
+}
+
+namuast_base* _init_namuast_base(namuast_base * base, int type, struct arena *arena) {
     base->ast_type = type;
     base->refcount = 1;
+    base->arena = arena;
+    if (arena && namuast_optbl[type].free_strings)
+        arena_on_release(arena, release_node_strings, base);
     return base;
 }
 
 namuast_inline* _init_namuast_inl_base(namuast_inline *inl, int type) {
     inl->inl_type = type;
+    if (inl->_base.arena && namuast_inl_optbl[type].free_strings)
+        arena_on_release(inl->_base.arena, release_node_strings, inl);
     return inl;
 }
 
-struct namuast_inl_container* make_inl_container() {
-    struct namuast_inl_container* ret = (struct namuast_inl_container*) NEW_INL_NAMUAST(namuast_inltype_container);
+void* namuast_calloc(struct arena *arena, size_t nmemb, size_t size) {
+    if (arena)
+        return arena_calloc(arena, nmemb, size);
+    return calloc(nmemb, size);
+}
+
+void* namuast_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (arena)
+        return arena_realloc(arena, ptr, old_size, new_size);
+    return realloc(ptr, new_size);
+}
+
+void namuast_free(struct arena *arena, void *ptr) {
+    if (!arena)
+        free(ptr);
+}
+
+struct namuast_inl_container* namuast_make_inline(struct namugen_ctx *ctx) {
+    struct namuast_inl_container* ret = (struct namuast_inl_container*) NEW_INL_NAMUAST(ctx->arena, namuast_inltype_container);
     ret->len = 0;
     ret->capacity = 16;
-    ret->children = calloc(ret->capacity, sizeof(namuast_inline *));
+    ret->children = namuast_calloc(ctx->arena, ret->capacity, sizeof(namuast_inline *));
     return ret;
 }
 
 void inl_container_add_steal(struct namuast_inl_container* container, namuast_inline *src) {
     if (container->len >= container->capacity) {
         container->capacity *= 2;
-        container->children = realloc(container->children, sizeof(namuast_inline*) * container->capacity);
+        container->children = namuast_realloc(NAMUAST_ARENA(container),
+                                              container->children,
+                                              sizeof(namuast_inline*) * container->len,
+                                              sizeof(namuast_inline*) * container->capacity);
     }
     container->children[container->len++] = src;
 }
@@ -50,7 +84,7 @@ void inl_container_add_return(struct namuast_inl_container* container, struct na
 
 static struct namuast_inl_fnt* make_fnt(struct namugen_ctx* ctx, struct namuast_inl_container* content, bndstr extra) {
     int my_footnote_id = ++ctx->last_footnote_id;
-    struct namuast_inl_fnt *fnt = (struct namuast_inl_fnt *)NEW_INL_NAMUAST(namuast_inltype_fnt);
+    struct namuast_inl_fnt *fnt = (struct namuast_inl_fnt *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_fnt);
     fnt->id = my_footnote_id;
     if (extra.len > 0) {
         fnt->is_named = true;
@@ -65,9 +99,11 @@ static struct namuast_inl_fnt* make_fnt(struct namugen_ctx* ctx, struct namuast_
 }
 
 static void emit_fnt_section(namuast_inl_container *container, struct namugen_ctx *ctx) {
-    struct namuast_inl_fnt_section *fnt_section = (struct namuast_inl_fnt_section *)NEW_INL_NAMUAST(namuast_inltype_fnt_section);
+    struct namuast_inl_fnt_section *fnt_section = (struct namuast_inl_fnt_section *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_fnt_section);
     fnt_section->cur_footnote_id = ctx->last_footnote_id;
     inl_container_add_steal(container, &fnt_section->_base);
+    if (ctx->fnt_sections)
+        varray_push(ctx->fnt_sections, fnt_section);
 }
 
 
@@ -86,7 +122,10 @@ static struct namuast_inl_fnt* get_footnote_by_id(struct namuast_container *ast_
 static void namuast_container_add_steal(struct namuast_container* container, namuast_base *src) {
     if (container->len >= container->capacity) {
         container->capacity *= 2;
-        container->children = realloc(container->children, sizeof (struct namuast_base*) * container->capacity);
+        container->children = namuast_realloc(NAMUAST_ARENA(container),
+                                              container->children,
+                                              sizeof (struct namuast_base*) * container->len,
+                                              sizeof (struct namuast_base*) * container->capacity);
     }
     container->children[container->len++] = src;
 }
@@ -98,10 +137,11 @@ int nm_register_footnote(struct namugen_ctx* ctx, struct namuast_inl_container*
     return fnt->id;
 }
 
-static struct namuast_heading* make_heading(struct namuast_heading* parent, struct namuast_inl_container *content, int h_num);
+static struct namuast_heading* make_heading(struct arena *arena, struct namuast_heading* parent, struct namuast_inl_container *content, int h_num);
 
-void nm_emit_heading(struct namugen_ctx* ctx, int h_num, struct namuast_inl_container * content) {
-    struct namuast_heading* p = ctx->result_container->root_heading;
+// the heading a new one of h_num goes under
+static struct namuast_heading* find_heading_parent(struct namuast_heading *root, int h_num) {
+    struct namuast_heading* p = root;
     // fine 'rightmost' node
     while (!list_empty(&p->children)) {
         struct list_elem *e = list_back(&p->children);
@@ -114,7 +154,12 @@ void nm_emit_heading(struct namugen_ctx* ctx, int h_num, struct namuast_inl_cont
         }
         p = p->parent;
     }
-    struct namuast_heading* hd = make_heading(p, content, h_num); // p owns hd automatically
+    return p;
+}
+
+void nm_emit_heading(struct namugen_ctx* ctx, int h_num, struct namuast_inl_container * content) {
+    struct namuast_heading* p = find_heading_parent(ctx->result_container->root_heading, h_num);
+    struct namuast_heading* hd = make_heading(ctx->arena, p, content, h_num); // p owns hd automatically
 
     OBTAIN_NAMUAST(hd);
     namuast_container_add_steal(ctx->result_container, &hd->_base);
@@ -131,24 +176,31 @@ static sds make_section_name(struct namuast_heading *hd) {
         return sdsempty();
 }
 
-static struct namuast_heading* make_heading(struct namuast_heading* parent, struct namuast_inl_container *content, int h_num) {
-    struct namuast_heading* ret = (struct namuast_heading *)NEW_NAMUAST(namuast_type_heading);
+// hd becomes the last child of parent, and is numbered after its siblings
+static void link_heading(struct namuast_heading *parent, struct namuast_heading *hd) {
+    hd->parent = parent;
+    if (list_empty(&parent->children)) {
+        hd->seq = 1;
+    } else {
+        struct namuast_heading* last = list_entry(list_back(&parent->children), struct namuast_heading, elem);
+        hd->seq = last->seq + 1;
+    }
+    list_push_back(&parent->children, &hd->elem);
+    hd->section_name = make_section_name(hd);
+}
+
+static struct namuast_heading* make_heading(struct arena *arena, struct namuast_heading* parent, struct namuast_inl_container *content, int h_num) {
+    struct namuast_heading* ret = (struct namuast_heading *)NEW_NAMUAST(arena, namuast_type_heading);
     ret->content = content;
     ret->h_num = h_num;
 
     list_init(&ret->children);
     if (parent) {
-        ret->parent = parent;
-        if (list_empty(&parent->children)) {
-            ret->seq = 1;
-        } else {
-            struct namuast_heading* last = list_entry(list_back(&parent->children), struct namuast_heading, elem);
-            ret->seq = last->seq + 1;
-        }
-        list_push_back(&parent->children, &ret->elem);
-    } else
+        link_heading(parent, ret);
+    } else {
         ret->parent = NULL;
-    ret->section_name = make_section_name(ret);
+        ret->section_name = make_section_name(ret);
+    }
     return ret;
 }
 
@@ -183,7 +235,7 @@ bool nm_in_footnote(struct namugen_ctx* ctx) {
 
 
 void nm_emit_quotation(struct namugen_ctx* ctx, struct namuast_inl_container* inl) {
-    struct namuast_quotation *quote = (struct namuast_quotation *)NEW_NAMUAST(namuast_type_quotation);
+    struct namuast_quotation *quote = (struct namuast_quotation *)NEW_NAMUAST(ctx->arena, namuast_type_quotation);
     quote->content = inl;
     namuast_container_add_steal(ctx->result_container, &quote->_base);
 }
@@ -201,14 +253,14 @@ void nm_on_start(struct namugen_ctx* ctx) {
 
 void nm_on_finish(struct namugen_ctx* ctx) {
     // emit footnote section at the end of article always
-    namuast_inl_container *container = make_inl_container();
+    namuast_inl_container *container = namuast_make_inline(ctx);
     emit_fnt_section(container, ctx);
     nm_emit_inline(ctx, container);
 
 }
 
 void nm_inl_emit_span(struct namuast_inl_container* container, struct namuast_inl_container* content, enum nm_span_type type) {
-    struct namuast_inl_span *span = (struct namuast_inl_span *)NEW_INL_NAMUAST(namuast_inltype_span);
+    struct namuast_inl_span *span = (struct namuast_inl_span *)NEW_INL_NAMUAST(NAMUAST_ARENA(container), namuast_inltype_span);
     span->span_type = type;
     span->content = content;
     inl_container_add_steal(container, &span->_base);
@@ -219,7 +271,7 @@ void nm_inl_emit_str(struct namuast_inl_container* container, bndstr s) {
         struct namuast_inl_str *prev_inlstr = (struct namuast_inl_str *)container->children[container->len - 1];
         prev_inlstr->str = sdscatlen(prev_inlstr->str, s.str, s.len);
     } else {
-        struct namuast_inl_str *inlstr = (struct namuast_inl_str *)NEW_INL_NAMUAST(namuast_inltype_str);
+        struct namuast_inl_str *inlstr = (struct namuast_inl_str *)NEW_INL_NAMUAST(NAMUAST_ARENA(container), namuast_inltype_str);
         inlstr->str = sdsnewlen(s.str, s.len);
         inl_container_add_steal(container, &inlstr->_base);
     }
@@ -248,17 +300,17 @@ void nm_inl_emit_macro(struct namuast_inl_container* container, struct namugen_c
             return;
         }
     }
-    struct namuast_inl_macro *macro = (struct namuast_inl_macro *)NEW_INL_NAMUAST(namuast_inltype_macro);
+    struct namuast_inl_macro *macro = (struct namuast_inl_macro *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_macro);
     macro->name = sdsnewlen(name.str, name.len);
     if (is_fn) {
         macro->is_fn = true;
         macro->pos_args_len = pos_args_len;
-        macro->pos_args = calloc(pos_args_len, sizeof(sds));
+        macro->pos_args = namuast_calloc(ctx->arena, pos_args_len, sizeof(sds));
         for (idx = 0; idx < pos_args_len; idx++) {
             macro->pos_args[idx] = sdsnewlen(pos_args[idx].str, pos_args[idx].len);
         }
         macro->kw_args_len = kw_args_len;
-        macro->kw_args = calloc(kw_args_len * 2, sizeof(sds));
+        macro->kw_args = namuast_calloc(ctx->arena, kw_args_len * 2, sizeof(sds));
         for (idx = 0; idx < kw_args_len * 2; idx++) {
             macro->kw_args[idx] = sdsnewlen(kw_args[idx].str, kw_args[idx].len);
         }
@@ -277,7 +329,7 @@ void nm_inl_emit_macro(struct namuast_inl_container* container, struct namugen_c
 
 void nm_inl_emit_link(struct namuast_inl_container* container, struct namugen_ctx *ctx, bndstr link, struct namuast_inl_container *alias, bndstr section) {
 
-    struct namuast_inl_link *linknode = (struct namuast_inl_link *)NEW_INL_NAMUAST(namuast_inltype_link);
+    struct namuast_inl_link *linknode = (struct namuast_inl_link *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_link);
     linknode->name = sdsnewlen(link.str, link.len);
     linknode->alias = alias;
     if (section.len > 0)
@@ -306,7 +358,7 @@ void nm_inl_emit_upper_link(struct namuast_inl_container* container, struct namu
     if (section.len > 0)
         sds_section = sdsnewlen(section.str, section.len);
 
-    struct namuast_inl_link *linknode = (struct namuast_inl_link *)NEW_INL_NAMUAST(namuast_inltype_link);
+    struct namuast_inl_link *linknode = (struct namuast_inl_link *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_link);
     linknode->name = upper_doc_name;
     linknode->alias = alias;
     linknode->section = sds_section;
@@ -315,7 +367,7 @@ void nm_inl_emit_upper_link(struct namuast_inl_container* container, struct namu
 
 void nm_inl_emit_lower_link(struct namuast_inl_container* container, struct namugen_ctx *ctx, bndstr link, struct namuast_inl_container *alias, bndstr section) {
     sds docname = sdscatlen(sdscat(sdsdup(ctx->cur_doc_name), "/"), link.str, link.len);
-    struct namuast_inl_link *linknode = (struct namuast_inl_link *)NEW_INL_NAMUAST(namuast_inltype_link);
+    struct namuast_inl_link *linknode = (struct namuast_inl_link *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_link);
     linknode->name = docname;
     linknode->alias = alias;
     if (section.len > 0)
@@ -326,7 +378,7 @@ void nm_inl_emit_lower_link(struct namuast_inl_container* container, struct namu
 }
 
 void nm_inl_emit_external_link(struct namuast_inl_container* container, bndstr link, struct namuast_inl_container* alias) {
-    struct namuast_inl_extlink *extlink = (struct namuast_inl_extlink *)NEW_INL_NAMUAST(namuast_inltype_extlink);
+    struct namuast_inl_extlink *extlink = (struct namuast_inl_extlink *)NEW_INL_NAMUAST(NAMUAST_ARENA(container), namuast_inltype_extlink);
     extlink->href = sdsnewlen(link.str, link.len);
     extlink->alias = alias;
     inl_container_add_steal(container, &extlink->_base);
@@ -334,7 +386,7 @@ void nm_inl_emit_external_link(struct namuast_inl_container* container, bndstr l
 
 
 void nm_inl_emit_image(struct namuast_inl_container* container, bndstr url, bndstr width, bndstr height, int align) {
-   struct namuast_inl_image *image = (struct namuast_inl_image *)NEW_INL_NAMUAST(namuast_inltype_image);
+   struct namuast_inl_image *image = (struct namuast_inl_image *)NEW_INL_NAMUAST(NAMUAST_ARENA(container), namuast_inltype_image);
    image->src = sdsnewlen(url.str, url.len);
     if (width.len > 0)
         image->width = sdsnewlen(width.str, width.len);
@@ -359,7 +411,7 @@ void nm_inl_emit_footnote_mark(struct namuast_inl_container* container, struct n
 }
 
 static bool p_emit_raw(struct namugen_ctx* ctx, struct namuast_inl_container* outer_inl, bndstr raw) {
-    struct namuast_block *block = (struct namuast_block *)NEW_NAMUAST(namuast_type_block);
+    struct namuast_block *block = (struct namuast_block *)NEW_NAMUAST(ctx->arena, namuast_type_block);
     block->block_type = block_type_raw;
     block->data.raw = sdsnewlen(raw.str, raw.len);
 
@@ -368,7 +420,7 @@ static bool p_emit_raw(struct namugen_ctx* ctx, struct namuast_inl_container* ou
 }
 
 static bool p_emit_html(struct namugen_ctx* ctx, struct namuast_inl_container* outer_inl, bndstr html) {
-    struct namuast_block *block = (struct namuast_block *)NEW_NAMUAST(namuast_type_block);
+    struct namuast_block *block = (struct namuast_block *)NEW_NAMUAST(ctx->arena, namuast_type_block);
     block->block_type = block_type_html;
     block->data.html = sdsnewlen(html.str, html.len);
     namuast_container_add_steal(ctx->result_container, &block->_base);
@@ -376,7 +428,7 @@ static bool p_emit_html(struct namugen_ctx* ctx, struct namuast_inl_container* o
 }
 
 static bool i_emit_raw(struct namugen_ctx* ctx, struct namuast_inl_container* outer_inl, bndstr raw) {
-    struct namuast_inl_block *inlblock = (struct namuast_inl_block *)NEW_INL_NAMUAST(namuast_inltype_block);
+    struct namuast_inl_block *inlblock = (struct namuast_inl_block *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_block);
     inlblock->inl_block_type = inlblock_type_raw;
     inlblock->data.raw = sdsnewlen(raw.str, raw.len);
     inlblock->content = NULL;
@@ -386,7 +438,7 @@ static bool i_emit_raw(struct namugen_ctx* ctx, struct namuast_inl_container* ou
 }
 
 static bool i_emit_highlighted_block(struct namugen_ctx* ctx, struct namuast_inl_container* outer_inl, struct namuast_inl_container* content, int level) {
-    struct namuast_inl_block *inlblock = (struct namuast_inl_block *)NEW_INL_NAMUAST(namuast_inltype_block);
+    struct namuast_inl_block *inlblock = (struct namuast_inl_block *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_block);
     inlblock->inl_block_type = inlblock_type_highlight;
     inlblock->data.highlight_level = level;
     inlblock->content = content;
@@ -395,7 +447,7 @@ static bool i_emit_highlighted_block(struct namugen_ctx* ctx, struct namuast_inl
 }
 
 static bool i_emit_colored_block(struct namugen_ctx* ctx, struct namuast_inl_container* outer_inl, struct namuast_inl_container* content, bndstr webcolor) {
-    struct namuast_inl_block *inlblock = (struct namuast_inl_block *)NEW_INL_NAMUAST(namuast_inltype_block);
+    struct namuast_inl_block *inlblock = (struct namuast_inl_block *)NEW_INL_NAMUAST(ctx->arena, namuast_inltype_block);
     inlblock->inl_block_type = inlblock_type_color;
     inlblock->data.webcolor = sdsnewlen(webcolor.str, webcolor.len);
     inlblock->content = content;
@@ -419,25 +471,35 @@ struct nm_block_emitters block_emitter_ops_paragraphic = {
 };
 
 
-void namugen_init(namugen_ctx* ctx, const char* cur_doc_name) {
+static void _namugen_init(namugen_ctx* ctx, const char* cur_doc_name, struct arena *arena) {
     ctx->is_in_footnote = false;
     ctx->last_footnote_id = 0;
     ctx->last_anon_fnt_num = 0;
+    ctx->arena = arena;
+    ctx->fnt_sections = NULL;
 
-    struct namuast_container *container =  (struct namuast_container *)NEW_NAMUAST(namuast_type_container);
+    struct namuast_container *container =  (struct namuast_container *)NEW_NAMUAST(arena, namuast_type_container);
     container->len = 0;
     container->capacity = 128;
-    container->children = calloc(container->capacity, sizeof(namuast_base *));
-    container->root_heading = make_heading(NULL, NULL, 0);
+    container->children = namuast_calloc(arena, container->capacity, sizeof(namuast_base *));
+    container->root_heading = make_heading(arena, NULL, NULL, 0);
     list_init(&container->fnt_list);
     ctx->result_container = container;
 
     ctx->cur_doc_name = sdsnew(cur_doc_name);
 
-    ctx->shared_hr = (struct namuast_hr *)NEW_NAMUAST(namuast_type_hr);
-    ctx->shared_return = (struct namuast_return *)NEW_NAMUAST(namuast_type_return);
-    ctx->shared_inl_return = (struct namuast_inl_return *)NEW_INL_NAMUAST(namuast_inltype_return);
-    ctx->shared_toc = (struct namuast_inl_toc*)NEW_INL_NAMUAST(namuast_inltype_toc);
+    ctx->shared_hr = (struct namuast_hr *)NEW_NAMUAST(arena, namuast_type_hr);
+    ctx->shared_return = (struct namuast_return *)NEW_NAMUAST(arena, namuast_type_return);
+    ctx->shared_inl_return = (struct namuast_inl_return *)NEW_INL_NAMUAST(arena, namuast_inltype_return);
+    ctx->shared_toc = (struct namuast_inl_toc*)NEW_INL_NAMUAST(arena, namuast_inltype_toc);
+}
+
+void namugen_init(namugen_ctx* ctx, const char* cur_doc_name) {
+    _namugen_init(ctx, cur_doc_name, NULL);
+}
+
+void namugen_init_with_arena(namugen_ctx* ctx, const char* cur_doc_name) {
+    _namugen_init(ctx, cur_doc_name, arena_new(ARENA_DEFAULT_CHUNK_SIZE));
 }
 
 namuast_container* namugen_obtain_ast(struct namugen_ctx *ctx) {
@@ -448,12 +510,67 @@ namuast_container* namugen_obtain_ast(struct namugen_ctx *ctx) {
 
 
 void namugen_remove(struct namugen_ctx* ctx) {
-    XRELEASE_NAMUAST(ctx->result_container);
+    // shared nodes go first, as releasing the container may take the arena down with it
     RELEASE_NAMUAST(ctx->shared_hr);
     RELEASE_NAMUAST(ctx->shared_return);
     RELEASE_NAMUAST(ctx->shared_inl_return);
     RELEASE_NAMUAST(ctx->shared_toc);
+    XRELEASE_NAMUAST(ctx->result_container);
     sdsfree(ctx->cur_doc_name);
+    if (ctx->fnt_sections)
+        varray_free(ctx->fnt_sections, NULL);
+}
+
+void namugen_init_segment(namugen_ctx *segment, namugen_ctx *ctx) {
+    _namugen_init(segment, ctx->cur_doc_name, ctx->arena? arena_new(ARENA_DEFAULT_CHUNK_SIZE) : NULL);
+    segment->fnt_sections = varray_init();
+}
+
+void namugen_merge_segment(namugen_ctx *ctx, namugen_ctx *segment) {
+    struct namuast_container *dst = ctx->result_container;
+    struct namuast_container *src = segment->result_container;
+    int id_offset = ctx->last_footnote_id;
+    int anon_offset = ctx->last_anon_fnt_num;
+
+    // footnotes of the segment are numbered from 1
+    while (!list_empty(&src->fnt_list)) {
+        struct namuast_inl_fnt *fnt = list_entry(list_pop_front(&src->fnt_list), struct namuast_inl_fnt, elem);
+        fnt->id += id_offset;
+        if (!fnt->is_named)
+            fnt->repr.anon_num += anon_offset;
+        list_push_back(&dst->fnt_list, &fnt->elem);
+    }
+    int idx;
+    for (idx = 0; idx < varray_length(segment->fnt_sections); idx++) {
+        struct namuast_inl_fnt_section *fnt_section = varray_get(segment->fnt_sections, idx);
+        fnt_section->cur_footnote_id += id_offset;
+    }
+    ctx->last_footnote_id += segment->last_footnote_id;
+    ctx->last_anon_fnt_num += segment->last_anon_fnt_num;
+
+    // headings are hung again one by one in order, as the parent of one may be in an earlier segment
+    list_init(&src->root_heading->children);
+    size_t child_idx;
+    for (child_idx = 0; child_idx < src->len; child_idx++) {
+        namuast_base *child = src->children[child_idx];
+        if (child->ast_type == namuast_type_heading) {
+            struct namuast_heading *hd = (struct namuast_heading *)child;
+            list_init(&hd->children);
+            sdsfree(hd->section_name);
+            link_heading(find_heading_parent(dst->root_heading, hd->h_num), hd);
+        }
+        namuast_container_add_steal(dst, child);
+    }
+    src->len = 0;
+
+    if (segment->arena) {
+        // the container is carved from the arena, which has to live on with ctx
+        RELEASE_NAMUAST(src->root_heading);
+        arena_adopt(ctx->arena, segment->arena);
+    } else
+        RELEASE_NAMUAST(src);
+    segment->result_container = NULL;
+    namugen_remove(segment);
 }
 
 
@@ -470,7 +587,7 @@ static void inl_dtor_container(namuast_inline *inl) {
     for (idx = 0; idx < container->len; idx++) {
         RELEASE_NAMUAST(container->children[idx]);
     }
-    free(container->children);
+    namuast_free(NAMUAST_ARENA(container), container->children);
 }
 
 static void dtor_container(namuast_base *base) {
@@ -479,7 +596,7 @@ static void dtor_container(namuast_base *base) {
     for (idx = 0; idx < container->len; idx++) {
         RELEASE_NAMUAST(container->children[idx]);
     }
-    free(container->children);
+    namuast_free(base->arena, container->children);
 
     remove_fnt_list(&container->fnt_list);
     RELEASE_NAMUAST(container->root_heading);
@@ -499,11 +616,15 @@ static void dtor_inline(namuast_base *base) {
 }
 
 
+static void free_heading_strings(namuast_base *base) {
+    sdsfree(((struct namuast_heading *)base)->section_name);
+}
+
 static void dtor_heading(namuast_base *base) {
     struct namuast_heading* root = (struct namuast_heading *)base;
     if (root->content)
         RELEASE_NAMUAST(root->content);
-    sdsfree(root->section_name);
+    free_heading_strings(base);
     while (!list_empty(&root->children)) {
         struct namuast_heading *child = list_entry(list_pop_front(&root->children), struct namuast_heading, elem);
         RELEASE_NAMUAST(child);
@@ -527,13 +648,17 @@ static void inl_dtor_str(namuast_inline *inl) {
     sdsfree(s->str);
 }
 
-static void inl_dtor_fnt(namuast_inline *inl) {
+static void inl_free_fnt_strings(namuast_inline *inl) {
     struct namuast_inl_fnt *fnt = (struct namuast_inl_fnt *)inl;
     if (fnt->is_named)
         sdsfree(fnt->repr.name);
     if (fnt->raw)
         sdsfree(fnt->raw);
-    RELEASE_NAMUAST(fnt->content);
+}
+
+static void inl_dtor_fnt(namuast_inline *inl) {
+    inl_free_fnt_strings(inl);
+    RELEASE_NAMUAST(((struct namuast_inl_fnt *)inl)->content);
 }
 
 static void inl_dtor_span(namuast_inline *inl) {
@@ -541,35 +666,49 @@ static void inl_dtor_span(namuast_inline *inl) {
     RELEASE_NAMUAST(span->content);
 }
 
-static void inl_dtor_link(namuast_inline *inl) {
+static void inl_free_link_strings(namuast_inline *inl) {
     struct namuast_inl_link *link = (struct namuast_inl_link *)inl;
     sdsfree(link->name);
     if (link->section)
         sdsfree(link->section);
+}
+
+static void inl_dtor_link(namuast_inline *inl) {
+    struct namuast_inl_link *link = (struct namuast_inl_link *)inl;
+    inl_free_link_strings(inl);
     if (link->alias) {
         RELEASE_NAMUAST(link->alias);
     }
 }
 
-static void inl_dtor_block(namuast_inline *inl) {
+static void inl_free_block_strings(namuast_inline *inl) {
     struct namuast_inl_block *block = (struct namuast_inl_block *)inl;
     switch (block->inl_block_type) {
     case inlblock_type_color:
         sdsfree(block->data.webcolor);
-        RELEASE_NAMUAST(block->content);
         break;
     case inlblock_type_raw:
         sdsfree(block->data.raw);
         break;
     case inlblock_type_highlight:
-        RELEASE_NAMUAST(block->content);
         break;
     }
 }
 
+static void inl_dtor_block(namuast_inline *inl) {
+    struct namuast_inl_block *block = (struct namuast_inl_block *)inl;
+    inl_free_block_strings(inl);
+    if (block->inl_block_type != inlblock_type_raw)
+        RELEASE_NAMUAST(block->content);
+}
+
+static void inl_free_extlink_strings(namuast_inline *inl) {
+    sdsfree(((struct namuast_inl_extlink *)inl)->href);
+}
+
 static void inl_dtor_extlink(namuast_inline *inl) {
     struct namuast_inl_extlink *extlink = (struct namuast_inl_extlink *)inl;
-    sdsfree(extlink->href);
+    inl_free_extlink_strings(inl);
     if (extlink->alias) {
         RELEASE_NAMUAST(extlink->alias);
     }
@@ -586,23 +725,28 @@ static void inl_dtor_image(namuast_inline* inl) {
     }
 }
 
-static void inl_dtor_macro(namuast_inline* inl) {
+static void inl_free_macro_strings(namuast_inline* inl) {
     struct namuast_inl_macro *macro = (struct namuast_inl_macro *)inl;
     sdsfree(macro->name);
     size_t idx;
     for (idx = 0; idx < macro->pos_args_len; idx++) {
         sdsfree(macro->pos_args[idx]);
     }
-    if (macro->pos_args)
-        free(macro->pos_args);
     for (idx = 0; idx < macro->kw_args_len * 2; idx++) {
         sdsfree(macro->kw_args[idx]);
     }
-    if (macro->kw_args)
-        free(macro->kw_args);
     sdsfree(macro->raw);
 }
 
+static void inl_dtor_macro(namuast_inline* inl) {
+    struct namuast_inl_macro *macro = (struct namuast_inl_macro *)inl;
+    inl_free_macro_strings(inl);
+    if (macro->pos_args)
+        namuast_free(NAMUAST_ARENA(macro), macro->pos_args);
+    if (macro->kw_args)
+        namuast_free(NAMUAST_ARENA(macro), macro->kw_args);
+}
+
 
 /*
  * Traversers here
@@ -637,6 +781,8 @@ static void inl_dtor_macro(namuast_inline* inl) {
 #define SET_INL_SIZETBL(type_no, type) namuast_inl_sizetbl[type_no] = sizeof(type)
 #define SET_DTOR(type_no, fn) namuast_optbl[type_no].dtor = fn
 #define SET_INL_DTOR(type_no, fn) namuast_inl_optbl[type_no].dtor = fn
+#define SET_FREE_STRINGS(type_no, fn) namuast_optbl[type_no].free_strings = fn
+#define SET_INL_FREE_STRINGS(type_no, fn) namuast_inl_optbl[type_no].free_strings = fn
 void initmod_namugen() {
     SET_SIZETBL(namuast_type_container, struct namuast_container);
     SET_SIZETBL(namuast_type_return, struct namuast_return);
@@ -658,6 +804,10 @@ void initmod_namugen() {
     SET_DTOR(namuast_type_list, _namuast_dtor_list);
     SET_DTOR(namuast_type_heading, dtor_heading);
 
+    SET_FREE_STRINGS(namuast_type_block, dtor_block);
+    SET_FREE_STRINGS(namuast_type_table, _namuast_free_table_strings);
+    SET_FREE_STRINGS(namuast_type_heading, free_heading_strings);
+
     SET_INL_SIZETBL(namuast_inltype_str, struct namuast_inl_str);
     SET_INL_SIZETBL(namuast_inltype_container, struct namuast_inl_container);
     SET_INL_SIZETBL(namuast_inltype_link, struct namuast_inl_link);
@@ -684,4 +834,12 @@ void initmod_namugen() {
     SET_INL_DTOR(namuast_inltype_return, NULL);
     SET_INL_DTOR(namuast_inltype_macro, inl_dtor_macro);
 
+    SET_INL_FREE_STRINGS(namuast_inltype_str, inl_dtor_str);
+    SET_INL_FREE_STRINGS(namuast_inltype_link, inl_free_link_strings);
+    SET_INL_FREE_STRINGS(namuast_inltype_extlink, inl_free_extlink_strings);
+    SET_INL_FREE_STRINGS(namuast_inltype_image, inl_dtor_image);
+    SET_INL_FREE_STRINGS(namuast_inltype_block, inl_free_block_strings);
+    SET_INL_FREE_STRINGS(namuast_inltype_fnt, inl_free_fnt_strings);
+    SET_INL_FREE_STRINGS(namuast_inltype_macro, inl_free_macro_strings);
+
 }
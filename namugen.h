@@ -5,6 +5,9 @@
 #include <stdbool.h>
 #include "sds/sds.h"
 #include "list.h"
+#include "arena.h"
+#include "bytescan.h"
+#include "varray.h"
 
 void initmod_namugen();
 
@@ -13,6 +16,10 @@ void initmod_namugen();
 #define UNTIL_REACHING3(p, border, c1, c2, c3) while ((p) < (border) && *(p) != (c1) && *(p) != (c2) && *(p) != (c3))
 #define UNTIL_REACHING4(p, border, c1, c2, c3, c4) while ((p) < (border) && *(p) != (c1) && *(p) != (c2) && *(p) != (c3) && *(p) != (c4))
 #define MET_EOF(p, border) ((p) >= (border))
+// Same as UNTIL_REACHINGn(p, border, ...) { p++; }, but long runs are skipped with SIMD
+#define SKIP_UNTIL1(p, border, c1) ((p) = bytescan_find_any((p), (border), (const char []){c1}, 1))
+#define SKIP_UNTIL2(p, border, c1, c2) ((p) = bytescan_find_any((p), (border), (const char []){c1, c2}, 2))
+#define SKIP_UNTIL3(p, border, c1, c2, c3) ((p) = bytescan_find_any((p), (border), (const char []){c1, c2, c3}, 3))
 #define UNTIL_NOT_REACHING1(p, border, c1) while ((p) < (border) && *(p) == (c1))
 #define UNTIL_NOT_REACHING2(p, border, c1, c2) while ((p) < (border) && (*(p) == (c1) || *(p) == (c2)))
 #define UNTIL_NOT_REACHING3(p, border, c1, c2, c3) while ((p) < (border) && (*(p) == (c1) || *(p) == (c2) || *(p) == (c3)))
@@ -131,8 +138,10 @@ typedef struct namuast_traverser {
 } namuast_traverser;
 */
 
+// free_strings frees nothing but the sds strings of a node. It is all that runs for a node in an arena, when the arena goes
 struct {
     namuast_dtor dtor;
+    namuast_dtor free_strings;
     // void (*traverse)(struct namuast_base *b, namuast_traverser *trav);
 } namuast_optbl[namuast_type_N];
 
@@ -141,6 +150,7 @@ size_t namuast_inl_sizetbl[namuast_inltype_N];
 typedef void (*namuast_inl_dtor)(struct namuast_inline *);
 struct {
     namuast_inl_dtor dtor;
+    namuast_inl_dtor free_strings;
      // void (*traverse)(struct namuast_inline *inl, namuast_traverser *trav);
 } namuast_inl_optbl[namuast_inltype_N];
 
@@ -150,6 +160,7 @@ struct {
 typedef struct namuast_base {
     enum namuast_type ast_type;
     long refcount;
+    struct arena *arena; // NULL if the node lives on the heap
 } namuast_base;
 
 typedef struct namuast_container {
@@ -330,22 +341,33 @@ struct namuast_inl_macro {
     sds raw;
 };
 
-namuast_inl_container* make_inl_container();
-
-
-namuast_base* _init_namuast_base(namuast_base *base, int type);
+namuast_base* _init_namuast_base(namuast_base *base, int type, struct arena *arena);
 namuast_inline* _init_namuast_inl_base(namuast_inline *inl, int type);
 
+/*
+ * Memory of nodes, children arrays and table cells comes from the arena of the document if there is one.
+ * These fall back to the heap when arena is NULL.
+ */
+void* namuast_calloc(struct arena *arena, size_t nmemb, size_t size);
+void* namuast_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+void namuast_free(struct arena *arena, void *ptr);
+
+#define NAMUAST_ARENA(ast) (((struct namuast_base*)(ast))->arena)
 #define OBTAIN_NAMUAST(ast) ((struct namuast_base*)(ast))->refcount++
-#define _NEW_NAMUAST(type, typesize) _init_namuast_base((namuast_base*)calloc(typesize, 1), type)
-#define NEW_NAMUAST(type) _NEW_NAMUAST(type, namuast_sizetbl[type])
-#define NEW_INL_NAMUAST(inltype) _init_namuast_inl_base((namuast_inline *)_NEW_NAMUAST(namuast_type_inline, namuast_inl_sizetbl[inltype]), inltype);
+#define _NEW_NAMUAST(arena, type, typesize) _init_namuast_base((namuast_base*)namuast_calloc((arena), 1, typesize), type, (arena))
+#define NEW_NAMUAST(arena, type) _NEW_NAMUAST(arena, type, namuast_sizetbl[type])
+#define NEW_INL_NAMUAST(arena, inltype) _init_namuast_inl_base((namuast_inline *)_NEW_NAMUAST(arena, namuast_type_inline, namuast_inl_sizetbl[inltype]), inltype);
+// nodes in an arena are never freed one by one. Releasing the root container frees the arena in one shot,
+// along with the strings its nodes registered on it, and no dtor runs.
 #define RELEASE_NAMUAST(ast) do { \
     struct namuast_base* __base__ = (struct namuast_base*)(ast); \
     if (--__base__->refcount <= 0) { \
-        namuast_dtor dtor = namuast_optbl[__base__->ast_type].dtor; \
-        if (dtor) dtor(__base__); \
-        free(__base__); \
+        if (!__base__->arena) { \
+            namuast_dtor dtor = namuast_optbl[__base__->ast_type].dtor; \
+            if (dtor) dtor(__base__); \
+            free(__base__); \
+        } else if (__base__->ast_type == namuast_type_container) \
+            arena_free(__base__->arena); \
     } \
 } while (0)
 
@@ -378,9 +400,13 @@ struct namuast_table_row {
 
 struct namugen_ctx;
 
-struct namuast_list* namuast_make_list(int type, struct namuast_inl_container* content);
+struct namuast_list* namuast_make_list(struct namugen_ctx *ctx, int type, struct namuast_inl_container* content);
+struct namuast_table* namuast_make_table(struct namugen_ctx *ctx);
+struct namuast_table_row* namuast_add_table_row(struct namuast_table* table);
+struct namuast_table_cell* namuast_add_table_cell(struct namuast_table* table, struct namuast_table_row *row);
 void _namuast_dtor_list(struct namuast_base *);
 void _namuast_dtor_table(struct namuast_base *);
+void _namuast_free_table_strings(struct namuast_base *);
 
 
 /*
@@ -401,7 +427,7 @@ struct nm_block_emitters {
 };
 
 /*
- * Functins visible to .lex files
+ * Functions shared by the block scanner and the inline scanner
  */
 bool scn_parse_block(char *p, char *border, char **p_out, struct nm_block_emitters* ops, struct namugen_ctx* ctx, struct namuast_inl_container* container);
 void scn_parse_link_content(char *p, char* border, char* pipe_pos, struct namugen_ctx* ctx, struct namuast_inl_container* container);
@@ -457,6 +483,13 @@ typedef struct namugen_ctx {
     struct namuast_container *result_container;
     sds cur_doc_name;
 
+    // Arena from which every node of result_container is carved. may be NULL.
+    // result_container owns it and frees it when released.
+    struct arena *arena;
+
+    // footnote sections emitted so far, only kept for a segment of a parallel scan. NULL otherwise
+    varray *fnt_sections;
+
     /*
      * Constants
      */
@@ -468,7 +501,24 @@ typedef struct namugen_ctx {
 
 
 void namugen_init(namugen_ctx* ctx, const char* cur_doc_name);
+// same as namugen_init, but the resulting AST is allocated in a per-document arena and freed in one shot
+void namugen_init_with_arena(namugen_ctx* ctx, const char* cur_doc_name);
 void namugen_scan(struct namugen_ctx *ctx, char *buffer, size_t len);
+
+/*
+ * Parallel scan
+ * Sources of at least two segments are cut into segments scanned on the pool at once, and merged into ctx in order.
+ * The result is the same as that of namugen_scan, which it falls back to without a pool.
+ */
+#define NAMUGEN_SEGMENT_SIZE (32 * 1024)
+#define NAMUGEN_SEGMENTS_PER_THREAD 4
+struct threadpool;
+void namugen_scan_parallel(struct namugen_ctx *ctx, char *buffer, size_t len, struct threadpool *pool);
+
+// a ctx to scan a part of the source of ctx with
+void namugen_init_segment(namugen_ctx *segment, namugen_ctx *ctx);
+// appends what segment has scanned to ctx, renumbering footnotes and headings, and removes segment
+void namugen_merge_segment(namugen_ctx *ctx, namugen_ctx *segment);
 namuast_container* namugen_obtain_ast(struct namugen_ctx *ctx);
 void namugen_remove(namugen_ctx* ctx);
 
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "outbuf.h"
+
+void outbuf_init(struct outbuf *ob) {
+    ob->iov = NULL;
+    ob->owners = NULL;
+    ob->count = 0;
+    ob->capacity = 0;
+    ob->len = 0;
+}
+
+void outbuf_remove(struct outbuf *ob) {
+    size_t idx;
+    for (idx = 0; idx < ob->count; idx++) {
+        if (ob->owners[idx].release)
+            ob->owners[idx].release(ob->owners[idx].ptr);
+    }
+    free(ob->iov);
+    free(ob->owners);
+    outbuf_init(ob);
+}
+
+static void reserve(struct outbuf *ob, size_t count) {
+    if (count <= ob->capacity)
+        return;
+    if (!ob->capacity)
+        ob->capacity = 16;
+    while (ob->capacity < count)
+        ob->capacity *= 2;
+    ob->iov = realloc(ob->iov, ob->capacity * sizeof(struct iovec));
+    ob->owners = realloc(ob->owners, ob->capacity * sizeof(struct outbuf_owner));
+}
+
+static void push_chunk(struct outbuf *ob, const char *data, size_t len, void (*release)(void *), void *owner) {
+    reserve(ob, ob->count + 1);
+    ob->iov[ob->count].iov_base = (void *)data;
+    ob->iov[ob->count].iov_len = len;
+    ob->owners[ob->count].release = release;
+    ob->owners[ob->count].ptr = owner;
+    ob->count++;
+    ob->len += len;
+}
+
+static void release_sds(void *chunk) {
+    sdsfree(chunk);
+}
+
+void outbuf_push_sds(struct outbuf *ob, sds chunk) {
+    push_chunk(ob, chunk, sdslen(chunk), release_sds, chunk);
+}
+
+void outbuf_push_ref(struct outbuf *ob, const char *data, size_t len) {
+    push_chunk(ob, data, len, NULL, NULL);
+}
+
+void outbuf_push_shared(struct outbuf *ob, const char *data, size_t len, void (*release)(void *owner), void *owner) {
+    push_chunk(ob, data, len, release, owner);
+}
+
+void outbuf_move(struct outbuf *dst, struct outbuf *src) {
+    if (!dst->count) {
+        // takes the arrays as they are
+        outbuf_remove(dst);
+        *dst = *src;
+        outbuf_init(src);
+        return;
+    }
+    reserve(dst, dst->count + src->count);
+    memcpy(dst->iov + dst->count, src->iov, src->count * sizeof(struct iovec));
+    memcpy(dst->owners + dst->count, src->owners, src->count * sizeof(struct outbuf_owner));
+    dst->count += src->count;
+    dst->len += src->len;
+    free(src->iov);
+    free(src->owners);
+    outbuf_init(src);
+}
+
+sds outbuf_flatten(struct outbuf *ob, sds buf) {
+    size_t offset = sdslen(buf);
+    buf = sdsMakeRoomFor(buf, ob->len);
+    size_t idx;
+    for (idx = 0; idx < ob->count; idx++) {
+        memcpy(buf + offset, ob->iov[idx].iov_base, ob->iov[idx].iov_len);
+        offset += ob->iov[idx].iov_len;
+    }
+    sdsIncrLen(buf, ob->len);
+    return buf;
+}
@@ -0,0 +1,45 @@
+#ifndef _OUTBUF_H
+#define _OUTBUF_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "sds/sds.h"
+
+/*
+ * Chunked output buffer
+ * ===
+ * Output kept as a list of chunks instead of one growing sds, so that nothing written is copied again
+ * until it is flattened or handed to writev as is.
+ * A chunk is either an sds owned by the buffer, a borrowed fragment, which must outlive it,
+ * or a shared one, whose owner is released once the buffer is done with it.
+ */
+
+struct outbuf_owner {
+    void (*release)(void *ptr); // NULL if borrowed
+    void *ptr;
+};
+
+struct outbuf {
+    struct iovec *iov;
+    struct outbuf_owner *owners; // owners[i] is what is behind iov[i]
+    size_t count;
+    size_t capacity;
+    size_t len; // in bytes
+};
+
+void outbuf_init(struct outbuf *ob);
+void outbuf_remove(struct outbuf *ob);
+
+// steals chunk
+void outbuf_push_sds(struct outbuf *ob, sds chunk);
+void outbuf_push_ref(struct outbuf *ob, const char *data, size_t len);
+// release(owner) is called when the chunk is no longer used, e.g. to drop a reference
+void outbuf_push_shared(struct outbuf *ob, const char *data, size_t len, void (*release)(void *owner), void *owner);
+// moves all the chunks of src after those of dst, leaving src empty
+void outbuf_move(struct outbuf *dst, struct outbuf *src);
+
+// appends all the chunks to buf, growing it only once
+sds outbuf_flatten(struct outbuf *ob, sds buf);
+
+#endif // !_OUTBUF_H
@@ -2,6 +2,7 @@
 # define _PINE_H
 #include <stdbool.h>
 #include <setjmp.h>
+#include <sys/uio.h>
 
 #include "uwsgi.h"
 #include "sds/sds.h"
@@ -82,6 +83,7 @@ int pr_header(PineRequest *req, char *key, char* value, size_t value_len);
 int pr_add_content_type(PineRequest *req, char* type);
 int pr_add_content_length(PineRequest *req, size_t content_length);
 int pr_write(PineRequest *req, char* buf, size_t len);
+int pr_writev(PineRequest *req, struct iovec *iov, size_t iov_count);
 int pr_writes(PineRequest *req, char* str);
 
 
@@ -5,6 +5,7 @@
 #include <assert.h>
 
 #include "namugen.h"
+#include "threadpool.h"
 
 #define MAX_HEADING_NUMBER 6
 #define MAX_LIST_STACK_SIZE 32
@@ -200,8 +201,8 @@ char* find_webcolor_by_name(char *name, size_t len) {
 
 static inline struct namuast_inl_container* parse_multiline(char *p, char* border, struct namugen_ctx* ctx);
 
-struct namuast_list* namuast_make_list(int type, struct namuast_inl_container* content) {
-    struct namuast_list* retval = (struct namuast_list*)NEW_NAMUAST(namuast_type_list);
+struct namuast_list* namuast_make_list(struct namugen_ctx *ctx, int type, struct namuast_inl_container* content) {
+    struct namuast_list* retval = (struct namuast_list*)NEW_NAMUAST(ctx->arena, namuast_type_list);
     retval->type = type;
     retval->content = content;
     return retval;
@@ -217,7 +218,7 @@ void _namuast_dtor_list(struct namuast_base *base) {
             RELEASE_NAMUAST(sibling->sublist);
         struct namuast_list* next = sibling->next;
         if (sibling != lt) {
-            free(sibling); // HACK
+            namuast_free(NAMUAST_ARENA(sibling), sibling); // HACK
         }
         sibling = next;
     }
@@ -227,7 +228,10 @@ void _namuast_dtor_list(struct namuast_base *base) {
 struct namuast_table_cell* namuast_add_table_cell(struct namuast_table* table, struct namuast_table_row *row) {
     if (row->col_count >= row->col_size) {
         row->col_size *= 2;
-        row->cols = realloc(row->cols, sizeof(struct namuast_table_cell) * row->col_size);
+        row->cols = namuast_realloc(NAMUAST_ARENA(table),
+                                    row->cols,
+                                    sizeof(struct namuast_table_cell) * row->col_count,
+                                    sizeof(struct namuast_table_cell) * row->col_size);
     }
     struct namuast_table_cell* cell = &row->cols[row->col_count++];
     cell->content = NULL;
@@ -247,18 +251,21 @@ struct namuast_table_cell* namuast_add_table_cell(struct namuast_table* table, s
 struct namuast_table_row* namuast_add_table_row(struct namuast_table* table) {
     if (table->row_count >= table->row_size) {
         table->row_size *= 2;
-        table->rows = realloc(table->rows, sizeof(struct namuast_table_row) * table->row_size);
+        table->rows = namuast_realloc(NAMUAST_ARENA(table),
+                                      table->rows,
+                                      sizeof(struct namuast_table_row) * table->row_count,
+                                      sizeof(struct namuast_table_row) * table->row_size);
     }
     struct namuast_table_row* row = &table->rows[table->row_count++];
     row->col_size = 8;
     row->col_count = 0;
     row->bg_webcolor = NULL;
-    row->cols = calloc(row->col_size, sizeof(struct namuast_table_cell));
+    row->cols = namuast_calloc(NAMUAST_ARENA(table), row->col_size, sizeof(struct namuast_table_cell));
     return row;
 }
 
-struct namuast_table* namuast_make_table() {
-    struct namuast_table* table = (struct namuast_table*)NEW_NAMUAST(namuast_type_table);
+struct namuast_table* namuast_make_table(struct namugen_ctx *ctx) {
+    struct namuast_table* table = (struct namuast_table*)NEW_NAMUAST(ctx->arena, namuast_type_table);
     table->row_size = 8;
     table->row_count = 0;
     table->align = nm_align_none;
@@ -268,11 +275,11 @@ struct namuast_table* namuast_make_table() {
     table->bg_webcolor = NULL;
     table->caption = NULL;
     table->max_col_count = 0;
-    table->rows = calloc(table->row_size, sizeof(struct namuast_table_row));
+    table->rows = namuast_calloc(ctx->arena, table->row_size, sizeof(struct namuast_table_row));
     return table;
 }
 
-void _namuast_dtor_table(struct namuast_base *base) {
+void _namuast_free_table_strings(struct namuast_base *base) {
     struct namuast_table* table = (struct namuast_table*)base;
     size_t row_idx;
     for (row_idx = 0; row_idx < table->row_count; row_idx++) {
@@ -280,24 +287,37 @@ void _namuast_dtor_table(struct namuast_base *base) {
         size_t col_idx;
         for (col_idx = 0; col_idx < row->col_count; col_idx++) {
             struct namuast_table_cell *cell = &row->cols[col_idx];
-            if (cell->content) {
-                RELEASE_NAMUAST(cell->content);
-            }
             if (cell->bg_webcolor) sdsfree(cell->bg_webcolor);
             if (cell->width) sdsfree(cell->width);
             if (cell->height) sdsfree(cell->height);
         }
         if (row->bg_webcolor) sdsfree(row->bg_webcolor);
-        free(row->cols);
     }
     if (table->border_webcolor) sdsfree(table->border_webcolor);
     if (table->width) sdsfree(table->width);
     if (table->height) sdsfree(table->height);
     if (table->bg_webcolor) sdsfree(table->bg_webcolor);
+}
+
+void _namuast_dtor_table(struct namuast_base *base) {
+    struct namuast_table* table = (struct namuast_table*)base;
+    _namuast_free_table_strings(base);
+    size_t row_idx;
+    for (row_idx = 0; row_idx < table->row_count; row_idx++) {
+        struct namuast_table_row *row = &table->rows[row_idx];
+        size_t col_idx;
+        for (col_idx = 0; col_idx < row->col_count; col_idx++) {
+            struct namuast_table_cell *cell = &row->cols[col_idx];
+            if (cell->content) {
+                RELEASE_NAMUAST(cell->content);
+            }
+        }
+        namuast_free(NAMUAST_ARENA(table), row->cols);
+    }
     if (table->caption) {
         RELEASE_NAMUAST(table->caption);
     }
-    free(table->rows);
+    namuast_free(NAMUAST_ARENA(table), table->rows);
 }
 
 char* dup_str(char *st, char *ed) {
@@ -519,9 +539,7 @@ static inline bool parse_table_cell(struct namugen_ctx *ctx, char *p, char *bord
     while (EQ(testp, border, '<')) {
         testp++; // consume '<'
         char* ctrl_st = testp;
-        UNTIL_REACHING1(testp, border, '>') {
-            testp++;
-        }
+        SKIP_UNTIL1(testp, border, '>');
         if (!MET_EOF(testp, border)) {
             table_use_cell_ctrl(ctrl_st, testp, table, row, cell);
             testp++; // consume '>'
@@ -533,10 +551,11 @@ static inline bool parse_table_cell(struct namugen_ctx *ctx, char *p, char *bord
 
     content_start_p = content_end_p = testp;
     while (1) {
+        SKIP_UNTIL1(testp, border, '|');
         if (MET_EOF(testp, border)) {
             return false;
         }
-        if (EQ(testp + 1, border, '|') && *testp == '|') {
+        if (EQ(testp + 1, border, '|')) {
             content_end_p = testp;
             testp += 2;
             break;
@@ -562,16 +581,14 @@ static struct namuast_table* parse_table(char* p, char* border, char **p_out, st
      */
     testp++; // consume '|'
     caption_start = testp;
-    UNTIL_REACHING2(testp, border, '|', '\n') {
-        testp++;
-    }
+    SKIP_UNTIL2(testp, border, '|', '\n');
     if (MET_EOF(testp, border) || *testp == '\n') {
         return NULL; 
     }
     caption_end = testp;
     testp++; // consume '|'
 
-    struct namuast_table* table = namuast_make_table();
+    struct namuast_table* table = namuast_make_table(ctx);
     if (caption_start < caption_end) {
         table->caption = parse_multiline(caption_start, caption_end, ctx);
     }
@@ -608,9 +625,7 @@ bool scn_parse_block(char *p, char *border, char **p_out, struct nm_block_emitte
         char *content_end_p;
         bool closing_braces_found = true;
         while (1) {
-            UNTIL_REACHING1(lastp, border, '}') {
-                lastp++;
-            }
+            SKIP_UNTIL1(lastp, border, '}');
             if (MET_EOF(lastp, border)) {
                 content_end_p = lastp;
                 closing_braces_found  = false;
@@ -634,7 +649,7 @@ bool scn_parse_block(char *p, char *border, char **p_out, struct nm_block_emitte
                         testp++;
                         CONSUME_WHITESPACE(testp, border);
                         RCONSUME_SPACETAB(testp, border);
-                        namuast_inl_container *content = scn_parse_inline(make_inl_container(), testp, content_end_p, &testp, ctx);
+                        namuast_inl_container *content = scn_parse_inline(namuast_make_inline(ctx), testp, content_end_p, &testp, ctx);
                         if (ops->emit_highlighted_block(ctx, container, content, highlight_level)) {
                             *p_out = lastp;
                             return true;
@@ -644,9 +659,7 @@ bool scn_parse_block(char *p, char *border, char **p_out, struct nm_block_emitte
             } else if (EQ(testp, border, '#')) {
                 testp++;
                 char *color_st = testp;
-                UNTIL_REACHING3(testp, border, ' ', '\n', '\t') {
-                    testp++;
-                }
+                SKIP_UNTIL3(testp, border, ' ', '\n', '\t');
                 char *color_ed = testp;
                 if (EQSTR(color_st, color_ed, "!html")) {
                     if (ops->emit_html) {
@@ -675,7 +688,7 @@ bool scn_parse_block(char *p, char *border, char **p_out, struct nm_block_emitte
                     }
                     CONSUME_SPACETAB(testp, content_end_p);
                     RCONSUME_SPACETAB(testp, content_end_p);
-                    struct namuast_inl_container *content = scn_parse_inline(make_inl_container(), testp, content_end_p, &testp, ctx);
+                    struct namuast_inl_container *content = scn_parse_inline(namuast_make_inline(ctx), testp, content_end_p, &testp, ctx);
                     if (ops->emit_colored_block(ctx, container, content, webcolor)) {
                         *p_out = lastp;
                         return true;
@@ -766,7 +779,7 @@ void scn_parse_link_content(char *p, char* border, char* pipe_pos, struct namuge
     if (pipe_pos) {
         char *rpipe_pos = pipe_pos + 1;
         CONSUME_SPACETAB(rpipe_pos, border);
-        alias_subinl = scn_parse_inline(make_inl_container(), rpipe_pos, border, &dummy, ctx);
+        alias_subinl = scn_parse_inline(namuast_make_inline(ctx), rpipe_pos, border, &dummy, ctx);
     }
     char* lpipe_pos = pipe_pos? pipe_pos : border;
     RCONSUME_SPACETAB(p, lpipe_pos);
@@ -810,7 +823,7 @@ void scn_parse_link_content(char *p, char* border, char* pipe_pos, struct namuge
             if (alias_subinl) {
                 RELEASE_NAMUAST(alias_subinl);
             }
-            alias_subinl = scn_parse_inline(make_inl_container(), testp, lpipe_pos, &dummy, ctx);
+            alias_subinl = scn_parse_inline(namuast_make_inline(ctx), testp, lpipe_pos, &dummy, ctx);
         }
         if (use_wiki || use_dquote) {
             emit_internal_link(link_st, link_ed, alias_subinl, container, ctx);
@@ -876,7 +889,7 @@ static inline bool parse_list_header (char *p, char *border, char **content_st_o
 }
 
 static inline struct namuast_inl_container* parse_multiline(char *p, char* border, struct namugen_ctx* ctx) {
-    struct namuast_inl_container *container = make_inl_container();
+    struct namuast_inl_container *container = namuast_make_inline(ctx);
     scn_parse_inline(container, p, border, &p, ctx);
 
     UNTIL_NOT_REACHING1(p, border, '\n') {
@@ -923,9 +936,7 @@ static inline char* namu_scan_main(char *p, char* border, struct namugen_ctx* ct
             UNTIL_REACHING1(testp, border, '\n') {
                 cls_num = 0;
                 content_end_p = NULL;
-                UNTIL_REACHING2(testp, border, '=', '\n') {
-                    testp++;
-                }
+                SKIP_UNTIL2(testp, border, '=', '\n');
                 if (MET_EOF(testp, border) || *testp == '\n') {
                     break;
                 }
@@ -942,7 +953,7 @@ static inline char* namu_scan_main(char *p, char* border, struct namugen_ctx* ct
                 // verbose_log("emit heading%d, %s:%s \n", h_num, content_start_p, content_end_p);
                 CONSUME_IF_ENDL(lastp, border);
                 char *dummy;
-                struct namuast_inl_container *content = scn_parse_inline(make_inl_container(), content_start_p, content_end_p, &dummy, ctx);
+                struct namuast_inl_container *content = scn_parse_inline(namuast_make_inline(ctx), content_start_p, content_end_p, &dummy, ctx);
                 nm_emit_heading(ctx, h_num, content);
                 return lastp;
             } else 
@@ -962,9 +973,7 @@ static inline char* namu_scan_main(char *p, char* border, struct namugen_ctx* ct
     case '#':
         if (EQ(p + 1, border, '#')) {
             char *testp = p + 2;
-            UNTIL_REACHING1(testp, border, '\n') {
-                testp++;
-            }
+            SKIP_UNTIL1(testp, border, '\n');
             SAFE_INC(testp, border); // consume \n
             return testp;
         }
@@ -972,7 +981,7 @@ static inline char* namu_scan_main(char *p, char* border, struct namugen_ctx* ct
     case '>':
         // quotation
         {
-            struct namuast_inl_container *container = make_inl_container();
+            struct namuast_inl_container *container = namuast_make_inline(ctx);
             char *testp = p;
             while (testp < border && *testp == '>') {
                 UNTIL_NOT_REACHING1(testp, border, '>') {
@@ -1030,7 +1039,7 @@ static inline char* namu_scan_main(char *p, char* border, struct namugen_ctx* ct
             int stack_top = 0;
 
             struct namuast_list* result_list;
-#define MAKE_LIST(p, lt) namuast_make_list(lt, scn_parse_inline(make_inl_container(), p, border, &p, ctx))
+#define MAKE_LIST(p, lt) namuast_make_list(ctx, lt, scn_parse_inline(namuast_make_inline(ctx), p, border, &p, ctx))
 #define FLUSH_STACK(ind, dangling_list) { \
     dangling_list = NULL; \
     while (stack_top > 0 && stack[stack_top - 1].indent_level > ind)  { \
@@ -1101,7 +1110,7 @@ static inline char* namu_scan_main(char *p, char* border, struct namugen_ctx* ct
     }
 
     char *retval;
-    nm_emit_inline(ctx, scn_parse_inline(make_inl_container(), p, border, &retval, ctx));
+    nm_emit_inline(ctx, scn_parse_inline(namuast_make_inline(ctx), p, border, &retval, ctx));
     // verbose_log("inline chunk: ");
     // verbose_str(p, retval);
     return retval;
@@ -1116,3 +1125,103 @@ void namugen_scan(struct namugen_ctx *ctx, char *buffer, size_t len) {
     }
     nm_on_finish(ctx);
 }
+
+/*
+ * Parallel scan
+ * Segments are cut at line starts that don't look like they continue a block, but that is only a guess.
+ * Each segment is scanned until it reaches the start of the next one, so that a block may run over it as it does in namugen_scan.
+ * A cut is right if the scan of the segment before stops exactly on it, as namu_scan_main depends on nothing but the position then.
+ * Otherwise the segment is scanned again from where the one before has stopped.
+ */
+struct scan_segment {
+    struct threadpool_task task; // first, so that the task is the segment
+    char *st;
+    char *stop_at; // the start of the next segment
+    char *ed; // where the scan has stopped, at or past stop_at
+    char *border;
+    namugen_ctx ctx;
+};
+
+static void scan_segment(struct threadpool_task *task) {
+    struct scan_segment *seg = (struct scan_segment *)task;
+    char *p = seg->st;
+    while (p < seg->stop_at) {
+        p = namu_scan_main(p, seg->border, &seg->ctx);
+    }
+    seg->ed = p;
+}
+
+static bool is_cut_candidate(char *line, char *border) {
+    // lists, quotations and tables go on over lines, and the others start a block by themselves
+    return !MET_EOF(line, border) && *line != ' ' && *line != '>' && *line != '|';
+}
+
+// a line start after p to cut at, preferring one after an empty line, or border.
+// p is never the start of the buffer
+static char* find_cut(char *p, char *border) {
+    char *limit = border - p > NAMUGEN_SEGMENT_SIZE / 4? p + NAMUGEN_SEGMENT_SIZE / 4 : border;
+    char *fallback = NULL;
+    while (p < limit) {
+        char *nl = memchr(p, '\n', border - p);
+        if (!nl)
+            break;
+        p = nl + 1;
+        if (!is_cut_candidate(p, border))
+            continue;
+        if (*(nl - 1) == '\n')
+            return p;
+        if (!fallback)
+            fallback = p;
+    }
+    return fallback? fallback : border;
+}
+
+void namugen_scan_parallel(struct namugen_ctx *ctx, char *buffer, size_t len, struct threadpool *pool) {
+    size_t max_segments = pool? pool->thread_count * NAMUGEN_SEGMENTS_PER_THREAD : 0;
+    size_t segment_count = len / NAMUGEN_SEGMENT_SIZE;
+    if (segment_count > max_segments)
+        segment_count = max_segments;
+    if (segment_count < 2) {
+        namugen_scan(ctx, buffer, len);
+        return;
+    }
+
+    char *border = buffer + len;
+    struct scan_segment *segs = calloc(segment_count, sizeof(struct scan_segment));
+    size_t seg_cnt = 0;
+    char *p = buffer;
+    while (seg_cnt < segment_count && p < border) {
+        struct scan_segment *seg = &segs[seg_cnt];
+        seg->st = p;
+        seg->border = border;
+        if (seg_cnt + 1 < segment_count) {
+            char *target = buffer + len / segment_count * (seg_cnt + 1);
+            seg->stop_at = find_cut(target > p? target : p, border);
+        } else
+            seg->stop_at = border;
+        namugen_init_segment(&seg->ctx, ctx);
+        seg->task.run = scan_segment;
+        threadpool_submit(pool, &seg->task);
+        p = seg->stop_at;
+        seg_cnt++;
+    }
+
+    nm_on_start(ctx);
+    p = buffer;
+    size_t idx;
+    for (idx = 0; idx < seg_cnt; idx++) {
+        struct scan_segment *seg = &segs[idx];
+        threadpool_wait(pool, &seg->task);
+        if (seg->st != p) {
+            // a block of the one before has run over the cut
+            namugen_remove(&seg->ctx);
+            namugen_init_segment(&seg->ctx, ctx);
+            seg->st = p;
+            scan_segment(&seg->task);
+        }
+        p = seg->ed;
+        namugen_merge_segment(ctx, &seg->ctx);
+    }
+    nm_on_finish(ctx);
+    free(segs);
+}
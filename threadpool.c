@@ -0,0 +1,90 @@
+#include <stdlib.h>
+
+#include "threadpool.h"
+
+static void* thread_main(void *arg) {
+    struct threadpool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (list_empty(&pool->queue) && !pool->stopping)
+            pthread_cond_wait(&pool->task_queued, &pool->lock);
+        if (list_empty(&pool->queue))
+            break;
+        struct threadpool_task *task = list_entry(list_pop_front(&pool->queue), struct threadpool_task, elem);
+        task->queued = false;
+        pthread_mutex_unlock(&pool->lock);
+
+        task->run(task);
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = true;
+        pthread_cond_broadcast(&pool->task_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct threadpool* threadpool_new(int thread_count) {
+    struct threadpool *pool = calloc(1, sizeof(struct threadpool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->task_queued, NULL);
+    pthread_cond_init(&pool->task_done, NULL);
+    list_init(&pool->queue);
+    pool->stopping = false;
+    pool->threads = calloc(thread_count, sizeof(pthread_t));
+
+    int idx;
+    for (idx = 0; idx < thread_count; idx++) {
+        if (pthread_create(&pool->threads[idx], NULL, thread_main, pool))
+            break;
+    }
+    pool->thread_count = idx;
+    if (pool->thread_count == 0) {
+        threadpool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void threadpool_free(struct threadpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->task_queued);
+    pthread_mutex_unlock(&pool->lock);
+
+    int idx;
+    for (idx = 0; idx < pool->thread_count; idx++) {
+        pthread_join(pool->threads[idx], NULL);
+    }
+    pthread_cond_destroy(&pool->task_done);
+    pthread_cond_destroy(&pool->task_queued);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+void threadpool_submit(struct threadpool *pool, struct threadpool_task *task) {
+    task->done = false;
+    pthread_mutex_lock(&pool->lock);
+    task->queued = true;
+    list_push_back(&pool->queue, &task->elem);
+    pthread_cond_signal(&pool->task_queued);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void threadpool_wait(struct threadpool *pool, struct threadpool_task *task) {
+    pthread_mutex_lock(&pool->lock);
+    if (task->queued) {
+        list_remove(&task->elem);
+        task->queued = false;
+        pthread_mutex_unlock(&pool->lock);
+
+        task->run(task);
+        task->done = true;
+        return;
+    }
+    while (!task->done)
+        pthread_cond_wait(&pool->task_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,45 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "list.h"
+
+/*
+ * Fixed pool of threads running submitted tasks
+ * ===
+ * Tasks are owned by whoever submits them, and must stay alive until threadpool_wait returns on them.
+ * Waiting on a task that no thread has picked up yet runs it in the waiting thread instead,
+ * so that the submitter never sits idle behind tasks of others.
+ */
+
+struct threadpool_task {
+    void (*run)(struct threadpool_task *task);
+
+    /* managed by the pool */
+    struct list_elem elem;
+    bool queued;
+    bool done;
+};
+
+struct threadpool {
+    pthread_mutex_t lock;
+    pthread_cond_t task_queued;
+    pthread_cond_t task_done;
+    struct list queue;
+    bool stopping;
+
+    pthread_t *threads;
+    int thread_count;
+};
+
+// NULL if no thread could be started
+struct threadpool* threadpool_new(int thread_count);
+// waits for the threads after running what is left in the queue
+void threadpool_free(struct threadpool *pool);
+
+void threadpool_submit(struct threadpool *pool, struct threadpool_task *task);
+void threadpool_wait(struct threadpool *pool, struct threadpool_task *task);
+
+#endif // !_THREADPOOL_H
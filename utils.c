@@ -193,6 +193,10 @@ int pr_write(PineRequest *req, char* buf, size_t len) {
     return uwsgi_response_write_body_do(req->wsgi_req, buf, len);
 }
 
+int pr_writev(PineRequest *req, struct iovec *iov, size_t iov_count) {
+    return uwsgi_response_writev_body_do(req->wsgi_req, iov, iov_count);
+}
+
 int pr_writes(PineRequest *req, char* str) {
     return pr_write(req, str, strlen(str));
 }
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "whitelist.h"
+
+const char *allowed_tags[] = {
+    "p", 
+    "pre", 
+    "blockquote", 
+    "ul", 
+    "div", 
+    "a", 
+    "em", 
+    "strong", 
+    "s", 
+    "sub", 
+    "i", 
+    "b", 
+    "u", 
+    "ruby", 
+    "rt", 
+    "rp", 
+    "span", 
+    "br", 
+    "ins", 
+    "del", 
+    "img", 
+    "iframe", 
+    "embed", 
+    "object", 
+    "param", 
+    "video",
+    0
+};
+
+static const unsigned char allowed_tag_flag_table[] = {
+    HTML_TAG_BLOCK | HTML_TAG_PARAGRAPH, // p
+    HTML_TAG_BLOCK, // pre
+    HTML_TAG_BLOCK, // blockquote
+    HTML_TAG_BLOCK, // ul
+    HTML_TAG_BLOCK, // div
+    0, // a
+    HTML_TAG_FORMATTING, HTML_TAG_FORMATTING, HTML_TAG_FORMATTING, HTML_TAG_FORMATTING, // em, strong, s, sub
+    HTML_TAG_FORMATTING, HTML_TAG_FORMATTING, HTML_TAG_FORMATTING, // i, b, u
+    0, 0, 0, // ruby, rt, rp
+    HTML_TAG_FORMATTING, // span
+    HTML_TAG_VOID, // br
+    HTML_TAG_FORMATTING, HTML_TAG_FORMATTING, // ins, del
+    HTML_TAG_VOID, // img
+    0, // iframe
+    HTML_TAG_VOID, // embed
+    0, // object
+    HTML_TAG_VOID, // param
+    0 // video
+};
+
+const char *allowed_attributes[] = {
+    "href",
+    "src",
+    "style",
+    "class",
+    "width",
+    "height", 
+    "alt", 
+    "align",
+    0
+};
+
+// sorted by strcmp, for is_html_entity_name. &apos; is there too, as tidy knows it
+static const char *html_entity_names[] = {
+    "AElig", "Aacute", "Acirc", "Agrave", "Alpha", "Aring", "Atilde", "Auml", "Beta", "Ccedil", "Chi",
+    "Dagger", "Delta", "ETH", "Eacute", "Ecirc", "Egrave", "Epsilon", "Eta", "Euml", "Gamma", "Iacute",
+    "Icirc", "Igrave", "Iota", "Iuml", "Kappa", "Lambda", "Mu", "Ntilde", "Nu", "OElig", "Oacute", "Ocirc",
+    "Ograve", "Omega", "Omicron", "Oslash", "Otilde", "Ouml", "Phi", "Pi", "Prime", "Psi", "Rho", "Scaron",
+    "Sigma", "THORN", "Tau", "Theta", "Uacute", "Ucirc", "Ugrave", "Upsilon", "Uuml", "Xi", "Yacute", "Yuml",
+    "Zeta", "aacute", "acirc", "acute", "aelig", "agrave", "alefsym", "alpha", "amp", "and", "ang", "apos",
+    "aring", "asymp", "atilde", "auml", "bdquo", "beta", "brvbar", "bull", "cap", "ccedil", "cedil", "cent",
+    "chi", "circ", "clubs", "cong", "copy", "crarr", "cup", "curren", "dArr", "dagger", "darr", "deg",
+    "delta", "diams", "divide", "eacute", "ecirc", "egrave", "empty", "emsp", "ensp", "epsilon", "equiv",
+    "eta", "eth", "euml", "euro", "exist", "fnof", "forall", "frac12", "frac14", "frac34", "frasl", "gamma",
+    "ge", "gt", "hArr", "harr", "hearts", "hellip", "iacute", "icirc", "iexcl", "igrave", "image", "infin",
+    "int", "iota", "iquest", "isin", "iuml", "kappa", "lArr", "lambda", "lang", "laquo", "larr", "lceil",
+    "ldquo", "le", "lfloor", "lowast", "loz", "lrm", "lsaquo", "lsquo", "lt", "macr", "mdash", "micro",
+    "middot", "minus", "mu", "nabla", "nbsp", "ndash", "ne", "ni", "not", "notin", "nsub", "ntilde", "nu",
+    "oacute", "ocirc", "oelig", "ograve", "oline", "omega", "omicron", "oplus", "or", "ordf", "ordm",
+    "oslash", "otilde", "otimes", "ouml", "para", "part", "permil", "perp", "phi", "pi", "piv", "plusmn",
+    "pound", "prime", "prod", "prop", "psi", "quot", "rArr", "radic", "rang", "raquo", "rarr", "rceil",
+    "rdquo", "real", "reg", "rfloor", "rho", "rlm", "rsaquo", "rsquo", "sbquo", "scaron", "sdot", "sect",
+    "shy", "sigma", "sigmaf", "sim", "spades", "sub", "sube", "sum", "sup", "sup1", "sup2", "sup3", "supe",
+    "szlig", "tau", "there4", "theta", "thetasym", "thinsp", "thorn", "tilde", "times", "trade", "uArr",
+    "uacute", "uarr", "ucirc", "ugrave", "uml", "upsih", "upsilon", "uuml", "weierp", "xi", "yacute", "yen",
+    "yuml", "zeta", "zwj", "zwnj",
+};
+
+const char *allowed_link_schema [] = {
+    "http://",
+    "https://",
+    "//", 
+    "/",
+    0
+};
+
+/*
+ * Perfect hashes
+ * slot = (len * K1 + first * K2 + last * K3) mod size, with the characters in lower case.
+ * The constants were searched offline for the smallest power-of-two table without collisions,
+ * and have to be searched again whenever a whitelist changes.
+ */
+#define LOWER(c) ((unsigned char)(c) | 0x20)
+#define PERFECT_HASH(name, len, k1, k2, k3, size) \
+    (((len) * (k1) + LOWER((name)[0]) * (k2) + LOWER((name)[(len) - 1]) * (k3)) & ((size) - 1))
+
+// K1 = 1, K2 = 5, K3 = 42
+static const signed char tag_slots[64] = {
+    -1, -1, -1,  3, 14,  1,  2, -1, 10, 25, -1, -1, -1, -1, -1, 16,
+     5,  0, -1,  4, -1, -1,  9, 24, 13, -1, -1, -1, 15,  6,  8, -1,
+    17, -1, -1, -1, -1, 21, 22, -1, -1, -1, -1,  7, -1, -1, 18, 19,
+    -1, -1, -1, -1, -1, -1, 20, -1, -1, 23, -1, -1, 12, -1, -1, 11,
+};
+
+// K1 = 1, K2 = 1, K3 = 5
+static const signed char attribute_slots[16] = {
+    -1,  2,  5, -1,  4,  1, -1,  3,  6, -1,  0, -1,  7, -1, -1, -1,
+};
+
+// the longest names of allowed_tags and allowed_attributes
+#define MAX_TAG_LEN 10
+#define MAX_ATTRIBUTE_LEN 6
+
+int find_allowed_tag(const char *name, size_t len) {
+    if (len == 0 || len > MAX_TAG_LEN)
+        return -1;
+    int tag = tag_slots[PERFECT_HASH(name, len, 1, 5, 42, 64)];
+    if (tag < 0 || strlen(allowed_tags[tag]) != len || strncasecmp(allowed_tags[tag], name, len))
+        return -1;
+    return tag;
+}
+
+int allowed_tag_flags(int tag) {
+    return allowed_tag_flag_table[tag];
+}
+
+int find_allowed_attribute(const char *name, size_t len) {
+    if (len == 0 || len > MAX_ATTRIBUTE_LEN)
+        return -1;
+    int attr = attribute_slots[PERFECT_HASH(name, len, 1, 1, 5, 16)];
+    if (attr < 0 || strlen(allowed_attributes[attr]) != len || strncasecmp(allowed_attributes[attr], name, len))
+        return -1;
+    return attr;
+}
+
+bool has_allowed_link_schema(const char *p, size_t len) {
+    if (len == 0)
+        return false;
+    switch (p[0]) {
+    case '/':
+        // "//" and "/"
+        return true;
+    case 'h':
+    case 'H':
+        return (len >= 7 && !strncasecmp(p, "http://", 7)) || (len >= 8 && !strncasecmp(p, "https://", 8));
+    default:
+        return false;
+    }
+}
+
+struct entity_key {
+    const char *name;
+    size_t len;
+};
+
+static int cmp_entity_name(const void *key, const void *elem) {
+    const struct entity_key *k = key;
+    const char *name = *(const char **)elem;
+    int cmp = strncmp(k->name, name, k->len);
+    if (cmp)
+        return cmp;
+    return name[k->len]? -1 : 0;
+}
+
+bool is_html_entity_name(const char *name, size_t len) {
+    struct entity_key key = {name, len};
+    return bsearch(&key, html_entity_names, sizeof(html_entity_names) / sizeof(html_entity_names[0]),
+                   sizeof(const char *), cmp_entity_name) != NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef _WHITELIST_H
+#define _WHITELIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Whitelists of the HTML sanitizer
+ * ===
+ * Tags and attributes are found through perfect hash tables, and link schemas through a switch on the first character.
+ * Names are compared case-insensitively.
+ */
+
+extern const char *allowed_tags[];
+extern const char *allowed_attributes[];
+extern const char *allowed_link_schema[];
+
+enum {
+    HTML_TAG_VOID = 1, // never has content or an end tag
+    HTML_TAG_BLOCK = 2, // ends an open <p>
+    HTML_TAG_PARAGRAPH = 4,
+    HTML_TAG_FORMATTING = 8 // opened again after the end tag of an element around it, as tidy does
+};
+
+// index in allowed_tags, or -1
+int find_allowed_tag(const char *name, size_t len);
+int allowed_tag_flags(int tag);
+// index in allowed_attributes, or -1
+int find_allowed_attribute(const char *name, size_t len);
+// whether the link starts with one of allowed_link_schema
+bool has_allowed_link_schema(const char *p, size_t len);
+// whether name, without '&' and ';', is a character entity of HTML 4. Case-sensitive
+bool is_html_entity_name(const char *name, size_t len);
+
+#endif // !_WHITELIST_H
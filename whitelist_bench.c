@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "whitelist.h"
+
+/*
+ * Compares the former linear whitelist scan with the perfect hash lookups of whitelist.c
+ * ===
+ * whitelist_bench [rounds]
+ */
+
+static const char *names[] = {
+    "p", "DIV", "span", "a", "br", "img", "strong", "Blockquote", "iframe", "video",
+    "script", "style", "table", "td", "font", "onclick", "href", "SRC", "class", "width",
+    0
+};
+
+static int linear_find(const char **list, const char *name, size_t len) {
+    const char **p;
+    for (p = list; *p; p++) {
+        if (strlen(*p) == len && !strncasecmp(*p, name, len))
+            return p - list;
+    }
+    return -1;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    long rounds = argc > 1? atol(argv[1]) : 1000000;
+    size_t lens[sizeof(names) / sizeof(names[0])];
+    int idx, name_cnt = 0;
+    for (idx = 0; names[idx]; idx++) {
+        lens[idx] = strlen(names[idx]);
+        // both have to agree before timing them
+        if (linear_find(allowed_tags, names[idx], lens[idx]) != find_allowed_tag(names[idx], lens[idx]) ||
+            linear_find(allowed_attributes, names[idx], lens[idx]) != find_allowed_attribute(names[idx], lens[idx])) {
+            fprintf(stderr, "Lookups disagree on %s\n", names[idx]);
+            return 1;
+        }
+        name_cnt++;
+    }
+
+    long round;
+    volatile int sink = 0;
+    double st = now();
+    for (round = 0; round < rounds; round++) {
+        for (idx = 0; idx < name_cnt; idx++) {
+            sink += linear_find(allowed_tags, names[idx], lens[idx]);
+            sink += linear_find(allowed_attributes, names[idx], lens[idx]);
+        }
+    }
+    double linear_elapsed = now() - st;
+
+    st = now();
+    for (round = 0; round < rounds; round++) {
+        for (idx = 0; idx < name_cnt; idx++) {
+            sink += find_allowed_tag(names[idx], lens[idx]);
+            sink += find_allowed_attribute(names[idx], lens[idx]);
+        }
+    }
+    double hash_elapsed = now() - st;
+
+    double lookups = (double)rounds * name_cnt * 2;
+    printf("Linear scan: %.2lfns per lookup\n", linear_elapsed * 1e9 / lookups);
+    printf("Perfect hash: %.2lfns per lookup\n", hash_elapsed * 1e9 / lookups);
+    return 0;
+}